@@ -0,0 +1,104 @@
+#include "LogRecord.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+const char BINARY_MAGIC[8] = {'M', 'I', 'L', 'O', 'G', '1', '\n', '\0'};
+
+template <typename T>
+static void put(string &out, T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+static bool get(const char *&data, const char *end, T &value) {
+    if (static_cast<size_t>(end - data) < sizeof(value)) {
+        return false;
+    }
+    memcpy(&value, data, sizeof(value));
+    data += sizeof(value);
+    return true;
+}
+
+// 0 for anything that is not an IPv4 address, which renders as 0.0.0.0
+static uint32_t pack_ip(const string &ip) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, ip.c_str(), &addr) != 1) {
+        return 0;
+    }
+    return addr.s_addr;
+}
+
+static string unpack_ip(uint32_t packed) {
+    struct in_addr addr;
+    addr.s_addr = packed;
+    char buf[INET_ADDRSTRLEN];
+    return inet_ntop(AF_INET, &addr, buf, sizeof(buf)) ? string(buf) : string();
+}
+
+void ChunkRecord::encode(string &out) const {
+    put(out, pack_ip(client_ip));
+    put(out, pack_ip(server_ip));
+    put(out, duration);
+    put(out, tput);
+    put(out, avg_tput);
+    put(out, static_cast<int32_t>(bitrate));
+    put(out, static_cast<uint8_t>(tcp_info));
+    if (tcp_info) {
+        put(out, delivery_rate);
+        put(out, rtt);
+        put(out, cwnd);
+    }
+    uint16_t name_len = static_cast<uint16_t>(min(chunkname.size(), static_cast<size_t>(UINT16_MAX)));
+    put(out, name_len);
+    out.append(chunkname, 0, name_len);
+}
+
+bool ChunkRecord::decode(const char *data, size_t size, ChunkRecord &record) {
+    const char *end = data + size;
+    uint32_t client = 0;
+    uint32_t server = 0;
+    int32_t bitrate = 0;
+    uint8_t tcp_info = 0;
+    uint16_t name_len = 0;
+    if (!get(data, end, client) || !get(data, end, server) || !get(data, end, record.duration) ||
+        !get(data, end, record.tput) || !get(data, end, record.avg_tput) || !get(data, end, bitrate) ||
+        !get(data, end, tcp_info)) {
+        return false;
+    }
+    record.tcp_info = tcp_info != 0;
+    if (record.tcp_info &&
+        (!get(data, end, record.delivery_rate) || !get(data, end, record.rtt) || !get(data, end, record.cwnd))) {
+        return false;
+    }
+    if (!get(data, end, name_len) || static_cast<size_t>(end - data) != name_len) {
+        return false;
+    }
+    record.client_ip = unpack_ip(client);
+    record.server_ip = unpack_ip(server);
+    record.bitrate = bitrate;
+    record.chunkname.assign(data, name_len);
+    return true;
+}
+
+string ChunkRecord::render() const {
+    // the default stream formatting, which the log has always used
+    ostringstream line;
+    line << client_ip << " " << chunkname << " " << server_ip << " " << duration << " " << tput << " " << avg_tput
+         << " " << bitrate;
+    if (tcp_info) {
+        line << " " << delivery_rate << " " << rtt << " " << cwnd;
+    }
+    return line.str();
+}
+
+void append_binary_record(string &out, RecordType type, const char *payload, size_t size) {
+    put(out, static_cast<uint8_t>(type));
+    put(out, static_cast<uint32_t>(size));
+    out.append(payload, size);
+}
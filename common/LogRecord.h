@@ -0,0 +1,51 @@
+#ifndef LOGRECORD_H
+#define LOGRECORD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * The records the logger carries from the threads that log to its writer,
+ * and the compact form they are stored in by binary logs.
+ *
+ * A binary log starts with BINARY_MAGIC, followed by the records, each as
+ * its type (1 byte), the size of its payload (4 bytes) and the payload, all
+ * in host byte order. logdecode renders such a log back to text.
+ */
+enum class RecordType : uint8_t {
+    Text = 1,  // a line, without its newline
+    Chunk = 2,  // a ChunkRecord
+};
+
+extern const char BINARY_MAGIC[8];
+
+// One line of the miProxy log, for a fragment fetched from a web server.
+struct ChunkRecord {
+    std::string client_ip;
+    std::string chunkname;
+    std::string server_ip;
+    float duration = 0;  // seconds
+    double tput = 0;  // kbps
+    double avg_tput = 0;  // kbps
+    int bitrate = 0;  // kbps
+    // the --tcp-info fields, rendered only if tcp_info is set
+    bool tcp_info = false;
+    double delivery_rate = 0;  // kbps
+    float rtt = 0;  // ms
+    uint32_t cwnd = 0;
+
+    // appends the compact form to out: the ips as 4 bytes each, the numbers
+    // as they are and the chunkname with its length in front
+    void encode(std::string &out) const;
+    // false if data is not an encoded record
+    static bool decode(const char *data, size_t size, ChunkRecord &record);
+    // <browser-ip> <chunkname> <server-ip> <duration> <tput> <avg-tput> <bitrate>,
+    // and <delivery-rate> <min-rtt> <cwnd> with tcp_info
+    std::string render() const;
+};
+
+// Appends the framed record to a binary log.
+void append_binary_record(std::string &out, RecordType type, const char *payload, size_t size);
+
+#endif
@@ -0,0 +1,283 @@
+#include "Logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+using namespace std;
+
+// How long the writer sleeps when it found nothing to write, and how long a
+// thread waits for it to make room or to flush.
+static const chrono::milliseconds IDLE_SLEEP(1);
+static const chrono::microseconds WAIT_SLEEP(100);
+
+static const size_t RING_CAPACITY = 1 << 20;  // bytes per thread
+static const size_t MAX_RECORD = RING_CAPACITY / 4;  // longer text is cut
+
+// what precedes every record in a ring
+struct RecordHeader {
+    uint32_t size;  // of the payload
+    uint16_t sink;
+    uint8_t type;
+    uint8_t level;
+};
+
+// Written by its thread only and read by the writer only. head and tail
+// count bytes since the start, so tail - head is what is in use.
+struct Logger::Ring {
+    unique_ptr<char[]> data{new char[RING_CAPACITY]};
+    char pad0[64];  // keeps the positions off each other's cache line
+    atomic<uint64_t> head{0};  // advanced by the writer
+    char pad1[64];
+    atomic<uint64_t> tail{0};  // advanced by the thread
+    char pad2[64];
+    atomic<uint64_t> written{0};  // everything before it is written out
+
+    size_t space(uint64_t t) const { return RING_CAPACITY - static_cast<size_t>(t - head.load(memory_order_acquire)); }
+
+    void copy_in(uint64_t pos, const void *src, size_t n) {
+        size_t offset = static_cast<size_t>(pos % RING_CAPACITY);
+        size_t first = min(n, RING_CAPACITY - offset);
+        memcpy(data.get() + offset, src, first);
+        memcpy(data.get(), static_cast<const char *>(src) + first, n - first);
+    }
+
+    void copy_out(uint64_t pos, void *dst, size_t n) const {
+        size_t offset = static_cast<size_t>(pos % RING_CAPACITY);
+        size_t first = min(n, RING_CAPACITY - offset);
+        memcpy(dst, data.get() + offset, first);
+        memcpy(static_cast<char *>(dst) + first, data.get(), n - first);
+    }
+};
+
+Logger &Logger::get() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger()
+    : min_level(0),
+      rings_version(0),
+      sink_count(1),
+      stopping(false),
+      records_written(0),
+      write_calls(0),
+      dropped_records(0),
+      waited_records(0) {
+    sinks[CONSOLE].fd = STDOUT_FILENO;
+    writer = thread([this]() { run(); });
+}
+
+Logger::~Logger() {
+    stopping.store(true, memory_order_release);
+    writer.join();
+    for (size_t i = 1; i < sink_count.load(memory_order_acquire); ++i) {
+        close(sinks[i].fd);
+    }
+}
+
+Logger::Sink Logger::open(const string &path, Format format) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw runtime_error("Error: could not open log " + path + ": " + strerror(errno));
+    }
+    lock_guard<std::mutex> lock(mutex);
+    size_t index = sink_count.load(memory_order_relaxed);
+    if (index == MAX_SINKS) {
+        close(fd);
+        throw runtime_error("Error: too many logs");
+    }
+    sinks[index].fd = fd;
+    sinks[index].format = format;
+    if (format == Format::Binary) {
+        sinks[index].batch.assign(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    }
+    // the writer only looks at sinks below sink_count
+    sink_count.store(index + 1, memory_order_release);
+    return static_cast<Sink>(index);
+}
+
+void Logger::text(Sink sink, LogLevel level, const string &line) {
+    append(sink, RecordType::Text, level, line.data(), line.size());
+}
+
+void Logger::chunk(Sink sink, const ChunkRecord &record) {
+    thread_local string encoded;
+    encoded.clear();
+    record.encode(encoded);
+    append(sink, RecordType::Chunk, LogLevel::Info, encoded.data(), encoded.size());
+}
+
+Logger::Ring &Logger::ring() {
+    // the ring outlives its thread in rings, so the writer still drains it
+    thread_local shared_ptr<Ring> mine;
+    if (!mine) {
+        mine = make_shared<Ring>();
+        lock_guard<std::mutex> lock(mutex);
+        rings.push_back(mine);
+        rings_version.fetch_add(1, memory_order_release);
+    }
+    return *mine;
+}
+
+void Logger::append(Sink sink, RecordType type, LogLevel level, const char *payload, size_t size) {
+    Ring &r = ring();
+    if (type == RecordType::Text) {
+        size = min(size, MAX_RECORD);
+    } else if (size > MAX_RECORD) {
+        return;
+    }
+    RecordHeader header = {static_cast<uint32_t>(size), sink, static_cast<uint8_t>(type),
+                           static_cast<uint8_t>(level)};
+    size_t need = sizeof(header) + size;
+    uint64_t tail = r.tail.load(memory_order_relaxed);
+    if (r.space(tail) < need) {
+        if (level == LogLevel::Debug || stopping.load(memory_order_acquire)) {
+            dropped_records.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        waited_records.fetch_add(1, memory_order_relaxed);
+        while (r.space(tail) < need) {
+            this_thread::sleep_for(WAIT_SLEEP);
+        }
+    }
+    r.copy_in(tail, &header, sizeof(header));
+    r.copy_in(tail + sizeof(header), payload, size);
+    r.tail.store(tail + need, memory_order_release);
+}
+
+void Logger::flush() {
+    vector<pair<shared_ptr<Ring>, uint64_t>> targets;
+    {
+        lock_guard<std::mutex> lock(mutex);
+        for (auto &r : rings) {
+            targets.emplace_back(r, r->tail.load(memory_order_acquire));
+        }
+    }
+    for (auto &target : targets) {
+        while (target.first->written.load(memory_order_acquire) < target.second) {
+            this_thread::sleep_for(WAIT_SLEEP);
+        }
+    }
+}
+
+Logger::Stats Logger::stats() const {
+    Stats stats;
+    stats.records = records_written.load(memory_order_relaxed);
+    stats.writes = write_calls.load(memory_order_relaxed);
+    stats.dropped = dropped_records.load(memory_order_relaxed);
+    stats.waits = waited_records.load(memory_order_relaxed);
+    return stats;
+}
+
+void Logger::run() {
+    vector<shared_ptr<Ring>> snapshot;
+    uint64_t version = 0;
+    while (true) {
+        if (rings_version.load(memory_order_acquire) != version) {
+            lock_guard<std::mutex> lock(mutex);
+            snapshot = rings;
+            version = rings_version.load(memory_order_relaxed);
+        }
+        bool stop = stopping.load(memory_order_acquire);
+        if (!drain(snapshot)) {
+            if (stop) {
+                return;
+            }
+            this_thread::sleep_for(IDLE_SLEEP);
+        }
+    }
+}
+
+static void write_all(int fd, const string &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;  // nowhere to report it, the log itself failed
+        }
+        done += static_cast<size_t>(n);
+    }
+}
+
+// One pass of the writer: empties every ring into the batches of the sinks,
+// then writes each batch at once. Returns false if there was nothing.
+bool Logger::drain(const vector<shared_ptr<Ring>> &snapshot) {
+    thread_local string payload;
+    size_t count = sink_count.load(memory_order_acquire);
+    vector<uint64_t> heads(snapshot.size());
+    uint64_t records = 0;
+    for (size_t i = 0; i < snapshot.size(); ++i) {
+        Ring &r = *snapshot[i];
+        uint64_t head = r.head.load(memory_order_relaxed);
+        uint64_t tail = r.tail.load(memory_order_acquire);
+        while (head < tail) {
+            RecordHeader header;
+            r.copy_out(head, &header, sizeof(header));
+            payload.resize(header.size);
+            r.copy_out(head + sizeof(header), &payload[0], header.size);
+            head += sizeof(header) + header.size;
+            if (header.sink < count) {
+                render(sinks[header.sink], static_cast<RecordType>(header.type), payload.data(), payload.size());
+            }
+            records++;
+        }
+        // the records are copied out, the thread may reuse their space
+        r.head.store(head, memory_order_release);
+        heads[i] = head;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (!sinks[i].batch.empty()) {
+            write_all(sinks[i].fd, sinks[i].batch);
+            sinks[i].batch.clear();
+            write_calls.fetch_add(1, memory_order_relaxed);
+        }
+    }
+    for (size_t i = 0; i < snapshot.size(); ++i) {
+        snapshot[i]->written.store(heads[i], memory_order_release);
+    }
+    records_written.fetch_add(records, memory_order_relaxed);
+    return records > 0;
+}
+
+void Logger::render(SinkState &sink, RecordType type, const char *payload, size_t size) {
+    if (sink.format == Format::Binary) {
+        append_binary_record(sink.batch, type, payload, size);
+        return;
+    }
+    if (type == RecordType::Text) {
+        sink.batch.append(payload, size);
+    } else if (type == RecordType::Chunk) {
+        ChunkRecord record;
+        if (!ChunkRecord::decode(payload, size, record)) {
+            return;
+        }
+        sink.batch.append(record.render());
+    }
+    sink.batch.push_back('\n');
+}
+
+void Logger::flush_on_termination() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    // started with the signals blocked, like every thread after it
+    Logger &logger = get();
+    thread([signals, &logger]() {
+        int signal = 0;
+        sigwait(&signals, &signal);
+        logger.flush();
+        _exit(128 + signal);
+    }).detach();
+}
@@ -0,0 +1,143 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LogRecord.h"
+
+enum class LogLevel : uint8_t { Debug = 0, Info = 1, Warn = 2, Error = 3 };
+
+// Levels below this are compiled out: release builds (NDEBUG) keep Info and
+// up, other builds everything. -DLOG_MIN_LEVEL=<n> overrides it.
+#ifndef LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define LOG_MIN_LEVEL 1
+#else
+#define LOG_MIN_LEVEL 0
+#endif
+#endif
+const LogLevel LOG_COMPILED_LEVEL = static_cast<LogLevel>(LOG_MIN_LEVEL);
+
+/**
+ * Logging that keeps the threads that log off the disk.
+ *
+ * Every thread that logs gets its own ring buffer on first use. Appending a
+ * record to it takes no lock and makes no system call; a background writer
+ * drains all rings about every millisecond, renders the records for their
+ * sink and hands each sink everything it got in a single write(). Records
+ * of one thread stay in order, those of different threads are only ordered
+ * within a pass of the writer.
+ *
+ * A sink is stdout or a file opened with open(). Text sinks get lines,
+ * binary sinks the records in the compact form of LogRecord.h.
+ *
+ * If a thread's ring is full, a Debug record is dropped; any other record
+ * waits for the writer, so log lines are never lost.
+ */
+class Logger {
+   public:
+    using Sink = uint16_t;
+    enum class Format { Text, Binary };
+    static const Sink CONSOLE = 0;  // stdout, text
+
+    struct Stats {
+        uint64_t records = 0;  // written
+        uint64_t writes = 0;  // write() calls
+        uint64_t dropped = 0;  // Debug records that found their ring full
+        uint64_t waits = 0;  // records that had to wait for the writer
+    };
+
+    // the process-wide logger, its writer starts on first use
+    static Logger &get();
+    ~Logger();
+    Logger(const Logger &) = delete;
+    Logger &operator=(const Logger &) = delete;
+
+    // truncates path; throws runtime_error if it cannot be opened
+    Sink open(const std::string &path, Format format);
+    void set_level(LogLevel level) { min_level.store(static_cast<uint8_t>(level), std::memory_order_relaxed); }
+    bool enabled(LogLevel level) const {
+        return static_cast<uint8_t>(level) >= min_level.load(std::memory_order_relaxed);
+    }
+
+    void text(Sink sink, LogLevel level, const std::string &line);
+    void chunk(Sink sink, const ChunkRecord &record);
+    // returns once everything logged before the call is written
+    void flush();
+    Stats stats() const;
+
+    // Blocks SIGINT and SIGTERM and has a thread wait for them, flush the
+    // log and exit. Call it first thing in main, before any other thread
+    // starts, so that the signals reach that thread.
+    static void flush_on_termination();
+
+   private:
+    struct Ring;
+    struct SinkState {
+        int fd = -1;
+        Format format = Format::Text;
+        std::string batch;  // rendered by the writer, not written yet
+    };
+    static const size_t MAX_SINKS = 64;
+
+    std::atomic<uint8_t> min_level;
+    std::mutex mutex;  // for rings and opening sinks, never taken to log a record
+    std::vector<std::shared_ptr<Ring>> rings;
+    std::atomic<uint64_t> rings_version;
+    SinkState sinks[MAX_SINKS];
+    std::atomic<size_t> sink_count;
+    std::atomic<bool> stopping;
+    std::atomic<uint64_t> records_written;
+    std::atomic<uint64_t> write_calls;
+    std::atomic<uint64_t> dropped_records;
+    std::atomic<uint64_t> waited_records;
+    std::thread writer;
+
+    Logger();
+    Ring &ring();
+    void append(Sink sink, RecordType type, LogLevel level, const char *payload, size_t size);
+    void run();
+    bool drain(const std::vector<std::shared_ptr<Ring>> &snapshot);
+    void render(SinkState &sink, RecordType type, const char *payload, size_t size);
+};
+
+// Collects one line with << and logs it when it goes out of scope.
+class LogLine {
+   public:
+    explicit LogLine(LogLevel level, Logger::Sink sink = Logger::CONSOLE) : level(level), sink(sink) {}
+    ~LogLine() { Logger::get().text(sink, level, stream.str()); }
+    LogLine(const LogLine &) = delete;
+    LogLine &operator=(const LogLine &) = delete;
+
+    template <typename T>
+    LogLine &operator<<(const T &value) {
+        stream << value;
+        return *this;
+    }
+
+   private:
+    LogLevel level;
+    Logger::Sink sink;
+    std::ostringstream stream;
+};
+
+// LOG_INFO << "x is " << x; nothing after LOG_* is evaluated unless the level
+// is compiled in and enabled.
+#define LOG_AT(level)                                                    \
+    if ((level) < LOG_COMPILED_LEVEL || !Logger::get().enabled(level)) { \
+    } else                                                               \
+        LogLine(level)
+#define LOG_DEBUG LOG_AT(LogLevel::Debug)
+#define LOG_INFO LOG_AT(LogLevel::Info)
+#define LOG_WARN LOG_AT(LogLevel::Warn)
+#define LOG_ERROR LOG_AT(LogLevel::Error)
+
+#endif
@@ -0,0 +1,400 @@
+#include "Player.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+using namespace std;
+using namespace std::chrono;
+
+atomic<int> PlayerStats::open{0};
+atomic<int> PlayerStats::peak_open{0};
+
+static const milliseconds RETRY_DELAY(1000);
+// asked for when the manifest lists no bitrates, as the one miProxy hands
+// browsers does; the proxy puts its own choice into the URI anyway
+static const int DEFAULT_BITRATE = 10;
+
+Player::Player(EventLoop &loop, const PlayerConfig &config, PlayerStats &stats, uint32_t index)
+    : loop(loop),
+      config(config),
+      stats(stats),
+      random(index),
+      source(config.source == INADDR_ANY ? INADDR_ANY : htonl(ntohl(config.source) + index)),
+      state(State::Waiting),
+      fd(-1),
+      connecting(false),
+      connection(0),
+      timer(0),
+      resent(false),
+      parser(HttpParser::Response),
+      head_done(false),
+      body_received(0),
+      bitrate(0),
+      fragment(0),
+      got_first_byte(false),
+      playing(false),
+      buffered(0) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &config.proxy.sin_addr, ip, sizeof(ip));
+    host = ip;
+    video_path = config.manifest.substr(0, config.manifest.rfind('/') + 1);
+}
+
+Player::~Player() {
+    loop.cancel_timer(timer);
+    close_connection();
+}
+
+// a new session: the manifest, then the fragments from the first
+void Player::start() {
+    timer = 0;
+    bitrate = 0;
+    fragment = 0;
+    playing = false;
+    buffered = 0;
+    if (stats.recording) {
+        stats.sessions++;
+    }
+    send_next();
+}
+
+void Player::send_next() {
+    timer = 0;
+    if (bitrate == 0) {
+        state = State::Manifest;
+        manifest.clear();
+        request(config.manifest);
+    } else {
+        state = State::Fragment;
+        request(video_path + to_string(bitrate) + "Seg1-Frag" + to_string(++fragment));
+    }
+}
+
+// The request is timed from here, so a reconnect counts against it as it
+// would for a real player.
+void Player::request(const string &uri) {
+    message = "GET " + uri + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: keep-alive\r\n\r\n";
+    out = message;
+    resent = false;
+    in.clear();
+    parser.reset();
+    head_done = false;
+    chunked.reset();
+    body_received = 0;
+    got_first_byte = false;
+    sent = Clock::now();
+    if (fd == -1) {
+        connect_proxy();  // the request goes out once connected
+    } else if (!connecting && !flush()) {
+        fail();
+    }
+}
+
+void Player::connect_proxy() {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        fd = -1;
+        fail();
+        return;
+    }
+    PlayerStats::open++;
+    int open = PlayerStats::open.load(memory_order_relaxed);
+    int peak = PlayerStats::peak_open.load(memory_order_relaxed);
+    while (open > peak && !PlayerStats::peak_open.compare_exchange_weak(peak, open)) {
+    }
+    connection++;
+    connecting = true;
+    if (stats.recording) {
+        stats.connects++;
+    }
+    if (source != INADDR_ANY) {
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = source;
+        if (::bind(fd, (sockaddr *)&address, sizeof(address)) < 0) {
+            if (stats.recording) {
+                stats.connect_failures++;
+            }
+            fail();
+            return;
+        }
+    }
+    if (connect(fd, (const sockaddr *)&config.proxy, sizeof(config.proxy)) < 0 && errno != EINPROGRESS) {
+        if (stats.recording) {
+            stats.connect_failures++;
+        }
+        fail();
+        return;
+    }
+    loop.add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, [this](uint32_t events) { handle_events(events); });
+}
+
+void Player::handle_events(uint32_t events) {
+    if (connecting) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            if (stats.recording) {
+                stats.connect_failures++;
+            }
+            fail();
+            return;
+        }
+        if (!(events & EPOLLOUT)) {
+            return;
+        }
+        connecting = false;
+    }
+    if ((events & EPOLLOUT) && !out.empty() && !flush()) {
+        fail();
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        read_response();
+    }
+}
+
+// false if the connection failed
+bool Player::flush() {
+    size_t written = 0;
+    while (written < out.size()) {
+        ssize_t n = send(fd, out.data() + written, out.size() - written, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n < 0) {
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    out.erase(0, written);
+    return true;
+}
+
+void Player::read_response() {
+    char buf[64 * 1024];
+    uint64_t current = connection;
+    // a response may end the connection, or end the session and start another
+    while (fd != -1 && connection == current) {
+        ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n > 0) {
+            receive(buf, static_cast<size_t>(n));
+            continue;
+        }
+        // closed: the end of a response without framing, or of an idle
+        // connection, which is opened again for the next request
+        if (state != State::Waiting && head_done && parser.framing() == HttpParser::Framing::UntilClose) {
+            close_connection();
+            finish_response();
+        } else if (state != State::Waiting && !got_first_byte && !resent) {
+            // the proxy timed the connection out as the request went out
+            close_connection();
+            resent = true;
+            out = message;
+            connect_proxy();
+        } else if (state != State::Waiting) {
+            if (stats.recording) {
+                stats.errors++;
+            }
+            fail();
+        } else {
+            close_connection();
+        }
+        return;
+    }
+}
+
+void Player::receive(const char *data, size_t len) {
+    if (state == State::Waiting) {
+        return;  // nothing was asked for, drop it
+    }
+    if (!got_first_byte) {
+        first_byte = Clock::now();
+        got_first_byte = true;
+    }
+    if (head_done) {
+        receive_body(data, len);
+        return;
+    }
+    in.append(data, len);
+    HttpParser::Status status = parser.parse(in.data(), in.size());
+    if (status == HttpParser::Status::Incomplete) {
+        return;
+    }
+    if (status == HttpParser::Status::Error) {
+        if (stats.recording) {
+            stats.errors++;
+        }
+        fail();
+        return;
+    }
+    head_done = true;
+    size_t head = parser.head_length();
+    if (parser.framing() == HttpParser::Framing::None) {
+        finish_response();
+        return;
+    }
+    // the body bytes are counted and dropped, only the manifest is kept
+    string body = in.substr(head);
+    in.resize(head);
+    receive_body(body.data(), body.size());
+}
+
+void Player::receive_body(const char *data, size_t len) {
+    string *keep = state == State::Manifest ? &manifest : nullptr;
+    switch (parser.framing()) {
+        case HttpParser::Framing::ContentLength: {
+            size_t take = min(len, parser.content_length() - body_received);
+            body_received += take;
+            if (keep) {
+                keep->append(data, take);
+            }
+            if (body_received == parser.content_length()) {
+                finish_response();
+            }
+            break;
+        }
+        case HttpParser::Framing::Chunked: {
+            size_t consumed = 0;
+            ChunkedDecoder::Status status = chunked.decode(data, len, consumed, keep);
+            body_received = chunked.body_length();
+            if (status == ChunkedDecoder::Status::Complete) {
+                finish_response();
+            } else if (status == ChunkedDecoder::Status::Error) {
+                if (stats.recording) {
+                    stats.errors++;
+                }
+                fail();
+            }
+            break;
+        }
+        case HttpParser::Framing::UntilClose:
+            body_received += len;
+            if (keep) {
+                keep->append(data, len);
+            }
+            break;
+        case HttpParser::Framing::None:
+            break;
+    }
+}
+
+void Player::finish_response() {
+    Clock::time_point now = Clock::now();
+    bool keep_alive = parser.keep_alive();
+    if (parser.status_code() != 200) {
+        if (stats.recording) {
+            stats.errors++;
+        }
+        fail();
+        return;
+    }
+    if (!keep_alive) {
+        close_connection();
+    }
+    if (state == State::Manifest) {
+        handle_manifest();
+    } else {
+        handle_fragment(now);
+    }
+}
+
+// the lowest of the bitrate="..." attributes, if there are any
+void Player::handle_manifest() {
+    state = State::Waiting;
+    int lowest = 0;
+    size_t pos = 0;
+    while ((pos = manifest.find("bitrate=\"", pos)) != string::npos) {
+        pos += 9;
+        int value = atoi(manifest.c_str() + pos);
+        if (value > 0 && (lowest == 0 || value < lowest)) {
+            lowest = value;
+        }
+    }
+    bitrate = lowest > 0 ? lowest : DEFAULT_BITRATE;
+    if (stats.recording) {
+        stats.manifests++;
+    }
+    schedule_next();
+}
+
+void Player::handle_fragment(Clock::time_point now) {
+    state = State::Waiting;
+    if (stats.recording) {
+        stats.fragments++;
+        stats.bytes += body_received;
+        stats.latencies.push_back(duration<float>(now - sent).count());
+        stats.first_bytes.push_back(duration<float>(first_byte - sent).count());
+    }
+    // play out what was buffered since the last fragment
+    if (playing) {
+        double played = duration<double>(now - buffer_time).count();
+        if (played > buffered && stats.recording) {
+            stats.stalls++;
+            stats.stall_seconds += played - buffered;
+        }
+        buffered = max(0.0, buffered - played);
+    }
+    buffered += config.fragment_seconds;
+    buffer_time = now;
+    playing = true;
+    if (fragment >= config.fragments) {
+        close_connection();
+        timer = loop.add_timer(milliseconds(0), [this]() { start(); });
+        return;
+    }
+    schedule_next();
+}
+
+// waits for the buffer to drain to the target, then thinks
+void Player::schedule_next() {
+    double wait = max(0.0, buffer_level(Clock::now()) - config.buffer_target);
+    milliseconds delay = duration_cast<milliseconds>(duration<double>(wait));
+    if (config.think.count() > 0) {
+        uniform_int_distribution<long> think(0, 2 * config.think.count());
+        delay += milliseconds(think(random));
+    }
+    timer = loop.add_timer(delay, [this]() { send_next(); });
+}
+
+// gives up on the session and starts another after a while
+void Player::fail() {
+    close_connection();
+    state = State::Waiting;
+    loop.cancel_timer(timer);
+    timer = loop.add_timer(RETRY_DELAY, [this]() { start(); });
+}
+
+void Player::close_connection() {
+    if (fd == -1) {
+        return;
+    }
+    if (loop.contains(fd)) {
+        loop.remove(fd);
+    }
+    close(fd);
+    fd = -1;
+    connecting = false;
+    out.clear();
+    PlayerStats::open--;
+}
+
+double Player::buffer_level(Clock::time_point now) const {
+    if (!playing) {
+        return 0;
+    }
+    return max(0.0, buffered - duration<double>(now - buffer_time).count());
+}
@@ -0,0 +1,129 @@
+#ifndef PLAYER_H
+#define PLAYER_H
+
+#include <netinet/in.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ChunkedDecoder.h"
+#include "EventLoop.h"
+#include "HttpParser.h"
+
+struct PlayerConfig {
+    sockaddr_in proxy;
+    // network order; player i binds the i-th address after this one, so that
+    // the proxy sees each as a browser of its own. INADDR_ANY lets the kernel
+    // pick, and all players share the proxy's session of that address
+    in_addr_t source = INADDR_ANY;
+    std::string manifest;  // e.g. /vod/big_buck_bunny.f4m
+    int fragments = 0;  // per session, then the player starts over
+    double fragment_seconds = 0;  // of video in each fragment
+    double buffer_target = 0;  // seconds; no request is sent while the buffer holds more
+    std::chrono::milliseconds think{0};  // mean pause before each request
+};
+
+// What the players of one thread add up to. Only that thread writes it,
+// apart from the open connections, which all threads count together.
+struct PlayerStats {
+    bool recording = false;  // off while the players ramp up and once the run is over
+    uint64_t bytes = 0;  // of fragment bodies
+    uint64_t fragments = 0;
+    uint64_t manifests = 0;
+    uint64_t sessions = 0;
+    uint64_t connects = 0;
+    uint64_t connect_failures = 0;
+    uint64_t errors = 0;  // bad responses and connections lost mid-response
+    uint64_t stalls = 0;  // the buffer ran dry while playing
+    double stall_seconds = 0;
+    std::vector<float> latencies;  // request sent to last byte, seconds
+    std::vector<float> first_bytes;  // request sent to first byte, seconds
+
+    static std::atomic<int> open;
+    static std::atomic<int> peak_open;
+};
+
+/**
+ * One simulated video player on a keep-alive connection to the proxy.
+ *
+ * A session fetches the manifest, then Seg1-Frag1, Seg1-Frag2, ... one at
+ * a time at the lowest bitrate it lists, which the proxy rewrites anyway.
+ * (miProxy hands out the manifest without the list; see DEFAULT_BITRATE.)
+ * Every fragment adds fragment_seconds to the buffer, which plays out in
+ * real time from the first one; a fragment that arrives after the buffer
+ * ran dry is a stall. The next request waits until the buffer is down to
+ * buffer_target, plus a random think time, so the player is closed-loop:
+ * a slow proxy slows the requests down instead of piling them up.
+ *
+ * After config.fragments fragments, or when the proxy closes the
+ * connection, the player reconnects and starts a new session.
+ */
+class Player {
+   public:
+    // index numbers the players from 0, and seeds the think times
+    Player(EventLoop &loop, const PlayerConfig &config, PlayerStats &stats, uint32_t index);
+    ~Player();
+    Player(const Player &) = delete;
+    Player &operator=(const Player &) = delete;
+
+    void start();
+
+   private:
+    using Clock = std::chrono::steady_clock;
+    enum class State { Waiting, Manifest, Fragment };  // what is in flight
+
+    EventLoop &loop;
+    const PlayerConfig &config;
+    PlayerStats &stats;
+    std::mt19937 random;
+
+    in_addr_t source;
+    std::string host;
+    std::string video_path;  // the directory of the manifest
+    State state;
+    int fd;  // -1 between connections
+    bool connecting;
+    uint64_t connection;  // counts the connections, so a read loop sees a reconnect
+    EventLoop::TimerId timer;
+    std::string message;  // the request in flight
+    bool resent;  // after the proxy closed an idle connection under it
+    std::string out;  // what of message does not fit into the socket yet
+    std::string in;  // the head of the response being read
+    HttpParser parser;
+    bool head_done;
+    ChunkedDecoder chunked;
+    size_t body_received;
+    std::string manifest;  // the body of the manifest response
+
+    int bitrate;
+    int fragment;  // the number of the fragment requested
+    Clock::time_point sent;
+    Clock::time_point first_byte;
+    bool got_first_byte;
+
+    bool playing;
+    double buffered;  // seconds of video at buffer_time
+    Clock::time_point buffer_time;
+
+    void send_next();
+    void request(const std::string &uri);
+    void connect_proxy();
+    void handle_events(uint32_t events);
+    bool flush();
+    void read_response();
+    void receive(const char *data, size_t len);
+    void receive_body(const char *data, size_t len);
+    void finish_response();
+    void handle_manifest();
+    void handle_fragment(Clock::time_point now);
+    void schedule_next();
+    void fail();
+    void close_connection();
+    double buffer_level(Clock::time_point now) const;
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Player.h"
+
+using namespace std;
+using namespace std::chrono;
+
+/**
+ * Closed-loop load generator for miProxy: simulated players, spread over a
+ * few threads with an event loop each, stream from the proxy for a while,
+ * and the throughput, fragment latencies, connections and CPU cost of the
+ * run are written to a results file as JSON.
+ */
+
+struct Options {
+    int players = 100;
+    int threads = 0;  // one per cpu
+    double duration = 30;  // seconds measured
+    double ramp = 1;  // seconds over which the players start, not measured
+    PlayerConfig player;
+    int proxy_pid = 0;
+    string results;
+};
+
+static void usage() {
+    cerr << "Usage: ./loadgen [--players <n>] [--threads <n>] [--duration <s>] [--ramp <s>]\n"
+            "                 [--fragments <n>] [--fragment-seconds <s>] [--buffer <s>] [--think <ms>]\n"
+            "                 [--manifest <uri>] [--source <ip>] [--proxy-pid <pid>]\n"
+            "                 <proxy-ip> <proxy-port> <results-file>"
+         << endl;
+    exit(1);
+}
+
+static Options get_options(int argc, char **argv) {
+    Options opts;
+    opts.player.manifest = "/vod/big_buck_bunny.f4m";
+    opts.player.fragments = 100;
+    opts.player.fragment_seconds = 2;
+    opts.player.buffer_target = 10;
+    vector<string> positional;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            bool value = i + 1 < argc;
+            if (arg == "--players" && value) {
+                opts.players = stoi(argv[++i]);
+            } else if (arg == "--threads" && value) {
+                opts.threads = stoi(argv[++i]);
+            } else if (arg == "--duration" && value) {
+                opts.duration = stod(argv[++i]);
+            } else if (arg == "--ramp" && value) {
+                opts.ramp = stod(argv[++i]);
+            } else if (arg == "--fragments" && value) {
+                opts.player.fragments = stoi(argv[++i]);
+            } else if (arg == "--fragment-seconds" && value) {
+                opts.player.fragment_seconds = stod(argv[++i]);
+            } else if (arg == "--buffer" && value) {
+                opts.player.buffer_target = stod(argv[++i]);
+            } else if (arg == "--think" && value) {
+                opts.player.think = milliseconds(stoi(argv[++i]));
+            } else if (arg == "--manifest" && value) {
+                opts.player.manifest = argv[++i];
+            } else if (arg == "--source" && value) {
+                in_addr addr;
+                if (inet_pton(AF_INET, argv[++i], &addr) != 1) {
+                    usage();
+                }
+                opts.player.source = addr.s_addr;
+            } else if (arg == "--proxy-pid" && value) {
+                opts.proxy_pid = stoi(argv[++i]);
+            } else if (arg.compare(0, 2, "--") == 0) {
+                usage();
+            } else {
+                positional.push_back(arg);
+            }
+        }
+        if (positional.size() != 3 || opts.players < 1 || opts.threads < 0 || opts.duration <= 0 || opts.ramp < 0 ||
+            opts.player.fragments < 1) {
+            usage();
+        }
+        opts.player.proxy = {};
+        opts.player.proxy.sin_family = AF_INET;
+        opts.player.proxy.sin_port = htons(static_cast<uint16_t>(stoi(positional[1])));
+        if (inet_pton(AF_INET, positional[0].c_str(), &opts.player.proxy.sin_addr) != 1) {
+            usage();
+        }
+    } catch (logic_error &) {
+        usage();
+    }
+    opts.results = positional[2];
+    if (opts.threads == 0) {
+        opts.threads = static_cast<int>(max(1u, thread::hardware_concurrency()));
+    }
+    opts.threads = min(opts.threads, opts.players);
+    return opts;
+}
+
+// user and system seconds of this process
+static double own_cpu() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+           double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// user and system seconds of another process, from /proc; -1 if unknown
+static double process_cpu(int pid) {
+    ifstream stat("/proc/" + to_string(pid) + "/stat");
+    string line;
+    if (!getline(stat, line) || line.rfind(')') == string::npos) {
+        return -1;
+    }
+    // the fields after the command name, from the 3rd: utime is the 14th and
+    // stime the 15th
+    istringstream fields(line.substr(line.rfind(')') + 2));
+    string field;
+    double utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; ++i) {
+        if (i == 14) {
+            utime = stod(field);
+        } else if (i == 15) {
+            stime = stod(field);
+        }
+    }
+    return (utime + stime) / double(sysconf(_SC_CLK_TCK));
+}
+
+// one thread's share of the players, on its own event loop
+static void run_players(const Options &opts, int index, PlayerStats &stats) {
+    EventLoop loop;
+    vector<unique_ptr<Player>> players;
+    for (int i = index; i < opts.players; i += opts.threads) {
+        players.emplace_back(new Player(loop, opts.player, stats, static_cast<uint32_t>(i)));
+        Player *player = players.back().get();
+        milliseconds start(static_cast<long>(opts.ramp * 1000 * i / opts.players));
+        loop.add_timer(start, [player]() { player->start(); });
+    }
+    milliseconds ramp(static_cast<long>(opts.ramp * 1000));
+    milliseconds end = ramp + milliseconds(static_cast<long>(opts.duration * 1000));
+    loop.add_timer(ramp, [&stats]() { stats.recording = true; });
+    loop.add_timer(end, [&stats, &loop]() {
+        stats.recording = false;
+        loop.stop();
+    });
+    loop.run();
+}
+
+// the nearest-rank percentile of sorted values, in ms
+static double percentile(const vector<float> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = static_cast<size_t>(ceil(p / 100 * double(sorted.size())));
+    return double(sorted[min(sorted.size(), max<size_t>(rank, 1)) - 1]) * 1000;
+}
+
+static void write_latencies(ostream &out, const char *name, vector<float> &values) {
+    sort(values.begin(), values.end());
+    out << "  \"" << name << "\": {\"p50\": " << percentile(values, 50) << ", \"p99\": " << percentile(values, 99)
+        << ", \"p999\": " << percentile(values, 99.9) << ", \"max\": " << percentile(values, 100) << "},\n";
+}
+
+int main(int argc, char **argv) {
+    Options opts = get_options(argc, argv);
+    // a player holds a socket, and thousands of them are the point
+    rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    vector<PlayerStats> stats(static_cast<size_t>(opts.threads));
+    vector<thread> threads;
+    for (int i = 0; i < opts.threads; ++i) {
+        threads.emplace_back(run_players, cref(opts), i, ref(stats[static_cast<size_t>(i)]));
+    }
+    // the cpu time is taken over the measured part of the run
+    this_thread::sleep_for(duration<double>(opts.ramp));
+    double own_start = own_cpu();
+    double proxy_start = opts.proxy_pid ? process_cpu(opts.proxy_pid) : -1;
+    this_thread::sleep_for(duration<double>(opts.duration));
+    double own_seconds = own_cpu() - own_start;
+    double proxy_seconds = opts.proxy_pid && proxy_start >= 0 ? process_cpu(opts.proxy_pid) - proxy_start : -1;
+    for (thread &t : threads) {
+        t.join();
+    }
+
+    PlayerStats total;
+    for (PlayerStats &s : stats) {
+        total.bytes += s.bytes;
+        total.fragments += s.fragments;
+        total.manifests += s.manifests;
+        total.sessions += s.sessions;
+        total.connects += s.connects;
+        total.connect_failures += s.connect_failures;
+        total.errors += s.errors;
+        total.stalls += s.stalls;
+        total.stall_seconds += s.stall_seconds;
+        total.latencies.insert(total.latencies.end(), s.latencies.begin(), s.latencies.end());
+        total.first_bytes.insert(total.first_bytes.end(), s.first_bytes.begin(), s.first_bytes.end());
+    }
+    double gigabits = double(total.bytes) * 8 / 1e9;
+
+    ofstream out(opts.results);
+    if (!out.is_open()) {
+        cerr << "Fail to Open File: " << opts.results << endl;
+        return 1;
+    }
+    out.precision(6);
+    out << "{\n"
+        << "  \"players\": " << opts.players << ",\n"
+        << "  \"threads\": " << opts.threads << ",\n"
+        << "  \"duration_s\": " << opts.duration << ",\n"
+        << "  \"think_ms\": " << opts.player.think.count() << ",\n"
+        << "  \"buffer_s\": " << opts.player.buffer_target << ",\n"
+        << "  \"sessions\": " << total.sessions << ",\n"
+        << "  \"manifests\": " << total.manifests << ",\n"
+        << "  \"fragments\": " << total.fragments << ",\n"
+        << "  \"bytes\": " << total.bytes << ",\n"
+        << "  \"throughput_mbps\": " << double(total.bytes) * 8 / 1e6 / opts.duration << ",\n"
+        << "  \"fragments_per_s\": " << double(total.fragments) / opts.duration << ",\n";
+    write_latencies(out, "latency_ms", total.latencies);
+    write_latencies(out, "first_byte_ms", total.first_bytes);
+    out << "  \"connections\": {\"opened\": " << total.connects << ", \"failed\": " << total.connect_failures
+        << ", \"peak_open\": " << PlayerStats::peak_open.load() << "},\n"
+        << "  \"errors\": " << total.errors << ",\n"
+        << "  \"stalls\": " << total.stalls << ",\n"
+        << "  \"stall_s\": " << total.stall_seconds << ",\n"
+        << "  \"loadgen_cpu_s\": " << own_seconds << ",\n";
+    if (proxy_seconds >= 0) {
+        out << "  \"proxy_cpu_s\": " << proxy_seconds << ",\n"
+            << "  \"proxy_cpu_s_per_gbit\": " << (gigabits > 0 ? proxy_seconds / gigabits : 0) << "\n";
+    } else {
+        out << "  \"proxy_cpu_s\": null,\n"
+            << "  \"proxy_cpu_s_per_gbit\": null\n";
+    }
+    out << "}\n";
+
+    cout << total.fragments << " fragments, " << double(total.bytes) * 8 / 1e6 / opts.duration << " Mbps, p99 "
+         << percentile(total.latencies, 99) << " ms, " << total.errors << " errors, results in " << opts.results
+         << endl;
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include <string.h>
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "LogRecord.h"
+
+/**
+ * Renders binary logs, as miProxy writes them with --log-binary, in the
+ * text format of the log.
+ */
+
+static void usage() {
+    std::cerr << "Usage: ./logdecode <log>..." << std::endl;
+    exit(1);
+}
+
+// Returns false if the log is not a binary log or ends in a partial record.
+static bool decode(std::istream &in, std::ostream &out) {
+    char magic[sizeof(BINARY_MAGIC)];
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, BINARY_MAGIC, sizeof(magic)) != 0) {
+        return false;
+    }
+    std::string payload;
+    while (true) {
+        uint8_t type;
+        uint32_t size;
+        if (!in.read(reinterpret_cast<char *>(&type), sizeof(type))) {
+            return true;  // the end, between records
+        }
+        if (!in.read(reinterpret_cast<char *>(&size), sizeof(size))) {
+            return false;
+        }
+        payload.resize(size);
+        if (!in.read(&payload[0], size)) {
+            return false;
+        }
+        if (type == static_cast<uint8_t>(RecordType::Text)) {
+            out << payload << '\n';
+        } else if (type == static_cast<uint8_t>(RecordType::Chunk)) {
+            ChunkRecord record;
+            if (!ChunkRecord::decode(payload.data(), payload.size(), record)) {
+                return false;
+            }
+            out << record.render() << '\n';
+        }
+        // records of a type this version does not know are skipped
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage();
+    }
+    for (int i = 1; i < argc; ++i) {
+        std::ifstream in(argv[i], std::ios::binary);
+        if (!in.is_open()) {
+            std::cerr << "Fail to Open File: " << argv[i] << std::endl;
+            return 1;
+        }
+        if (!decode(in, std::cout)) {
+            std::cerr << argv[i] << " is not a binary log or is cut short" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
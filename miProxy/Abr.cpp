@@ -0,0 +1,165 @@
+#include "Abr.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+void AbrSession::add_sample(double sample, double smoothed_throughput) {
+    smoothed = smoothed_throughput;
+    recent.push_back(sample);
+    if (recent.size() > MAX_SAMPLES) {
+        recent.pop_front();
+    }
+}
+
+double AbrSession::buffer(Clock::time_point now) const {
+    if (!playing) {
+        return level;
+    }
+    double drained = chrono::duration<double>(now - updated).count();
+    return max(0.0, level - drained);
+}
+
+void AbrSession::fragment_served(int bitrate, Clock::time_point now) {
+    if (playing) {
+        double drained = chrono::duration<double>(now - updated).count();
+        if (drained > level) {
+            // the player ran out of video before this fragment arrived
+            stall_count++;
+            stalled += drained - level;
+        }
+    }
+    level = buffer(now) + fragment_duration;
+    peak = max(peak, level);
+    updated = now;
+    playing = true;
+    previous = bitrate;
+    served++;
+    bitrate_sum += bitrate;
+}
+
+unique_ptr<AbrStrategy> AbrStrategy::create(const string &name) {
+    if (name == "rate") {
+        return unique_ptr<AbrStrategy>(new RateBasedAbr);
+    }
+    if (name == "buffer") {
+        return unique_ptr<AbrStrategy>(new BufferBasedAbr);
+    }
+    if (name == "mpc") {
+        return unique_ptr<AbrStrategy>(new MpcAbr);
+    }
+    throw runtime_error("Error: unknown ABR strategy " + name + ", expected rate, buffer or mpc");
+}
+
+// the highest bitrate at or below rate, or the lowest one
+static int highest_below(const vector<int> &bitrates, double rate) {
+    int bitrate = bitrates[0];
+    for (int br : bitrates) {
+        if (br > rate) {
+            break;
+        }
+        bitrate = br;
+    }
+    return bitrate;
+}
+
+int RateBasedAbr::choose(const AbrSession &session, const vector<int> &bitrates, AbrSession::Clock::time_point) const {
+    return highest_below(bitrates, session.throughput() / 1.5);
+}
+
+// reservoir and cushion, in fragments
+const static double RESERVOIR = 3;
+const static double CUSHION = 6;
+
+int BufferBasedAbr::choose(const AbrSession &session, const vector<int> &bitrates,
+                           AbrSession::Clock::time_point now) const {
+    double reservoir = RESERVOIR * session.duration();
+    double cushion = CUSHION * session.duration();
+    double buffer = session.buffer(now);
+    if (session.peak_buffer() < reservoir) {
+        // still starting up
+        return highest_below(bitrates, session.throughput() / 1.5);
+    }
+    if (buffer <= reservoir) {
+        return bitrates.front();
+    }
+    if (buffer >= reservoir + cushion) {
+        return bitrates.back();
+    }
+    double rate = bitrates.front() + (bitrates.back() - bitrates.front()) * (buffer - reservoir) / cushion;
+    return highest_below(bitrates, rate);
+}
+
+// fragments planned ahead, fewer when there are many bitrates to try
+const static int HORIZON = 5;
+const static double MAX_PLANS = 4096;
+
+// Harmonic mean of samples [begin, end), 0 if there are none.
+static double harmonic_mean(const deque<double> &samples, size_t begin, size_t end) {
+    double sum = 0;
+    for (size_t i = begin; i < end; ++i) {
+        if (samples[i] <= 0) {
+            return 0;
+        }
+        sum += 1 / samples[i];
+    }
+    return end > begin ? (double)(end - begin) / sum : 0;
+}
+
+struct Plan {
+    const vector<int> &bitrates;
+    double throughput;  // predicted, kbps
+    double duration;  // of a fragment, s
+    double rtt;  // added to every download, s
+    double stall_penalty;  // per second of stall
+    int horizon;
+};
+
+// The best QoE of the remaining fragments, starting with buffer seconds
+// buffered after a fragment at bitrate previous.
+static double best_qoe(const Plan &plan, int depth, double buffer, int previous, int *first) {
+    if (depth == plan.horizon) {
+        return 0;
+    }
+    double best = -INFINITY;
+    for (int bitrate : plan.bitrates) {
+        double download = bitrate * plan.duration / plan.throughput + plan.rtt;
+        double stall = max(0.0, download - buffer);
+        double next_buffer = max(0.0, buffer - download) + plan.duration;
+        double qoe = bitrate - plan.stall_penalty * stall - (previous == 0 ? 0 : abs(bitrate - previous)) +
+                     best_qoe(plan, depth + 1, next_buffer, bitrate, nullptr);
+        if (qoe > best) {
+            best = qoe;
+            if (first != nullptr) {
+                *first = bitrate;
+            }
+        }
+    }
+    return best;
+}
+
+int MpcAbr::choose(const AbrSession &session, const vector<int> &bitrates, AbrSession::Clock::time_point now) const {
+    const deque<double> &samples = session.samples();
+    double predicted = harmonic_mean(samples, 0, samples.size());
+    if (predicted <= 0) {
+        return bitrates.front();
+    }
+    // how far off the same prediction was for each of the recent samples
+    double max_error = 0;
+    for (size_t i = 1; i < samples.size(); ++i) {
+        double past = harmonic_mean(samples, 0, i);
+        max_error = max(max_error, abs(past - samples[i]) / samples[i]);
+    }
+    int horizon = HORIZON;
+    while (horizon > 1 && pow((double)bitrates.size(), horizon) > MAX_PLANS) {
+        horizon--;
+    }
+    // a second of stall costs as much as a fragment at the top bitrate
+    Plan plan{bitrates, predicted / (1 + max_error), session.duration(), session.rtt(), (double)bitrates.back(),
+              horizon};
+    int first = bitrates.front();
+    best_qoe(plan, 0, session.buffer(now), session.last_bitrate(), &first);
+    return first;
+}
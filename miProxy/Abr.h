@@ -0,0 +1,117 @@
+#ifndef ABR_H
+#define ABR_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * What the proxy has measured of one session, the same for every bitrate
+ * strategy.
+ *
+ * Besides the throughput samples, the session keeps an estimate of the
+ * player's buffer: every fragment served adds fragment_duration seconds of
+ * video, and playback drains it in real time from the first fragment on.
+ * Finding it empty when the next fragment is served counts as a stall.
+ * Average bitrate and stalls are kept so the strategies can be compared on
+ * real traffic.
+ */
+class AbrSession {
+   public:
+    using Clock = std::chrono::steady_clock;
+
+    // how many throughput samples are kept for the strategies
+    static const size_t MAX_SAMPLES = 5;
+
+    explicit AbrSession(double fragment_duration = 2.0) : fragment_duration(fragment_duration) {}
+
+    // a throughput sample and the smoothed throughput after it, in kbps
+    void add_sample(double sample, double smoothed);
+    // the round trip time to the server, in seconds, when the kernel knows it
+    void add_rtt(double seconds) { round_trip = seconds; }
+    // a fragment of bitrate kbps was served to the player
+    void fragment_served(int bitrate, Clock::time_point now);
+
+    double throughput() const { return smoothed; }
+    const std::deque<double> &samples() const { return recent; }
+    // estimated seconds of video the player has buffered at now
+    double buffer(Clock::time_point now) const;
+    int last_bitrate() const { return previous; }
+    double duration() const { return fragment_duration; }
+    double peak_buffer() const { return peak; }  // the highest estimate so far
+    double rtt() const { return round_trip; }  // 0 if unknown
+
+    uint64_t fragments() const { return served; }
+    double average_bitrate() const { return served == 0 ? 0 : bitrate_sum / (double)served; }
+    uint64_t stalls() const { return stall_count; }
+    double stall_time() const { return stalled; }  // seconds
+
+   private:
+    double fragment_duration;  // seconds of video in a fragment
+    double smoothed = 0;
+    std::deque<double> recent;  // newest last
+    double round_trip = 0;
+    double level = 0;  // buffered seconds at updated
+    Clock::time_point updated;
+    double peak = 0;
+    bool playing = false;  // the first fragment was served
+    int previous = 0;  // bitrate of the last fragment, 0 before the first
+    uint64_t served = 0;
+    double bitrate_sum = 0;
+    uint64_t stall_count = 0;
+    double stalled = 0;
+};
+
+/**
+ * Picks the bitrate of the next fragment of a session. One strategy is
+ * chosen per deployment with --abr; it is shared by all sessions of a worker
+ * and keeps no state of its own.
+ */
+class AbrStrategy {
+   public:
+    virtual ~AbrStrategy() {}
+    virtual const char *name() const = 0;
+    // bitrates is ascending and not empty, the result is one of them
+    virtual int choose(const AbrSession &session, const std::vector<int> &bitrates,
+                       AbrSession::Clock::time_point now) const = 0;
+
+    // "rate", "buffer" or "mpc"; throws runtime_error for anything else
+    static std::unique_ptr<AbrStrategy> create(const std::string &name);
+};
+
+// The highest bitrate the smoothed throughput sustains with 50% headroom.
+class RateBasedAbr : public AbrStrategy {
+   public:
+    const char *name() const override { return "rate"; }
+    int choose(const AbrSession &session, const std::vector<int> &bitrates,
+               AbrSession::Clock::time_point now) const override;
+};
+
+// BBA: the buffer level alone maps to a bitrate, the lowest below a
+// reservoir, the highest above reservoir + cushion and linear in between.
+// Until the buffer first fills the reservoir the rate rule decides, so a
+// session does not start at the lowest bitrate on a fast link.
+class BufferBasedAbr : public AbrStrategy {
+   public:
+    const char *name() const override { return "buffer"; }
+    int choose(const AbrSession &session, const std::vector<int> &bitrates,
+               AbrSession::Clock::time_point now) const override;
+};
+
+// RobustMPC: predicts the throughput of the next fragments as the harmonic
+// mean of the recent samples, discounted by the largest recent prediction
+// error, and picks the first bitrate of the plan over the next fragments
+// that maximizes bitrate minus stalls minus switches. Every download in the
+// plan takes a round trip on top, when it is known.
+class MpcAbr : public AbrStrategy {
+   public:
+    const char *name() const override { return "mpc"; }
+    int choose(const AbrSession &session, const std::vector<int> &bitrates,
+               AbrSession::Clock::time_point now) const override;
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include "AdminServer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include "Logger.h"
+
+using namespace std;
+using namespace std::chrono;
+
+const static milliseconds ACCEPT_RETRY(100);
+
+AdminServer::AdminServer(EventLoop &loop) : loop(loop), listen_fd(-1), accept_timer(0) {}
+
+AdminServer::~AdminServer() {
+    loop.cancel_timer(accept_timer);
+    for (auto &it : clients) {
+        loop.remove(it.first);
+        close(it.first);
+    }
+    if (listen_fd != -1) {
+        loop.remove(listen_fd);
+        close(listen_fd);
+    }
+}
+
+void AdminServer::listen(int port, bool reuse_port) {
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        throw runtime_error("admin socket failed");
+    }
+    int yes = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0 ||
+        (reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0)) {
+        throw runtime_error("admin setsockopt failed");
+    }
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    if (::bind(listen_fd, (sockaddr *)&address, sizeof(address)) < 0) {
+        throw runtime_error("admin bind failed");
+    }
+    if (::listen(listen_fd, 16) < 0) {
+        throw runtime_error("admin listen failed");
+    }
+    loop.add(listen_fd, EPOLLIN, [this](uint32_t) { accept_clients(); });
+}
+
+void AdminServer::add_page(const string &path, const string &content_type, Page page) {
+    routes[path] = {content_type, move(page)};
+}
+
+void AdminServer::accept_clients() {
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // out of fds: the listener is edge-triggered, so the connections
+            // left in the backlog are picked up by a retry rather than by
+            // the next one to arrive
+            LOG_WARN << "Accepting an admin connection failed: " << strerror(errno);
+            if (accept_timer == 0) {
+                accept_timer = loop.add_timer(ACCEPT_RETRY, [this]() {
+                    accept_timer = 0;
+                    accept_clients();
+                });
+            }
+            return;
+        }
+        clients[fd].reset(new Client());
+        loop.add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, [this, fd](uint32_t events) { handle_client(fd, events); });
+    }
+}
+
+void AdminServer::handle_client(int fd, uint32_t events) {
+    auto it = clients.find(fd);
+    if (it == clients.end()) {
+        return;
+    }
+    Client &client = *it->second;
+    if (client.out.empty()) {
+        char buf[4096];
+        while (true) {
+            ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (n <= 0) {
+                close_client(fd);
+                return;
+            }
+            client.in.append(buf, static_cast<size_t>(n));
+        }
+        HttpParser::Status status = client.parser.parse(client.in.data(), client.in.size());
+        if (status == HttpParser::Status::Incomplete) {
+            if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                close_client(fd);
+            }
+            return;
+        }
+        if (status == HttpParser::Status::Error) {
+            client.out = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+        } else {
+            client.out = respond(client.parser);
+        }
+    }
+    if (!flush(fd, client) || client.sent == client.out.size()) {
+        close_client(fd);
+    }
+}
+
+string AdminServer::respond(const HttpParser &parser) {
+    string status = "200 OK";
+    string content_type = "text/plain";
+    string body;
+    auto route = routes.find(string(parser.uri()));
+    if (route == routes.end()) {
+        status = "404 Not Found";
+    } else if (parser.method() != "GET") {
+        status = "405 Method Not Allowed";
+    } else {
+        content_type = route->second.content_type;
+        body = route->second.page();
+    }
+    LOG_DEBUG << "Admin request " << parser.method() << " " << parser.uri() << ": " << status;
+    return "HTTP/1.1 " + status + "\r\nContent-Type: " + content_type + "\r\nContent-Length: " +
+           to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+}
+
+// false if the socket failed
+bool AdminServer::flush(int fd, Client &client) {
+    while (client.sent < client.out.size()) {
+        ssize_t n = send(fd, client.out.data() + client.sent, client.out.size() - client.sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n < 0) {
+            return false;
+        }
+        client.sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+void AdminServer::close_client(int fd) {
+    loop.remove(fd);
+    close(fd);
+    clients.erase(fd);
+}
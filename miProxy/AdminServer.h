@@ -0,0 +1,60 @@
+#ifndef ADMINSERVER_H
+#define ADMINSERVER_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "EventLoop.h"
+#include "HttpParser.h"
+
+/**
+ * A small HTTP listener on the admin port, served from a worker's event
+ * loop like the browsers.
+ *
+ * Pages are registered by path with add_page(); a GET for one is answered
+ * with what its handler returns, anything else with 404 or 405. Every
+ * connection carries one request and is closed after the response. With
+ * several workers each binds the port with SO_REUSEPORT, and whichever
+ * worker gets the connection answers it.
+ */
+class AdminServer {
+   public:
+    using Page = std::function<std::string()>;
+
+    explicit AdminServer(EventLoop &loop);
+    ~AdminServer();
+    AdminServer(const AdminServer &) = delete;
+    AdminServer &operator=(const AdminServer &) = delete;
+
+    // throws runtime_error if the port cannot be bound
+    void listen(int port, bool reuse_port);
+    void add_page(const std::string &path, const std::string &content_type, Page page);
+
+   private:
+    struct Route {
+        std::string content_type;
+        Page page;
+    };
+    struct Client {
+        std::string in;
+        HttpParser parser{HttpParser::Request};
+        std::string out;  // the response, once the request is complete
+        size_t sent = 0;
+    };
+
+    EventLoop &loop;
+    int listen_fd;
+    EventLoop::TimerId accept_timer;  // retrying accept after running out of fds, or 0
+    std::map<std::string, Route> routes;
+    std::map<int, std::unique_ptr<Client>> clients;  // by fd
+
+    void accept_clients();
+    void handle_client(int fd, uint32_t events);
+    std::string respond(const HttpParser &parser);
+    bool flush(int fd, Client &client);
+    void close_client(int fd);
+};
+
+#endif
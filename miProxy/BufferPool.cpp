@@ -0,0 +1,28 @@
+#include "BufferPool.h"
+
+using namespace std;
+
+BufferPool::BufferPool(size_t block_size, size_t max_free) : size(block_size), max_free(max_free) {}
+
+BufferPool::~BufferPool() {
+    for (char *block : free_blocks) {
+        delete[] block;
+    }
+}
+
+char *BufferPool::acquire() {
+    if (free_blocks.empty()) {
+        return new char[size];
+    }
+    char *block = free_blocks.back();
+    free_blocks.pop_back();
+    return block;
+}
+
+void BufferPool::release(char *block) {
+    if (free_blocks.size() >= max_free) {
+        delete[] block;
+        return;
+    }
+    free_blocks.push_back(block);
+}
@@ -0,0 +1,34 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Free list of fixed-size memory blocks for the connections' read buffers.
+ *
+ * Connections take a block when they have data to hold and give it back as
+ * soon as they are drained, so the memory in use follows the number of busy
+ * connections rather than the number of open ones, and a steady load never
+ * reaches the allocator. At most max_free blocks are kept around; more are
+ * freed when they are returned. A pool belongs to a single event loop and is
+ * not thread-safe.
+ */
+class BufferPool {
+   public:
+    BufferPool(size_t block_size, size_t max_free);
+    ~BufferPool();
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    size_t block_size() const { return size; }
+    char *acquire();
+    void release(char *block);
+
+   private:
+    const size_t size;
+    const size_t max_free;
+    std::vector<char *> free_blocks;
+};
+
+#endif
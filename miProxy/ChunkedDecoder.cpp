@@ -0,0 +1,138 @@
+#include "ChunkedDecoder.h"
+
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+void ChunkedDecoder::reset() {
+    state = State::Size;
+    chunk_size = 0;
+    size_digits = 0;
+    remaining = 0;
+    decoded = 0;
+}
+
+void ChunkedDecoder::end_size_line() {
+    if (size_digits == 0) {
+        state = State::Failed;
+    } else if (chunk_size == 0) {
+        state = State::TrailerLine;  // last-chunk
+    } else {
+        remaining = chunk_size;
+        state = State::Data;
+    }
+}
+
+ChunkedDecoder::Status ChunkedDecoder::decode(const char *buf, size_t len, size_t &consumed,
+                                              string *body) {
+    size_t i = 0;
+    while (i < len && state != State::Done && state != State::Failed) {
+        if (state == State::Data) {
+            // chunk data is taken in bulk, everything else byte by byte
+            size_t n = min(remaining, len - i);
+            if (body != nullptr) {
+                body->append(buf + i, n);
+            }
+            decoded += n;
+            remaining -= n;
+            i += n;
+            if (remaining == 0) {
+                state = State::DataCR;
+            }
+            continue;
+        }
+
+        char c = buf[i++];
+        switch (state) {
+            case State::Size: {
+                int digit = hex_value(c);
+                if (digit >= 0) {
+                    if (chunk_size > (SIZE_MAX >> 4)) {
+                        state = State::Failed;
+                        break;
+                    }
+                    chunk_size = (chunk_size << 4) | static_cast<size_t>(digit);
+                    size_digits++;
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    state = State::Extension;
+                } else if (c == '\r') {
+                    state = State::SizeLF;
+                } else if (c == '\n') {
+                    end_size_line();
+                } else {
+                    state = State::Failed;
+                }
+                break;
+            }
+            case State::Extension:
+                if (c == '\r') {
+                    state = State::SizeLF;
+                } else if (c == '\n') {
+                    end_size_line();
+                }
+                break;
+            case State::SizeLF:
+                if (c == '\n') {
+                    end_size_line();
+                } else {
+                    state = State::Failed;
+                }
+                break;
+            case State::DataCR:
+                if (c == '\r') {
+                    state = State::DataLF;
+                    break;
+                }
+                // a bare LF is tolerated
+                [[fallthrough]];
+            case State::DataLF:
+                if (c == '\n') {
+                    chunk_size = 0;
+                    size_digits = 0;
+                    state = State::Size;
+                } else {
+                    state = State::Failed;
+                }
+                break;
+            case State::TrailerLine:
+                if (c == '\r') {
+                    state = State::FinalLF;
+                } else if (c == '\n') {
+                    state = State::Done;
+                } else {
+                    state = State::Trailer;
+                }
+                break;
+            case State::Trailer:
+                if (c == '\n') {
+                    state = State::TrailerLine;
+                }
+                break;
+            case State::FinalLF:
+                state = c == '\n' ? State::Done : State::Failed;
+                break;
+            default:
+                break;
+        }
+    }
+
+    consumed = i;
+    if (state == State::Done) {
+        return Status::Complete;
+    }
+    return state == State::Failed ? Status::Error : Status::Incomplete;
+}
@@ -0,0 +1,53 @@
+#ifndef CHUNKEDDECODER_H
+#define CHUNKEDDECODER_H
+
+#include <cstddef>
+#include <string>
+
+/**
+ * Resumable decoder for a body sent with Transfer-Encoding: chunked.
+ *
+ * decode() is fed the body bytes as they are read from the socket, in any
+ * split, and reports how many of them belong to the message, so the caller
+ * can forward exactly those bytes still encoded and knows where the next
+ * response starts. Chunk extensions and trailer fields are skipped. The
+ * chunk data itself is only copied out when the caller asks for it, which
+ * is needed for bodies that are parsed rather than relayed.
+ */
+class ChunkedDecoder {
+   public:
+    enum class Status { Incomplete, Complete, Error };
+
+    ChunkedDecoder() { reset(); }
+    void reset();
+    // consumes bytes of buf up to the end of the message and sets consumed;
+    // the chunk data is appended to body unless it is null
+    Status decode(const char *buf, size_t len, size_t &consumed, std::string *body);
+    // chunk data decoded so far
+    size_t body_length() const { return decoded; }
+
+   private:
+    enum class State {
+        Size,        // hex digits of the chunk size
+        Extension,   // ";name=value" after the size
+        SizeLF,      // '\n' ending the size line
+        Data,        // chunk data
+        DataCR,      // CRLF after the data
+        DataLF,
+        TrailerLine, // start of a trailer field or of the final CRLF
+        Trailer,     // rest of a trailer field
+        FinalLF,
+        Done,
+        Failed,
+    };
+
+    State state;
+    size_t chunk_size;
+    size_t size_digits;
+    size_t remaining;  // data bytes left in the current chunk
+    size_t decoded;
+
+    void end_size_line();
+};
+
+#endif
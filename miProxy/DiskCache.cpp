@@ -0,0 +1,291 @@
+#include "DiskCache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "Logger.h"
+
+using namespace std;
+
+// a cache of this size or less still gets segments of this size
+const static size_t MIN_SEGMENT_SIZE = 1024 * 1024;
+// the index is rewritten once it has this many lines more than twice the
+// live entries, so that overwritten and evicted entries do not pile up
+const static size_t INDEX_SLACK = 1024;
+
+DiskCache::Segment::~Segment() {
+    close(fd);
+}
+
+DiskCache::DiskCache(const string &dir, size_t max_bytes)
+    : dir(dir),
+      max_bytes(max_bytes),
+      segment_size(max(max_bytes / 8, MIN_SEGMENT_SIZE)),
+      index_fd(-1),
+      index_lines(0),
+      next_segment(0) {}
+
+DiskCache::~DiskCache() {
+    if (index_fd != -1) {
+        close(index_fd);
+    }
+}
+
+string DiskCache::segment_path(int id) const {
+    return dir + "/segment." + to_string(id);
+}
+
+DiskCache::SegmentInfo *DiskCache::find_segment(int id) {
+    for (auto &info : segments) {
+        if (info.segment->id == id) {
+            return &info;
+        }
+    }
+    return nullptr;
+}
+
+// false if the file could not be opened, a full disk or no fds left, say
+bool DiskCache::open_segment(int id, bool create) {
+    int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0);
+    int fd = open(segment_path(id).c_str(), flags, 0644);
+    if (fd < 0) {
+        LOG_WARN << "Opening " << segment_path(id) << " failed: " << strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        LOG_WARN << "Reading the size of " << segment_path(id) << " failed: " << strerror(errno);
+        close(fd);
+        return false;
+    }
+    segments.push_back({make_shared<Segment>(id, fd), static_cast<size_t>(st.st_size), {}});
+    counters.bytes += static_cast<size_t>(st.st_size);
+    counters.segments++;
+    next_segment = max(next_segment, id + 1);
+    return true;
+}
+
+void DiskCache::load() {
+    if (!enabled()) {
+        return;
+    }
+    lock_guard<mutex> guard(lock);
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        throw runtime_error("could not create " + dir + ": " + strerror(errno));
+    }
+
+    // segments left by an earlier run, oldest first
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) {
+        throw runtime_error("could not open " + dir + ": " + strerror(errno));
+    }
+    vector<int> ids;
+    while (struct dirent *ent = readdir(d)) {
+        int id;
+        char rest;
+        if (sscanf(ent->d_name, "segment.%d%c", &id, &rest) == 1 && id >= 0) {
+            ids.push_back(id);
+        }
+    }
+    closedir(d);
+    sort(ids.begin(), ids.end());
+    for (int id : ids) {
+        // one that cannot be opened is left out, with its entries
+        open_segment(id, false);
+    }
+
+    // index lines: segment \t offset \t length \t content type \t key
+    // later lines win; entries whose body did not make it to disk are dropped
+    ifstream in(dir + "/index");
+    string line;
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string segment, offset, length, content_type, key;
+        if (!getline(fields, segment, '\t') || !getline(fields, offset, '\t') ||
+            !getline(fields, length, '\t') || !getline(fields, content_type, '\t') || !getline(fields, key) ||
+            key.empty()) {
+            continue;
+        }
+        IndexEntry entry;
+        try {
+            entry = {stoi(segment), static_cast<off_t>(stoll(offset)), stoul(length), content_type};
+        } catch (logic_error &) {
+            continue;
+        }
+        SegmentInfo *info = find_segment(entry.segment);
+        if (info == nullptr || entry.offset < 0 || static_cast<size_t>(entry.offset) + entry.length > info->size) {
+            continue;
+        }
+        index[key] = entry;
+        info->keys.push_back(key);
+    }
+    counters.entries = index.size();
+    LOG_INFO << "Disk cache " << dir << ": " << counters.entries << " fragments, " << counters.bytes << " bytes in "
+             << counters.segments << " segments";
+
+    evict();
+    rewrite_index();
+}
+
+DiskCache::Location DiskCache::find(const string &key) {
+    Location location;
+    lock_guard<mutex> guard(lock);
+    auto it = index.find(key);
+    if (it == index.end()) {
+        counters.misses++;
+        return location;
+    }
+    counters.hits++;
+    location.segment = find_segment(it->second.segment)->segment;
+    location.offset = it->second.offset;
+    location.length = it->second.length;
+    location.content_type = it->second.content_type;
+    return location;
+}
+
+bool DiskCache::contains(const string &key) const {
+    if (!enabled()) {
+        return false;
+    }
+    lock_guard<mutex> guard(lock);
+    return index.count(key) > 0;
+}
+
+// The body is written from the worker's thread, but without the lock: its
+// range of the segment is taken first, so the other workers' lookups and
+// insertions go on meanwhile, and the entry is only added to the index once
+// the body is on its way to disk. Appending to a segment only copies into
+// the page cache, the kernel writes it back later.
+void DiskCache::insert(const string &key, const string &content_type, const string &body) {
+    if (!enabled() || body.size() > segment_size || content_type.find_first_of("\t\r\n") != string::npos) {
+        return;
+    }
+    shared_ptr<Segment> segment;
+    off_t offset;
+    {
+        lock_guard<mutex> guard(lock);
+        if ((segments.empty() || segments.back().size + body.size() > segment_size) &&
+            !open_segment(next_segment, true)) {
+            return;  // not cached
+        }
+        SegmentInfo &info = segments.back();
+        segment = info.segment;
+        offset = static_cast<off_t>(info.size);
+        info.size += body.size();
+        counters.bytes += body.size();
+    }
+
+    size_t written = 0;
+    while (written < body.size()) {
+        ssize_t n = pwrite(segment->fd, body.data() + written, body.size() - written,
+                           offset + static_cast<off_t>(written));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // the range is skipped, the next body goes after it
+            LOG_WARN << "Writing to " << segment_path(segment->id) << " failed: " << strerror(errno);
+            return;
+        }
+        written += static_cast<size_t>(n);
+    }
+
+    lock_guard<mutex> guard(lock);
+    SegmentInfo *info = find_segment(segment->id);
+    if (info == nullptr) {
+        return;  // evicted while it was being written
+    }
+    IndexEntry entry{segment->id, offset, body.size(), content_type};
+    info->keys.push_back(key);
+    counters.insertions++;
+    index[key] = entry;
+    counters.entries = index.size();
+    write_index(key, entry);
+    evict();
+    if (index_lines > 2 * index.size() + INDEX_SLACK) {
+        rewrite_index();
+    }
+}
+
+DiskCache::Stats DiskCache::stats() const {
+    lock_guard<mutex> guard(lock);
+    return counters;
+}
+
+static string index_line(const string &key, int segment, off_t offset, size_t length, const string &content_type) {
+    return to_string(segment) + "\t" + to_string(offset) + "\t" + to_string(length) + "\t" + content_type + "\t" +
+           key + "\n";
+}
+
+void DiskCache::write_index(const string &key, const IndexEntry &entry) {
+    if (index_fd == -1) {
+        return;  // the entry is lost with a restart
+    }
+    string line = index_line(key, entry.segment, entry.offset, entry.length, entry.content_type);
+    if (write(index_fd, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+        LOG_WARN << "Writing to " << dir << "/index failed: " << strerror(errno);
+    }
+    index_lines++;
+}
+
+// Replaces the index with the live entries, so it does not keep growing with
+// overwritten and evicted ones. If that fails the old index is kept, lines
+// of evicted segments in it are dropped by load().
+void DiskCache::rewrite_index() {
+    string tmp = dir + "/index.tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_WARN << "Opening " << tmp << " failed: " << strerror(errno);
+        return;
+    }
+    string lines;
+    for (auto &it : index) {
+        lines += index_line(it.first, it.second.segment, it.second.offset, it.second.length, it.second.content_type);
+    }
+    if (write(fd, lines.data(), lines.size()) != static_cast<ssize_t>(lines.size()) ||
+        rename(tmp.c_str(), (dir + "/index").c_str()) < 0) {
+        LOG_WARN << "Rewriting " << dir << "/index failed: " << strerror(errno);
+        close(fd);
+        unlink(tmp.c_str());
+        return;
+    }
+    if (index_fd != -1) {
+        close(index_fd);
+    }
+    index_fd = fd;
+    index_lines = index.size();
+    // appends go to the renamed file through the same descriptor
+    fcntl(index_fd, F_SETFL, O_APPEND);
+}
+
+// Drops the oldest segments until the cache fits into max_bytes. Their
+// lines stay in the index until it is rewritten.
+void DiskCache::evict() {
+    while (counters.bytes > max_bytes && segments.size() > 1) {
+        SegmentInfo &oldest = segments.front();
+        int id = oldest.segment->id;
+        for (auto &key : oldest.keys) {
+            auto it = index.find(key);
+            if (it != index.end() && it->second.segment == id) {
+                index.erase(it);
+            }
+        }
+        // hits being sent from it keep the file open
+        unlink(segment_path(id).c_str());
+        counters.bytes -= oldest.size;
+        counters.segments--;
+        segments.pop_front();
+        LOG_DEBUG << "Evicted disk cache segment " << id;
+    }
+    counters.entries = index.size();
+}
@@ -0,0 +1,105 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Second cache tier for video fragments, on local disk and shared by all
+ * workers.
+ *
+ * Bodies are appended to segment files (dir/segment.N) that are never
+ * rewritten, and every insertion appends a line to dir/index naming the
+ * segment, offset and length of the body under its key. The index is read
+ * back by load(), so a restarted proxy keeps its cache, and rewritten with
+ * the live entries once overwritten and evicted ones make up most of it.
+ * Space is reclaimed a whole segment at a time, oldest first, once the
+ * segments exceed max_bytes; a body may take at most one segment, an eighth
+ * of max_bytes. A failed open or write is logged and the fragment is just
+ * not cached.
+ *
+ * A hit is a file range, which the caller sends with sendfile(). The range
+ * holds a reference to its segment, so the file stays open while it is
+ * being sent even if the segment is evicted meanwhile.
+ */
+class DiskCache {
+   public:
+    struct Segment {
+        int id;
+        int fd;
+        Segment(int id, int fd) : id(id), fd(fd) {}
+        ~Segment();
+    };
+    struct Location {
+        std::shared_ptr<const Segment> segment;  // null if not found
+        off_t offset = 0;
+        size_t length = 0;
+        std::string content_type;
+    };
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t insertions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;  // in segment files, including overwritten bodies
+        size_t segments = 0;
+    };
+
+    // a cache with an empty dir is disabled
+    DiskCache(const std::string &dir, size_t max_bytes);
+    ~DiskCache();
+    DiskCache(const DiskCache &) = delete;
+    DiskCache &operator=(const DiskCache &) = delete;
+
+    bool enabled() const { return !dir.empty(); }
+    size_t max_entry_size() const { return enabled() ? segment_size : 0; }
+    // opens the segments left by an earlier run and reads the index back
+    void load();
+    // the location of the body for key; counts a hit or a miss
+    Location find(const std::string &key);
+    // whether key is cached, without counting it as a lookup
+    bool contains(const std::string &key) const;
+    void insert(const std::string &key, const std::string &content_type, const std::string &body);
+    Stats stats() const;
+
+   private:
+    struct IndexEntry {
+        int segment;
+        off_t offset;
+        size_t length;
+        std::string content_type;
+    };
+    struct SegmentInfo {
+        std::shared_ptr<Segment> segment;
+        size_t size;
+        std::vector<std::string> keys;  // entries stored in it, some may be stale
+    };
+
+    const std::string dir;
+    const size_t max_bytes;
+    const size_t segment_size;
+    mutable std::mutex lock;
+    std::deque<SegmentInfo> segments;  // oldest first, the last one is appended to
+    std::unordered_map<std::string, IndexEntry> index;
+    int index_fd;
+    size_t index_lines;  // in the index file, live or not
+    int next_segment;
+    Stats counters;
+
+    std::string segment_path(int id) const;
+    SegmentInfo *find_segment(int id);
+    bool open_segment(int id, bool create);
+    void write_index(const std::string &key, const IndexEntry &entry);
+    void rewrite_index();
+    void evict();
+};
+
+#endif
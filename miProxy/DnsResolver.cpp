@@ -0,0 +1,280 @@
+#include "DnsResolver.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "DNSHeader.h"
+#include "DNSQuestion.h"
+#include "DNSRecord.h"
+#include "Logger.h"
+
+using namespace std;
+using namespace std::chrono;
+
+DnsResolver::DnsResolver(EventLoop &loop, const string &server_ip, int server_port, milliseconds default_ttl,
+                         milliseconds timeout)
+    : loop(loop),
+      server_ip(server_ip),
+      server_port(server_port),
+      default_ttl(default_ttl),
+      timeout(timeout),
+      next_id(1) {}
+
+DnsResolver::~DnsResolver() {
+    for (auto &it : queries) {
+        if (it.second->fd != -1) {
+            loop.remove(it.second->fd);
+            close(it.second->fd);
+        }
+        loop.cancel_timer(it.second->timer);
+    }
+}
+
+// Every field is sent with its length in front, in network byte order.
+static void append_framed(string &out, const string &field) {
+    uint32_t size = htonl(static_cast<uint32_t>(field.size()));
+    out.append(reinterpret_cast<const char *>(&size), sizeof(size));
+    out.append(field);
+}
+
+void DnsResolver::resolve(const string &name, Callback callback) {
+    auto cached = cache.find(name);
+    if (cached != cache.end() && cached->second.expires > Clock::now()) {
+        counters.hits++;
+        string ip = cached->second.ip;
+        loop.add_timer(milliseconds(0), [callback, ip]() { callback(ip); });
+        return;
+    }
+    counters.misses++;
+    auto joined = by_name.find(name);
+    if (joined != by_name.end()) {
+        queries[joined->second]->callbacks.push_back(move(callback));
+        return;
+    }
+
+    QueryId id = next_id++;
+    unique_ptr<Query> query(new Query);
+    query->id = id;
+    query->name = name;
+    query->callbacks.push_back(move(callback));
+
+    DNSHeader header;
+    header.ID = static_cast<ushort>(id);
+    header.QR = 0;
+    header.OPCODE = 1;
+    header.AA = 0;
+    header.TC = 0;
+    header.RD = 0;
+    header.RA = 0;
+    header.Z = 0;
+    header.RCODE = 0;
+    header.QDCOUNT = 1;
+    header.ANCOUNT = 0;
+    header.NSCOUNT = 0;
+    header.ARCOUNT = 0;
+    DNSQuestion question;
+    strncpy(question.QNAME, name.c_str(), sizeof(question.QNAME) - 1);
+    question.QTYPE = 1;
+    question.QCLASS = 1;
+    append_framed(query->out, DNSHeader::encode(header));
+    append_framed(query->out, DNSQuestion::encode(question));
+
+    Query &q = *query;
+    queries[id] = move(query);
+    if (default_ttl.count() > 0) {
+        by_name[name] = id;
+    }
+    start(q);
+}
+
+DnsResolver::Stats DnsResolver::stats() const {
+    Stats stats = counters;
+    stats.in_flight = queries.size();
+    return stats;
+}
+
+void DnsResolver::start(Query &query) {
+    QueryId id = query.id;
+    counters.queries++;
+    query.timer = loop.add_timer(timeout, [this, id]() {
+        auto it = queries.find(id);
+        if (it != queries.end()) {
+            LOG_WARN << "DNS query for " << it->second->name << " timed out";
+            it->second->timer = 0;
+            finish(id, "");
+        }
+    });
+
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(server_port));
+    if (inet_pton(AF_INET, server_ip.c_str(), &address.sin_addr) != 1) {
+        loop.add_timer(milliseconds(0), [this, id]() { finish(id, ""); });
+        return;
+    }
+    query.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (query.fd < 0) {
+        LOG_WARN << "Opening a socket to the dns server failed: " << strerror(errno);
+        query.fd = -1;
+        loop.add_timer(milliseconds(0), [this, id]() { finish(id, ""); });
+        return;
+    }
+    if (connect(query.fd, (sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+        LOG_WARN << "Connecting to dns server failed: " << strerror(errno);
+        loop.add_timer(milliseconds(0), [this, id]() { finish(id, ""); });
+        return;
+    }
+    loop.add(query.fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, [this, id](uint32_t events) { handle_event(id, events); });
+}
+
+void DnsResolver::handle_event(QueryId id, uint32_t events) {
+    auto it = queries.find(id);
+    if (it == queries.end()) {
+        return;
+    }
+    Query &query = *it->second;
+    if (query.connecting) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(query.fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+            error = errno;
+        }
+        if (error == 0 && !(events & EPOLLOUT)) {
+            return;  // still in progress
+        }
+        if (error != 0) {
+            LOG_WARN << "Connecting to dns server failed: " << strerror(error);
+            finish(id, "");
+            return;
+        }
+        query.connecting = false;
+    }
+    if (!send_query(query)) {
+        finish(id, "");
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        int status = read_answer(query);
+        if (status != 0) {
+            string ip;
+            seconds ttl(0);
+            if (status > 0 && parse_answer(query, ip, ttl) > 0 && !ip.empty()) {
+                if (ttl.count() > 0 || default_ttl.count() > 0) {
+                    milliseconds lifetime = ttl.count() > 0 ? duration_cast<milliseconds>(ttl) : default_ttl;
+                    cache[query.name] = {ip, Clock::now() + lifetime};
+                }
+            } else {
+                LOG_WARN << "DNS query for " << query.name << " got no answer";
+            }
+            finish(id, ip);
+        }
+    }
+}
+
+bool DnsResolver::send_query(Query &query) {
+    while (query.sent < query.out.size()) {
+        ssize_t n = send(query.fd, query.out.data() + query.sent, query.out.size() - query.sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n < 0) {
+            return false;
+        }
+        query.sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Returns 1 once the nameserver closed the connection after answering, 0
+// while more is expected and -1 if the connection failed.
+int DnsResolver::read_answer(Query &query) {
+    char buf[1024];
+    while (true) {
+        ssize_t n = recv(query.fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            return 1;
+        }
+        query.in.append(buf, static_cast<size_t>(n));
+    }
+}
+
+// Reads the length-prefixed field at offset, returns false if it is cut off.
+static bool read_framed(const string &in, size_t &offset, string &field) {
+    uint32_t size;
+    if (in.size() - offset < sizeof(size)) {
+        return false;
+    }
+    memcpy(&size, in.data() + offset, sizeof(size));
+    size = ntohl(size);
+    if (in.size() - offset - sizeof(size) < size) {
+        return false;
+    }
+    field = in.substr(offset + sizeof(size), size);
+    offset += sizeof(size) + size;
+    return true;
+}
+
+// The answer is a header, and a record unless the header has an error code.
+// Returns 1 with ip empty for an error code, 1 with ip and ttl for a record,
+// and -1 if the answer is malformed.
+int DnsResolver::parse_answer(const Query &query, string &ip, seconds &ttl) const {
+    size_t offset = 0;
+    string field;
+    if (!read_framed(query.in, offset, field)) {
+        return -1;
+    }
+    DNSHeader header = DNSHeader::decode(field);
+    if (header.RCODE != 0) {
+        return 1;
+    }
+    if (!read_framed(query.in, offset, field)) {
+        return -1;
+    }
+    DNSRecord record = DNSRecord::decode(field);
+    ip = string(record.RDATA, strnlen(record.RDATA, sizeof(record.RDATA)));
+    ttl = seconds(record.TTL);
+    return 1;
+}
+
+void DnsResolver::finish(QueryId id, const string &ip) {
+    auto it = queries.find(id);
+    if (it == queries.end()) {
+        return;
+    }
+    Query &query = *it->second;
+    if (query.fd != -1) {
+        loop.remove(query.fd);
+        close(query.fd);
+    }
+    loop.cancel_timer(query.timer);
+    if (ip.empty()) {
+        counters.failures++;
+    }
+    auto named = by_name.find(query.name);
+    if (named != by_name.end() && named->second == id) {
+        by_name.erase(named);
+    }
+    vector<Callback> callbacks = move(query.callbacks);
+    queries.erase(it);
+    for (auto &callback : callbacks) {
+        callback(ip);
+    }
+}
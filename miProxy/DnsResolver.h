@@ -0,0 +1,91 @@
+#ifndef DNSRESOLVER_H
+#define DNSRESOLVER_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "EventLoop.h"
+
+/**
+ * Resolves names through the nameserver without blocking the event loop.
+ *
+ * The nameserver answers a single query per TCP connection and closes it,
+ * so every query gets its own non-blocking connection and any number of them
+ * can be in flight at once. A query that is not answered within timeout
+ * fails.
+ *
+ * Answers are cached for the TTL of their record, or for default_ttl when
+ * the record has none (the nameserver always sends 0). With a default_ttl
+ * of 0 such answers are not cached, and every lookup gets its own query so
+ * that the nameserver can spread sessions over its servers. While answers
+ * are cached, a lookup of a name that is already being queried waits for
+ * that query.
+ *
+ * Callbacks only ever run from the event loop, a cache hit included.
+ */
+class DnsResolver {
+   public:
+    // ip is empty if the name could not be resolved
+    using Callback = std::function<void(const std::string &ip)>;
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t queries = 0;  // sent to the nameserver
+        uint64_t failures = 0;
+        size_t in_flight = 0;
+    };
+
+    DnsResolver(EventLoop &loop, const std::string &server_ip, int server_port,
+                std::chrono::milliseconds default_ttl, std::chrono::milliseconds timeout);
+    ~DnsResolver();
+    DnsResolver(const DnsResolver &) = delete;
+    DnsResolver &operator=(const DnsResolver &) = delete;
+
+    void resolve(const std::string &name, Callback callback);
+    Stats stats() const;
+
+   private:
+    using Clock = std::chrono::steady_clock;
+    using QueryId = uint64_t;
+
+    struct Query {
+        QueryId id;
+        std::string name;
+        int fd = -1;
+        bool connecting = true;
+        std::string out;  // the query, framed as the nameserver expects it
+        size_t sent = 0;
+        std::string in;  // the answer read so far
+        EventLoop::TimerId timer = 0;
+        std::vector<Callback> callbacks;
+    };
+    struct CacheEntry {
+        std::string ip;
+        Clock::time_point expires;
+    };
+
+    EventLoop &loop;
+    const std::string server_ip;
+    const int server_port;
+    const std::chrono::milliseconds default_ttl;
+    const std::chrono::milliseconds timeout;
+    std::unordered_map<QueryId, std::unique_ptr<Query>> queries;
+    std::unordered_map<std::string, QueryId> by_name;  // queries others may join
+    std::unordered_map<std::string, CacheEntry> cache;
+    QueryId next_id;
+    Stats counters;
+
+    void start(Query &query);
+    void handle_event(QueryId id, uint32_t events);
+    bool send_query(Query &query);
+    int read_answer(Query &query);
+    int parse_answer(const Query &query, std::string &ip, std::chrono::seconds &ttl) const;
+    void finish(QueryId id, const std::string &ip);
+};
+
+#endif
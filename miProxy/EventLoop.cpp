@@ -0,0 +1,137 @@
+#include "EventLoop.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+static uint64_t pack(int fd, uint32_t generation) {
+    return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+}
+
+EventLoop::EventLoop() : running(false), next_generation(1), next_timer_id(1) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        throw runtime_error("epoll_create1 failed");
+    }
+}
+
+EventLoop::~EventLoop() {
+    close(epoll_fd);
+}
+
+void EventLoop::add(int fd, uint32_t events, Handler handler) {
+    if (fd < 0) {
+        throw runtime_error("epoll add: bad fd");
+    }
+    if (static_cast<size_t>(fd) >= entries.size()) {
+        entries.resize(static_cast<size_t>(fd) + 1);
+    }
+    Entry &entry = entries[fd];
+    // re-adding a registered fd hands it over to the new handler
+    int op = entry.handler ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    entry.handler = make_shared<Handler>(move(handler));
+    entry.generation = next_generation++;
+
+    struct epoll_event ev;
+    ev.events = events | EPOLLET;
+    ev.data.u64 = pack(fd, entry.generation);
+    if (epoll_ctl(epoll_fd, op, fd, &ev) < 0) {
+        entry.handler.reset();
+        throw runtime_error("epoll_ctl add failed");
+    }
+}
+
+void EventLoop::modify(int fd, uint32_t events) {
+    if (!contains(fd)) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = events | EPOLLET;
+    ev.data.u64 = pack(fd, entries[fd].generation);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        throw runtime_error("epoll_ctl mod failed");
+    }
+}
+
+void EventLoop::remove(int fd) {
+    if (!contains(fd)) {
+        return;
+    }
+    // the fd may already be closed, in which case the kernel dropped it
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    entries[fd].handler.reset();
+}
+
+bool EventLoop::contains(int fd) const {
+    return fd >= 0 && static_cast<size_t>(fd) < entries.size() && entries[fd].handler != nullptr;
+}
+
+EventLoop::TimerId EventLoop::add_timer(chrono::milliseconds delay, TimerCallback callback) {
+    TimerId id = next_timer_id++;
+    auto it = timers.emplace(Clock::now() + delay, make_pair(id, move(callback)));
+    timer_index[id] = it;
+    return id;
+}
+
+void EventLoop::cancel_timer(TimerId id) {
+    auto it = timer_index.find(id);
+    if (it == timer_index.end()) {
+        return;
+    }
+    timers.erase(it->second);
+    timer_index.erase(it);
+}
+
+// milliseconds until the earliest timer is due, -1 if there is none
+int EventLoop::next_timeout() const {
+    if (timers.empty()) {
+        return -1;
+    }
+    auto delay = timers.begin()->first - Clock::now();
+    if (delay <= Clock::duration::zero()) {
+        return 0;
+    }
+    // round up so that the timer has expired when epoll_wait() returns
+    return static_cast<int>(chrono::duration_cast<chrono::milliseconds>(delay).count()) + 1;
+}
+
+void EventLoop::run_timers() {
+    Clock::time_point now = Clock::now();
+    while (!timers.empty() && timers.begin()->first <= now) {
+        TimerCallback callback = move(timers.begin()->second.second);
+        timer_index.erase(timers.begin()->second.first);
+        timers.erase(timers.begin());
+        callback();
+    }
+}
+
+void EventLoop::run() {
+    struct epoll_event events[MAX_EVENTS];
+    running = true;
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, next_timeout());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw runtime_error("epoll_wait error");
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = static_cast<int>(events[i].data.u64 & 0xffffffffu);
+            uint32_t generation = static_cast<uint32_t>(events[i].data.u64 >> 32);
+            if (!contains(fd) || entries[fd].generation != generation) {
+                continue;  // fd was removed earlier in this batch
+            }
+            shared_ptr<Handler> handler = entries[fd].handler;
+            (*handler)(events[i].events);
+        }
+        run_timers();
+    }
+}
+
+void EventLoop::stop() {
+    running = false;
+}
@@ -0,0 +1,83 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <sys/epoll.h>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Edge-triggered epoll reactor.
+ *
+ * Every fd is registered once together with a callback; run() only wakes up
+ * for sockets that actually became ready, so the cost of a wakeup no longer
+ * depends on how many connections are open. Handlers are stored in a table
+ * indexed by fd, and every registration gets a generation number so that an
+ * event queued for an fd that was closed (and possibly reused by accept())
+ * earlier in the same batch is dropped instead of being misdelivered.
+ *
+ * Since registration is edge-triggered, a handler must drain its fd (read
+ * until EAGAIN) before returning.
+ *
+ * One-shot timers run on the same thread; epoll_wait() sleeps at most until
+ * the earliest timer is due.
+ */
+class EventLoop {
+   public:
+    using Handler = std::function<void(uint32_t events)>;
+    using TimerCallback = std::function<void()>;
+    using TimerId = uint64_t;  // 0 is never a valid id
+
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    // register fd for events (EPOLLET is always added), or replace the
+    // handler and events of an fd that is already registered
+    void add(int fd, uint32_t events, Handler handler);
+    // change the event mask of a registered fd
+    void modify(int fd, uint32_t events);
+    // unregister fd, it is safe to call this from inside fd's own handler
+    void remove(int fd);
+    bool contains(int fd) const;
+
+    // run callback once after delay, returns an id for cancel_timer()
+    TimerId add_timer(std::chrono::milliseconds delay, TimerCallback callback);
+    // cancelling an expired or unknown timer is a no-op
+    void cancel_timer(TimerId id);
+
+    // dispatch events until stop() is called
+    void run();
+    void stop();
+
+   private:
+    struct Entry {
+        // shared so that a handler can remove or replace itself while running
+        std::shared_ptr<Handler> handler;
+        uint32_t generation = 0;
+    };
+
+    using Clock = std::chrono::steady_clock;
+    using TimerQueue = std::multimap<Clock::time_point, std::pair<TimerId, TimerCallback>>;
+
+    static const int MAX_EVENTS = 256;
+
+    int next_timeout() const;
+    void run_timers();
+
+    int epoll_fd;
+    bool running;
+    uint32_t next_generation;
+    std::vector<Entry> entries;  // indexed by fd
+    TimerQueue timers;  // ordered by deadline
+    std::unordered_map<TimerId, TimerQueue::iterator> timer_index;
+    TimerId next_timer_id;
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef FDTABLE_H
+#define FDTABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * Objects indexed by the fd of their socket, like EventLoop's handlers.
+ *
+ * The table itself is a flat array of small slots, one per fd, which is all
+ * an event has to touch to find its object; the objects, with their buffers
+ * and queues, live on the heap and are never moved, so references to them
+ * stay valid while the table grows.
+ *
+ * Every insertion gets a new generation number. An Id holds the fd and the
+ * generation, so callbacks that run later (timers, fetches, the pool) can
+ * keep one and find out that the object they were meant for is gone, even
+ * if accept() reused its fd meanwhile.
+ */
+template <typename T>
+class FdTable {
+   public:
+    using Id = uint64_t;  // 0 is never a valid id
+
+    FdTable() : next_generation(1), count(0) {}
+    FdTable(const FdTable &) = delete;
+    FdTable &operator=(const FdTable &) = delete;
+
+    // a new object for fd, which must not have one
+    T &insert(int fd) {
+        size_t index = static_cast<size_t>(fd);
+        if (index >= slots.size()) {
+            slots.resize(index + 1);
+        }
+        Slot &slot = slots[index];
+        slot.generation = next_generation++;
+        slot.object.reset(new T());  // value-initialized, plain fields start at 0
+        count++;
+        return *slot.object;
+    }
+
+    Id id(int fd) const {
+        return (static_cast<Id>(slots[static_cast<size_t>(fd)].generation) << 32) | static_cast<uint32_t>(fd);
+    }
+
+    // the object id was given to, or null if it was erased
+    T *find(Id id) const {
+        size_t index = static_cast<uint32_t>(id);
+        uint32_t generation = static_cast<uint32_t>(id >> 32);
+        if (index >= slots.size() || !slots[index].object || slots[index].generation != generation) {
+            return nullptr;
+        }
+        return slots[index].object.get();
+    }
+
+    void erase(int fd) {
+        Slot &slot = slots[static_cast<size_t>(fd)];
+        if (slot.object) {
+            slot.object.reset();
+            count--;
+        }
+    }
+
+    size_t size() const { return count; }
+
+   private:
+    struct Slot {
+        uint32_t generation = 0;
+        std::unique_ptr<T> object;
+    };
+
+    std::vector<Slot> slots;
+    uint32_t next_generation;
+    size_t count;
+};
+
+#endif
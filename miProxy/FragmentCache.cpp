@@ -0,0 +1,59 @@
+#include "FragmentCache.h"
+
+using namespace std;
+
+FragmentCache::FragmentCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+FragmentCache::EntryPtr FragmentCache::find(const string &key) {
+    lock_guard<mutex> guard(lock);
+    auto it = index.find(key);
+    if (it == index.end()) {
+        counters.misses++;
+        return nullptr;
+    }
+    counters.hits++;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+}
+
+bool FragmentCache::contains(const string &key) const {
+    lock_guard<mutex> guard(lock);
+    return index.count(key) > 0;
+}
+
+void FragmentCache::insert(const string &key, EntryPtr entry) {
+    if (!enabled() || entry->body.size() > max_entry_size()) {
+        return;
+    }
+    lock_guard<mutex> guard(lock);
+    auto it = index.find(key);
+    if (it != index.end()) {
+        // fetched twice concurrently, keep the newer copy
+        counters.bytes -= it->second->second->body.size();
+        lru.erase(it->second);
+        index.erase(it);
+        counters.entries--;
+    }
+    counters.bytes += entry->body.size();
+    counters.entries++;
+    counters.insertions++;
+    lru.emplace_front(key, move(entry));
+    index[key] = lru.begin();
+    evict();
+}
+
+FragmentCache::Stats FragmentCache::stats() const {
+    lock_guard<mutex> guard(lock);
+    return counters;
+}
+
+void FragmentCache::evict() {
+    while (counters.bytes > max_bytes && !lru.empty()) {
+        auto &oldest = lru.back();
+        counters.bytes -= oldest.second->body.size();
+        counters.entries--;
+        counters.evictions++;
+        index.erase(oldest.first);
+        lru.pop_back();
+    }
+}
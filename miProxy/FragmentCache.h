@@ -0,0 +1,63 @@
+#ifndef FRAGMENTCACHE_H
+#define FRAGMENTCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Byte-bounded LRU cache of video fragments, shared by all workers.
+ *
+ * Entries are keyed by origin and rewritten request-uri and are immutable
+ * once inserted, so a worker keeps serving an entry through its shared_ptr
+ * after dropping the lock, even if the entry is evicted meanwhile. The
+ * least recently used entries are evicted when the cached bodies exceed
+ * max_bytes; a single body may take at most an eighth of that. A cache of
+ * size 0 is disabled.
+ */
+class FragmentCache {
+   public:
+    struct Entry {
+        std::string content_type;
+        std::string body;
+    };
+    using EntryPtr = std::shared_ptr<const Entry>;
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t insertions = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    explicit FragmentCache(size_t max_bytes);
+    FragmentCache(const FragmentCache &) = delete;
+    FragmentCache &operator=(const FragmentCache &) = delete;
+
+    bool enabled() const { return max_bytes > 0; }
+    size_t max_entry_size() const { return max_bytes / 8; }
+    // the entry for key, or null; counts a hit or a miss
+    EntryPtr find(const std::string &key);
+    // whether key is cached, without counting it as a lookup
+    bool contains(const std::string &key) const;
+    void insert(const std::string &key, EntryPtr entry);
+    Stats stats() const;
+
+   private:
+    using Lru = std::list<std::pair<std::string, EntryPtr>>;  // most recent first
+
+    const size_t max_bytes;
+    mutable std::mutex lock;
+    Lru lru;
+    std::unordered_map<std::string, Lru::iterator> index;
+    Stats counters;
+
+    void evict();
+};
+
+#endif
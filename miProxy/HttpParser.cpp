@@ -0,0 +1,235 @@
+#include "HttpParser.h"
+
+#include <string.h>
+
+using namespace std;
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+HttpParser::HttpParser(Type type) : type(type) {
+    reset();
+}
+
+void HttpParser::reset() {
+    state = State::StartLine;
+    base = nullptr;
+    line_start = 0;
+    scan = 0;
+    head_len = 0;
+    method_span = uri_span = version_span = Span();
+    status = 0;
+    field_count = 0;
+    body_framing = Framing::None;
+    body_length = 0;
+    persistent = false;
+}
+
+HttpParser::Status HttpParser::parse(const char *buf, size_t len) {
+    base = buf;
+    if (state == State::Done) {
+        return Status::Complete;
+    }
+    if (state == State::Failed) {
+        return Status::Error;
+    }
+
+    while (true) {
+        const char *nl = static_cast<const char *>(memchr(buf + scan, '\n', len - scan));
+        if (nl == nullptr) {
+            scan = len;
+            return len > MAX_HEAD_SIZE ? fail() : Status::Incomplete;
+        }
+        size_t begin = line_start;
+        size_t end = static_cast<size_t>(nl - buf);
+        line_start = scan = end + 1;
+        if (end > begin && buf[end - 1] == '\r') {
+            end--;
+        }
+
+        if (state == State::StartLine) {
+            if (begin == end && type == Request) {
+                continue;  // tolerate empty lines before a request
+            }
+            if (!parse_start_line(begin, end)) {
+                return fail();
+            }
+            state = State::Headers;
+        } else if (begin == end) {
+            head_len = line_start;
+            if (!finish()) {
+                return fail();
+            }
+            state = State::Done;
+            return Status::Complete;
+        } else if (!parse_field(begin, end)) {
+            return fail();
+        }
+    }
+}
+
+// request-line = method SP request-target SP HTTP-version
+// status-line = HTTP-version SP status-code SP reason-phrase
+bool HttpParser::parse_start_line(size_t begin, size_t end) {
+    const char *line = base + begin;
+    size_t len = end - begin;
+    const char *sp1 = static_cast<const char *>(memchr(line, ' ', len));
+    if (sp1 == nullptr) {
+        return false;
+    }
+    size_t first = static_cast<size_t>(sp1 - line);
+
+    if (type == Response) {
+        version_span = {static_cast<uint32_t>(begin), static_cast<uint32_t>(first)};
+        if (len < first + 4) {
+            return false;
+        }
+        status = 0;
+        for (size_t i = first + 1; i < first + 4; ++i) {
+            if (line[i] < '0' || line[i] > '9') {
+                return false;
+            }
+            status = status * 10 + (line[i] - '0');
+        }
+        return version().substr(0, 5) == "HTTP/";
+    }
+
+    const char *sp2 = static_cast<const char *>(memchr(sp1 + 1, ' ', len - first - 1));
+    if (sp2 == nullptr) {
+        return false;
+    }
+    size_t second = static_cast<size_t>(sp2 - line);
+    method_span = {static_cast<uint32_t>(begin), static_cast<uint32_t>(first)};
+    uri_span = {static_cast<uint32_t>(begin + first + 1), static_cast<uint32_t>(second - first - 1)};
+    version_span = {static_cast<uint32_t>(begin + second + 1), static_cast<uint32_t>(len - second - 1)};
+    return first > 0 && uri_span.length > 0 && version().substr(0, 5) == "HTTP/";
+}
+
+// header-field = field-name ":" OWS field-value OWS
+bool HttpParser::parse_field(size_t begin, size_t end) {
+    const char *line = base + begin;
+    size_t len = end - begin;
+    if (is_space(line[0]) || field_count == MAX_HEADERS) {
+        return false;  // obsolete line folding, or too many fields
+    }
+    const char *colon = static_cast<const char *>(memchr(line, ':', len));
+    if (colon == nullptr || colon == line || is_space(colon[-1])) {
+        return false;
+    }
+    size_t name_len = static_cast<size_t>(colon - line);
+    size_t value_begin = name_len + 1;
+    while (value_begin < len && is_space(line[value_begin])) {
+        value_begin++;
+    }
+    size_t value_end = len;
+    while (value_end > value_begin && is_space(line[value_end - 1])) {
+        value_end--;
+    }
+    Field &field = fields[field_count++];
+    field.name = {static_cast<uint32_t>(begin), static_cast<uint32_t>(name_len)};
+    field.value = {static_cast<uint32_t>(begin + value_begin), static_cast<uint32_t>(value_end - value_begin)};
+    return true;
+}
+
+// work out the body framing and persistence, RFC 7230 section 3.3.3
+bool HttpParser::finish() {
+    bool no_body = type == Request || (status >= 100 && status < 200) || status == 204 || status == 304;
+    string_view transfer_encoding = header("Transfer-Encoding");
+    string_view length = header("Content-Length");
+
+    if (!transfer_encoding.empty()) {
+        if (!has_token(transfer_encoding, "chunked")) {
+            return false;  // no other coding can be delimited
+        }
+        body_framing = Framing::Chunked;
+    } else if (!length.empty()) {
+        body_length = 0;
+        for (char c : length) {
+            if (c < '0' || c > '9') {
+                return false;
+            }
+            body_length = body_length * 10 + static_cast<size_t>(c - '0');
+        }
+        body_framing = Framing::ContentLength;
+    } else {
+        body_framing = no_body ? Framing::None : Framing::UntilClose;
+    }
+    if (status == 204 || status == 304 || (status >= 100 && status < 200)) {
+        body_framing = Framing::None;
+    }
+
+    string_view connection = header("Connection");
+    if (version() == "HTTP/1.0") {
+        persistent = has_token(connection, "keep-alive");
+    } else {
+        persistent = !has_token(connection, "close");
+    }
+    if (body_framing == Framing::UntilClose) {
+        persistent = false;
+    }
+    return true;
+}
+
+HttpParser::Status HttpParser::fail() {
+    state = State::Failed;
+    return Status::Error;
+}
+
+string_view HttpParser::header(string_view name) const {
+    for (size_t i = 0; i < field_count; ++i) {
+        if (iequals(view(fields[i].name), name)) {
+            return view(fields[i].value);
+        }
+    }
+    return string_view();
+}
+
+bool HttpParser::has_header(string_view name) const {
+    for (size_t i = 0; i < field_count; ++i) {
+        if (iequals(view(fields[i].name), name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HttpParser::iequals(string_view a, string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (lower(a[i]) != lower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// whether a comma separated header value lists token (case-insensitive)
+bool HttpParser::has_token(string_view value, string_view token) {
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        string_view item = value.substr(0, comma);
+        while (!item.empty() && is_space(item.front())) {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && is_space(item.back())) {
+            item.remove_suffix(1);
+        }
+        // ignore parameters such as "chunked;q=1"
+        item = item.substr(0, item.find(';'));
+        if (iequals(item, token)) {
+            return true;
+        }
+        if (comma == string_view::npos) {
+            break;
+        }
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
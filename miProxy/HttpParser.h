@@ -0,0 +1,98 @@
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * Resumable parser for the head (start line and header fields) of an
+ * HTTP/1.1 request or response.
+ *
+ * The caller keeps appending received bytes to its own buffer and calls
+ * parse() with the whole buffer after every read. The parser remembers how
+ * far it got, so every byte is scanned once no matter how many reads the
+ * head is split over, and it never allocates: fields are recorded as
+ * offsets into the buffer. Since they are offsets, the buffer may move
+ * between calls (e.g. a std::string that grows); the string_view accessors
+ * point into the buffer passed to the last parse() call.
+ *
+ * Once the head is complete the parser also works out how the body is
+ * framed and whether the connection can be kept alive.
+ */
+class HttpParser {
+   public:
+    enum Type { Request, Response };
+    enum class Status { Incomplete, Complete, Error };
+    enum class Framing {
+        None,           // no body
+        ContentLength,  // content_length() bytes follow the head
+        Chunked,        // Transfer-Encoding: chunked
+        UntilClose,     // body ends when the server closes the connection
+    };
+
+    explicit HttpParser(Type type);
+    // forget the current message, e.g. before parsing the next one
+    void reset();
+    Status parse(const char *buf, size_t len);
+
+    // the rest is only meaningful once parse() returned Complete
+    size_t head_length() const { return head_len; }
+    std::string_view method() const { return view(method_span); }
+    std::string_view uri() const { return view(uri_span); }
+    std::string_view version() const { return view(version_span); }
+    int status_code() const { return status; }
+    // offset of the request-uri in the buffer, used to rewrite it
+    size_t uri_offset() const { return uri_span.offset; }
+    // value of the first header with this name (case-insensitive), or empty
+    std::string_view header(std::string_view name) const;
+    bool has_header(std::string_view name) const;
+    std::string_view content_type() const { return header("Content-Type"); }
+    Framing framing() const { return body_framing; }
+    size_t content_length() const { return body_length; }
+    bool keep_alive() const { return persistent; }
+
+    // helpers shared with the rest of the proxy
+    static bool iequals(std::string_view a, std::string_view b);
+    static bool has_token(std::string_view value, std::string_view token);
+
+   private:
+    enum class State { StartLine, Headers, Done, Failed };
+    struct Span {
+        uint32_t offset = 0;
+        uint32_t length = 0;
+    };
+    struct Field {
+        Span name;
+        Span value;
+    };
+
+    static const size_t MAX_HEAD_SIZE = 64 * 1024;
+    static const size_t MAX_HEADERS = 64;
+
+    const Type type;
+    State state;
+    const char *base;
+    size_t line_start;  // start of the line being scanned
+    size_t scan;        // bytes before this hold no line break
+    size_t head_len;
+
+    Span method_span;
+    Span uri_span;
+    Span version_span;
+    int status;
+    Field fields[MAX_HEADERS];
+    size_t field_count;
+
+    Framing body_framing;
+    size_t body_length;
+    bool persistent;
+
+    std::string_view view(Span span) const { return std::string_view(base + span.offset, span.length); }
+    bool parse_start_line(size_t begin, size_t end);
+    bool parse_field(size_t begin, size_t end);
+    bool finish();
+    Status fail();
+};
+
+#endif
@@ -0,0 +1,57 @@
+#include "ManifestCache.h"
+
+#include <algorithm>
+
+#include "HttpParser.h"
+
+using namespace std;
+using namespace std::chrono;
+
+ManifestCache::ManifestCache(milliseconds ttl) : ttl(ttl) {}
+
+milliseconds ManifestCache::lifetime(string_view cache_control) const {
+    if (!enabled() || HttpParser::has_token(cache_control, "no-store") ||
+        HttpParser::has_token(cache_control, "no-cache") || HttpParser::has_token(cache_control, "private")) {
+        return milliseconds(0);
+    }
+    // max-age=<seconds>, anywhere in the list
+    size_t pos = cache_control.find("max-age=");
+    if (pos == string_view::npos) {
+        return ttl;
+    }
+    long long seconds = 0;
+    size_t digits = 0;
+    for (pos += 8; pos < cache_control.size() && cache_control[pos] >= '0' && cache_control[pos] <= '9'; ++pos) {
+        seconds = min(seconds * 10 + (cache_control[pos] - '0'), 365LL * 24 * 3600);
+        digits++;
+    }
+    return digits > 0 ? milliseconds(seconds * 1000) : ttl;
+}
+
+ManifestCache::EntryPtr ManifestCache::find(const string &key) {
+    lock_guard<mutex> guard(lock);
+    auto it = entries.find(key);
+    if (it != entries.end() && it->second->expires <= steady_clock::now()) {
+        entries.erase(it);
+        it = entries.end();
+    }
+    counters.entries = entries.size();
+    if (it == entries.end()) {
+        counters.misses++;
+        return nullptr;
+    }
+    counters.hits++;
+    return it->second;
+}
+
+void ManifestCache::insert(const string &key, EntryPtr entry) {
+    lock_guard<mutex> guard(lock);
+    entries[key] = move(entry);
+    counters.insertions++;
+    counters.entries = entries.size();
+}
+
+ManifestCache::Stats ManifestCache::stats() const {
+    lock_guard<mutex> guard(lock);
+    return counters;
+}
@@ -0,0 +1,58 @@
+#ifndef MANIFESTCACHE_H
+#define MANIFESTCACHE_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "FragmentCache.h"
+
+/**
+ * Manifests of the videos sessions have started, shared by all workers.
+ *
+ * An entry keeps what a new session needs from the two manifests of a
+ * video: the bitrates listed in the full manifest, and the no-list manifest
+ * that is sent to the browser. Entries expire after the max-age the origin
+ * gave them, or after ttl if it gave none. A ttl of 0 disables the cache.
+ */
+class ManifestCache {
+   public:
+    struct Entry {
+        std::vector<int> bitrates;  // sorted, in kbps
+        FragmentCache::EntryPtr no_list;
+        std::chrono::steady_clock::time_point expires;
+    };
+    using EntryPtr = std::shared_ptr<const Entry>;
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;  // expired entries included
+        uint64_t insertions = 0;
+        size_t entries = 0;
+    };
+
+    explicit ManifestCache(std::chrono::milliseconds ttl);
+    ManifestCache(const ManifestCache &) = delete;
+    ManifestCache &operator=(const ManifestCache &) = delete;
+
+    bool enabled() const { return ttl.count() > 0; }
+    // how long a response with this Cache-Control stays fresh, 0 if it must
+    // not be stored
+    std::chrono::milliseconds lifetime(std::string_view cache_control) const;
+    // the fresh entry for key, or null; counts a hit or a miss
+    EntryPtr find(const std::string &key);
+    void insert(const std::string &key, EntryPtr entry);
+    Stats stats() const;
+
+   private:
+    const std::chrono::milliseconds ttl;
+    mutable std::mutex lock;
+    std::unordered_map<std::string, EntryPtr> entries;
+    Stats counters;
+};
+
+#endif
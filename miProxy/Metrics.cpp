@@ -0,0 +1,140 @@
+#include "Metrics.h"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+using namespace std;
+
+// seconds to fetch a fragment, and kbps
+static const vector<double> SECONDS_BOUNDS = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+static const vector<double> KBPS_BOUNDS = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 1000000};
+
+Histogram::Histogram(vector<double> bounds)
+    : upper(move(bounds)), counts(new Counter[upper.size() + 1]) {}
+
+void Histogram::observe(double v) {
+    size_t i = static_cast<size_t>(lower_bound(upper.begin(), upper.end(), v) - upper.begin());
+    counts[i].add();
+    total.set(total.get() + v);
+}
+
+WorkerMetrics::WorkerMetrics() : fragment_seconds(SECONDS_BOUNDS), estimates(KBPS_BOUNDS) {}
+
+Metrics::Metrics(int workers) {
+    for (int i = 0; i < workers; ++i) {
+        this->workers.emplace_back(new WorkerMetrics());
+    }
+}
+
+static void header(ostringstream &out, const char *name, const char *type, const char *help) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+string Metrics::render() const {
+    ostringstream out;
+    out.precision(12);
+    // a counter or gauge summed over the workers
+    auto total = [this, &out](const char *name, const char *type, const char *help, auto value) {
+        decltype(value(*workers[0])) sum = 0;
+        for (auto &w : workers) {
+            sum += value(*w);
+        }
+        header(out, name, type, help);
+        out << name << " " << sum << "\n";
+    };
+    auto histogram = [this, &out](const char *name, const char *help, const Histogram WorkerMetrics::*field) {
+        const vector<double> &bounds = (workers[0].get()->*field).bounds();
+        vector<uint64_t> counts(bounds.size() + 1);
+        double sum = 0;
+        for (auto &w : workers) {
+            const Histogram &h = w.get()->*field;
+            for (size_t i = 0; i < counts.size(); ++i) {
+                counts[i] += h.bucket(i);
+            }
+            sum += h.sum();
+        }
+        header(out, name, "histogram", help);
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            cumulative += counts[i];
+            out << name << "_bucket{le=\"";
+            if (i < bounds.size()) {
+                out << bounds[i];
+            } else {
+                out << "+Inf";
+            }
+            out << "\"} " << cumulative << "\n";
+        }
+        out << name << "_sum " << sum << "\n" << name << "_count " << cumulative << "\n";
+    };
+
+    total("miproxy_sessions", "gauge", "Browsers with an open connection.",
+          [](const WorkerMetrics &w) { return w.sessions.get(); });
+    total("miproxy_connections", "gauge", "Open connections from browsers.",
+          [](const WorkerMetrics &w) { return w.connections.get(); });
+    total("miproxy_accepted_total", "counter", "Connections accepted from browsers.",
+          [](const WorkerMetrics &w) { return w.accepted.get(); });
+    total("miproxy_requests_total", "counter", "Requests from browsers.",
+          [](const WorkerMetrics &w) { return w.requests.get(); });
+    total("miproxy_cache_hits_total", "counter", "Fragment requests answered from the memory or disk cache.",
+          [](const WorkerMetrics &w) { return w.cache_hits.get(); });
+    total("miproxy_origin_connects_total", "counter", "Connections opened to web servers for browser requests.",
+          [](const WorkerMetrics &w) { return w.origin_connects.get(); });
+    total("miproxy_origin_connect_failures_total", "counter", "Connections to web servers that failed or timed out.",
+          [](const WorkerMetrics &w) { return w.origin_connect_failures.get(); });
+    total("miproxy_origin_reuses_total", "counter", "Requests sent on a pooled keep-alive connection.",
+          [](const WorkerMetrics &w) { return w.origin_reuses.get(); });
+    total("miproxy_client_bytes_total", "counter", "Bytes written to browsers.",
+          [](const WorkerMetrics &w) { return w.bytes_to_clients.get(); });
+    total("miproxy_origin_bytes_total", "counter", "Bytes read from web servers for browser requests.",
+          [](const WorkerMetrics &w) { return w.bytes_from_origins.get(); });
+    histogram("miproxy_fragment_seconds", "Time from sending a fragment request to its last byte.",
+              &WorkerMetrics::fragment_seconds);
+    histogram("miproxy_throughput_estimate_kbps", "Session throughput estimates after each fragment.",
+              &WorkerMetrics::estimates);
+
+    // labels may have been added to any worker, in any order
+    struct Origin {
+        uint64_t fragments = 0;
+        uint64_t bytes = 0;
+        double throughput = 0;
+        int estimates = 0;
+    };
+    map<string, Origin> origins;
+    map<string, uint64_t> bitrates;
+    for (auto &w : workers) {
+        for (size_t i = 0; i < w->origins.size(); ++i) {
+            const OriginMetrics &m = w->origins.at(i);
+            Origin &o = origins[w->origins.label(i)];
+            o.fragments += m.fragments.get();
+            o.bytes += m.bytes.get();
+            if (m.fragments.get() > 0) {
+                o.throughput += m.throughput.get();
+                o.estimates++;
+            }
+        }
+        for (size_t i = 0; i < w->bitrates.size(); ++i) {
+            bitrates[w->bitrates.label(i)] += w->bitrates.at(i).get();
+        }
+    }
+    header(out, "miproxy_origin_fragments_total", "counter", "Fragments fetched, by web server.");
+    for (auto &o : origins) {
+        out << "miproxy_origin_fragments_total{origin=\"" << o.first << "\"} " << o.second.fragments << "\n";
+    }
+    header(out, "miproxy_origin_fragment_bytes_total", "counter", "Bytes of the fragments fetched, by web server.");
+    for (auto &o : origins) {
+        out << "miproxy_origin_fragment_bytes_total{origin=\"" << o.first << "\"} " << o.second.bytes << "\n";
+    }
+    header(out, "miproxy_origin_throughput_kbps", "gauge",
+           "EWMA of the fragment throughputs, by web server, averaged over the workers.");
+    for (auto &o : origins) {
+        double ewma = o.second.estimates > 0 ? o.second.throughput / o.second.estimates : 0;
+        out << "miproxy_origin_throughput_kbps{origin=\"" << o.first << "\"} " << ewma << "\n";
+    }
+    header(out, "miproxy_bitrate_requests_total", "counter", "Fragment requests, by the bitrate chosen.");
+    for (auto &b : bitrates) {
+        out << "miproxy_bitrate_requests_total{bitrate=\"" << b.first << "\"} " << b.second << "\n";
+    }
+    return out.str();
+}
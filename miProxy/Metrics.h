@@ -0,0 +1,135 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * What the proxy counts for /metrics on the admin port.
+ *
+ * Every worker updates its own WorkerMetrics, and nothing else writes to
+ * them. The page may be rendered by any worker, so every value is an atomic
+ * with a single writer: an update is a relaxed load and store, with no
+ * locked instruction and no lock, and a reader sees every value whole,
+ * though not all of them at the same instant.
+ */
+
+// Only ever goes up.
+class Counter {
+   public:
+    void add(uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+   private:
+    std::atomic<uint64_t> value{0};
+};
+
+class Gauge {
+   public:
+    void set(double v) { value.store(v, std::memory_order_relaxed); }
+    double get() const { return value.load(std::memory_order_relaxed); }
+
+   private:
+    std::atomic<double> value{0};
+};
+
+// Counts of observations at or below each bound, and their sum.
+class Histogram {
+   public:
+    // bounds ascending; one more bucket takes everything above the last
+    explicit Histogram(std::vector<double> bounds);
+    void observe(double v);
+
+    const std::vector<double> &bounds() const { return upper; }
+    uint64_t bucket(size_t i) const { return counts[i].get(); }  // not cumulative
+    double sum() const { return total.get(); }
+
+   private:
+    std::vector<double> upper;
+    std::unique_ptr<Counter[]> counts;
+    Gauge total;
+};
+
+// Values by a label, such as an origin ip. A label gets a slot the first
+// time it is used and keeps it; the slots beyond MAX_LABELS - 1 are all
+// counted under "other". Only the worker calls get().
+template <typename T>
+class Labeled {
+   public:
+    static const size_t MAX_LABELS = 64;
+
+    T &get(const std::string &label) {
+        auto it = index.find(label);
+        if (it != index.end()) {
+            return slots[it->second].value;
+        }
+        size_t i = used.load(std::memory_order_relaxed);
+        if (i == MAX_LABELS) {
+            return slots[MAX_LABELS - 1].value;
+        }
+        slots[i].label = i == MAX_LABELS - 1 ? "other" : label;
+        index[label] = i;
+        // the label is written before readers get to see the slot
+        used.store(i + 1, std::memory_order_release);
+        return slots[i].value;
+    }
+
+    size_t size() const { return used.load(std::memory_order_acquire); }
+    const std::string &label(size_t i) const { return slots[i].label; }
+    const T &at(size_t i) const { return slots[i].value; }
+
+   private:
+    struct Slot {
+        std::string label;
+        T value;
+    };
+    Slot slots[MAX_LABELS];
+    std::atomic<size_t> used{0};
+    std::unordered_map<std::string, size_t> index;
+};
+
+struct OriginMetrics {
+    Counter fragments;
+    Counter bytes;
+    Gauge throughput;  // EWMA of the fragment throughputs, in kbps
+};
+
+struct WorkerMetrics {
+    WorkerMetrics();
+
+    Gauge sessions;
+    Gauge connections;  // from browsers
+    Counter accepted;
+    Counter requests;
+    Counter cache_hits;  // requests answered from one of the caches
+    Counter origin_connects;  // opened for browser requests
+    Counter origin_connect_failures;
+    Counter origin_reuses;  // requests sent on a pooled connection
+    Counter bytes_to_clients;
+    Counter bytes_from_origins;
+    Histogram fragment_seconds;  // the duration of the log
+    Histogram estimates;  // session throughput estimates after each fragment, kbps
+    Labeled<OriginMetrics> origins;
+    Labeled<Counter> bitrates;  // requests by the bitrate chosen
+};
+
+class Metrics {
+   public:
+    explicit Metrics(int workers);
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+    WorkerMetrics &worker(int i) { return *workers[static_cast<size_t>(i)]; }
+    // all workers added up, in the Prometheus text format
+    std::string render() const;
+
+   private:
+    std::vector<std::unique_ptr<WorkerMetrics>> workers;
+};
+
+#endif
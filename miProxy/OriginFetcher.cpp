@@ -0,0 +1,302 @@
+#include "OriginFetcher.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Logger.h"
+
+using namespace std;
+using namespace std::chrono;
+
+OriginFetcher::OriginFetcher(EventLoop &loop, OriginPool &pool, milliseconds connect_timeout)
+    : loop(loop), pool(pool), connect_timeout(connect_timeout), next_id(1) {}
+
+OriginFetcher::~OriginFetcher() {
+    for (auto &it : fetches) {
+        close_socket(*it.second);
+    }
+}
+
+OriginFetcher::FetchId OriginFetcher::fetch(const string &origin, string request, Callback callback) {
+    FetchId id = next_id++;
+    unique_ptr<Fetch> fetch(new Fetch);
+    fetch->id = id;
+    fetch->origin = origin;
+    fetch->request = move(request);
+    fetch->callback = move(callback);
+    Fetch &f = *fetch;
+    fetches[id] = move(fetch);
+    start(f);
+    return id;
+}
+
+void OriginFetcher::cancel(FetchId id) {
+    auto it = fetches.find(id);
+    if (it == fetches.end()) {
+        return;
+    }
+    // a borrowed socket may still get the response, it cannot be reused
+    close_socket(*it->second);
+    fetches.erase(it);
+}
+
+void OriginFetcher::start(Fetch &fetch) {
+    fetch.fd = pool.acquire(fetch.origin);
+    if (fetch.fd != -1) {
+        fetch.reused = true;
+        FetchId id = fetch.id;
+        loop.add(fetch.fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, [this, id](uint32_t events) { handle_event(id, events); });
+        if (!send_request(fetch)) {
+            // callbacks only ever run from the event loop
+            loop.add_timer(milliseconds(0), [this, id]() { fail(id); });
+        }
+        return;
+    }
+    if (!pool.can_open(fetch.origin)) {
+        fetch.waiting = true;
+        FetchId id = fetch.id;
+        pool.wait(fetch.origin, [this, id]() {
+            auto it = fetches.find(id);
+            if (it == fetches.end() || !it->second->waiting) {
+                return false;
+            }
+            it->second->waiting = false;
+            start(*it->second);
+            return true;
+        });
+        return;
+    }
+    connect(fetch);
+}
+
+void OriginFetcher::connect(Fetch &fetch) {
+    FetchId id = fetch.id;
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(80);
+    if (inet_pton(AF_INET, fetch.origin.c_str(), &address.sin_addr) != 1) {
+        loop.add_timer(milliseconds(0), [this, id]() { fail(id); });
+        return;
+    }
+    fetch.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fetch.fd < 0) {
+        // out of fds, say: the fetch fails, the worker goes on
+        LOG_WARN << "Opening a socket to " << fetch.origin << " failed: " << strerror(errno);
+        fetch.fd = -1;
+        fetch.reused = false;
+        loop.add_timer(milliseconds(0), [this, id]() { fail(id); });
+        return;
+    }
+    pool.opened(fetch.origin);
+    fetch.reused = false;
+    if (::connect(fetch.fd, (sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+        loop.add_timer(milliseconds(0), [this, id]() { fail(id); });
+        return;
+    }
+    fetch.connecting = true;
+    loop.add(fetch.fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, [this, id](uint32_t events) { handle_event(id, events); });
+    fetch.connect_timer = loop.add_timer(connect_timeout, [this, id]() {
+        auto it = fetches.find(id);
+        if (it != fetches.end()) {
+            it->second->connect_timer = 0;
+            fail(id);
+        }
+    });
+}
+
+void OriginFetcher::handle_event(FetchId id, uint32_t events) {
+    auto it = fetches.find(id);
+    if (it == fetches.end()) {
+        return;
+    }
+    Fetch &fetch = *it->second;
+    if (fetch.connecting) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(fetch.fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+            error = errno;
+        }
+        if (error == 0 && !(events & EPOLLOUT)) {
+            return;  // still in progress
+        }
+        if (error != 0) {
+            fail(id);
+            return;
+        }
+        fetch.connecting = false;
+        loop.cancel_timer(fetch.connect_timer);
+        fetch.connect_timer = 0;
+    }
+    if (!send_request(fetch)) {
+        fail(id);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        int status = read_response(fetch);
+        if (status > 0) {
+            finish(id);
+        } else if (status < 0) {
+            fail(id);
+        }
+    }
+}
+
+bool OriginFetcher::send_request(Fetch &fetch) {
+    while (fetch.sent < fetch.request.size()) {
+        ssize_t n = send(fetch.fd, fetch.request.data() + fetch.sent, fetch.request.size() - fetch.sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n < 0) {
+            return false;
+        }
+        fetch.sent += static_cast<size_t>(n);
+        if (fetch.sent == fetch.request.size()) {
+            fetch.response.sent = steady_clock::now();
+        }
+    }
+    return true;
+}
+
+// Returns 1 once the response is complete, 0 while more is expected and -1
+// if the connection failed.
+int OriginFetcher::read_response(Fetch &fetch) {
+    char buf[16 * 1024];
+    while (true) {
+        ssize_t n = recv(fetch.fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n == 0 && fetch.head_done && fetch.framing == HttpParser::Framing::UntilClose) {
+            fetch.keep_alive = false;
+            return 1;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        if (fetch.in.empty() && !fetch.head_done) {
+            fetch.response.first_byte = steady_clock::now();
+        }
+        fetch.in.append(buf, static_cast<size_t>(n));
+        int status = handle_response(fetch);
+        if (status != 0) {
+            return status;
+        }
+    }
+}
+
+int OriginFetcher::handle_response(Fetch &fetch) {
+    if (!fetch.head_done) {
+        HttpParser::Status status = fetch.parser.parse(fetch.in.data(), fetch.in.size());
+        if (status == HttpParser::Status::Incomplete) {
+            return 0;
+        }
+        if (status == HttpParser::Status::Error) {
+            return -1;
+        }
+        fetch.response.status = fetch.parser.status_code();
+        fetch.response.content_type = string(fetch.parser.content_type());
+        fetch.response.cache_control = string(fetch.parser.header("Cache-Control"));
+        fetch.framing = fetch.parser.framing();
+        fetch.body_remaining = fetch.parser.content_length();
+        fetch.keep_alive = fetch.parser.keep_alive();
+        fetch.in.erase(0, fetch.parser.head_length());
+        fetch.head_done = true;
+    }
+
+    size_t take = 0;
+    bool complete = false;
+    switch (fetch.framing) {
+        case HttpParser::Framing::None:
+            complete = true;
+            break;
+        case HttpParser::Framing::ContentLength:
+            take = min(fetch.in.size(), fetch.body_remaining);
+            fetch.response.body.append(fetch.in, 0, take);
+            fetch.body_remaining -= take;
+            complete = fetch.body_remaining == 0;
+            break;
+        case HttpParser::Framing::Chunked: {
+            ChunkedDecoder::Status status = fetch.decoder.decode(fetch.in.data(), fetch.in.size(), take,
+                                                                 &fetch.response.body);
+            if (status == ChunkedDecoder::Status::Error) {
+                return -1;
+            }
+            complete = status == ChunkedDecoder::Status::Complete;
+            break;
+        }
+        case HttpParser::Framing::UntilClose:
+            take = fetch.in.size();
+            fetch.response.body.append(fetch.in);
+            break;
+    }
+    fetch.in.erase(0, take);
+    if (complete && !fetch.in.empty()) {
+        fetch.keep_alive = false;  // the origin sent more than it was asked for
+    }
+    return complete ? 1 : 0;
+}
+
+void OriginFetcher::close_socket(Fetch &fetch) {
+    loop.cancel_timer(fetch.connect_timer);
+    fetch.connect_timer = 0;
+    fetch.connecting = false;
+    fetch.waiting = false;
+    if (fetch.fd != -1) {
+        loop.remove(fetch.fd);
+        close(fetch.fd);
+        pool.closed(fetch.origin);
+        fetch.fd = -1;
+    }
+}
+
+void OriginFetcher::fail(FetchId id) {
+    auto it = fetches.find(id);
+    if (it == fetches.end()) {
+        return;
+    }
+    Fetch &fetch = *it->second;
+    close_socket(fetch);
+    if (fetch.reused && !fetch.retried && !fetch.head_done && fetch.in.empty()) {
+        // the origin closed the idle connection before it got the request
+        LOG_DEBUG << "Retrying fetch from " << fetch.origin << " on a new connection";
+        fetch.retried = true;
+        fetch.sent = 0;
+        connect(fetch);
+        return;
+    }
+    LOG_DEBUG << "Fetch from " << fetch.origin << " failed";
+    Response response = move(fetch.response);
+    Callback callback = move(fetch.callback);
+    fetches.erase(it);
+    callback(response);
+}
+
+void OriginFetcher::finish(FetchId id) {
+    auto it = fetches.find(id);
+    Fetch &fetch = *it->second;
+    if (fetch.keep_alive) {
+        pool.release(fetch.origin, fetch.fd);
+        fetch.fd = -1;
+    } else {
+        close_socket(fetch);
+    }
+    Response response = move(fetch.response);
+    response.ok = true;
+    Callback callback = move(fetch.callback);
+    fetches.erase(it);
+    callback(response);
+}
@@ -0,0 +1,92 @@
+#ifndef ORIGINFETCHER_H
+#define ORIGINFETCHER_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "ChunkedDecoder.h"
+#include "EventLoop.h"
+#include "HttpParser.h"
+#include "OriginPool.h"
+
+/**
+ * Requests the proxy makes to origins on its own behalf, not relayed to a
+ * browser, e.g. the manifests it keeps in its manifest cache.
+ *
+ * Every fetch borrows its own socket from the origin pool, so fetches run
+ * concurrently with each other and with the browsers' requests. The whole
+ * response is read into memory and handed to the callback; the socket goes
+ * back to the pool if the origin keeps it open. A fetch that fails on a
+ * reused keep-alive socket before any of the response arrived is retried
+ * once on a new connection, since the origin may have closed it meanwhile.
+ */
+class OriginFetcher {
+   public:
+    struct Response {
+        bool ok = false;  // a complete response was read
+        int status = 0;
+        std::string content_type;
+        std::string cache_control;
+        std::string body;  // without transfer coding
+        std::chrono::steady_clock::time_point sent;  // the request was written
+        std::chrono::steady_clock::time_point first_byte;  // of the response
+    };
+    using Callback = std::function<void(Response &response)>;
+    using FetchId = uint64_t;  // 0 is never a valid id
+
+    OriginFetcher(EventLoop &loop, OriginPool &pool, std::chrono::milliseconds connect_timeout);
+    ~OriginFetcher();
+    OriginFetcher(const OriginFetcher &) = delete;
+    OriginFetcher &operator=(const OriginFetcher &) = delete;
+
+    // send request (a complete HTTP/1.1 request) to port 80 of origin
+    FetchId fetch(const std::string &origin, std::string request, Callback callback);
+    // drop a fetch, its callback is not called; unknown ids are a no-op
+    void cancel(FetchId id);
+    size_t in_flight() const { return fetches.size(); }
+
+   private:
+    struct Fetch {
+        FetchId id;
+        std::string origin;
+        std::string request;
+        Callback callback;
+        int fd = -1;
+        bool connecting = false;
+        bool waiting = false;  // for the pool to allow another socket
+        bool reused = false;  // socket came from the pool
+        bool retried = false;
+        EventLoop::TimerId connect_timer = 0;
+        size_t sent = 0;  // bytes of request written
+        std::string in;  // response bytes not handled yet
+        HttpParser parser{HttpParser::Response};
+        bool head_done = false;
+        HttpParser::Framing framing = HttpParser::Framing::None;
+        size_t body_remaining = 0;  // for Content-Length framing
+        ChunkedDecoder decoder;
+        Response response;
+        bool keep_alive = false;
+    };
+
+    EventLoop &loop;
+    OriginPool &pool;
+    const std::chrono::milliseconds connect_timeout;
+    std::unordered_map<FetchId, std::unique_ptr<Fetch>> fetches;
+    FetchId next_id;
+
+    void start(Fetch &fetch);
+    void connect(Fetch &fetch);
+    void handle_event(FetchId id, uint32_t events);
+    bool send_request(Fetch &fetch);
+    int read_response(Fetch &fetch);
+    int handle_response(Fetch &fetch);
+    void close_socket(Fetch &fetch);
+    void fail(FetchId id);
+    void finish(FetchId id);
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include "OriginPool.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Logger.h"
+
+using namespace std;
+using namespace std::chrono;
+
+OriginPool::OriginPool(EventLoop &loop, size_t max_idle, size_t max_total, milliseconds idle_timeout)
+    : loop(loop), max_idle(max_idle), max_total(max_total), idle_timeout(idle_timeout), sweep_timer(0) {}
+
+OriginPool::~OriginPool() {
+    loop.cancel_timer(sweep_timer);
+    for (auto &origin : origins) {
+        for (const IdleSocket &socket : origin.second.idle) {
+            loop.remove(socket.fd);
+            close(socket.fd);
+        }
+    }
+}
+
+int OriginPool::acquire(const string &origin) {
+    auto it = origins.find(origin);
+    if (it == origins.end()) {
+        return -1;
+    }
+    Origin &entry = it->second;
+    steady_clock::time_point now = steady_clock::now();
+    while (!entry.idle.empty()) {
+        IdleSocket socket = entry.idle.back();
+        if (now - socket.since > idle_timeout) {
+            close_idle(entry, entry.idle.size() - 1);
+            continue;
+        }
+        // a closed socket reads 0, a healthy idle one has nothing to read
+        char byte;
+        ssize_t n = recv(socket.fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            entry.idle.pop_back();
+            LOG_DEBUG << "Reusing server socket " << socket.fd << " to " << origin;
+            return socket.fd;
+        }
+        close_idle(entry, entry.idle.size() - 1);
+    }
+    return -1;
+}
+
+void OriginPool::release(const string &origin, int fd) {
+    Origin &entry = origins[origin];
+    if (max_idle == 0) {
+        loop.remove(fd);
+        close(fd);
+        entry.total--;
+        notify(entry);
+        return;
+    }
+    if (entry.idle.size() >= max_idle) {
+        close_idle(entry, 0);  // make room by dropping the oldest
+    }
+    entry.idle.push_back({fd, steady_clock::now()});
+    loop.add(fd, EPOLLIN | EPOLLRDHUP, [this, origin, fd](uint32_t) { discard(origin, fd); });
+    if (sweep_timer == 0) {
+        sweep_timer = loop.add_timer(idle_timeout, [this]() { sweep(); });
+    }
+    notify(entry);
+}
+
+bool OriginPool::can_open(const string &origin) const {
+    if (max_total == 0) {
+        return true;
+    }
+    auto it = origins.find(origin);
+    return it == origins.end() || it->second.total < max_total;
+}
+
+void OriginPool::opened(const string &origin) {
+    origins[origin].total++;
+}
+
+void OriginPool::closed(const string &origin) {
+    Origin &entry = origins[origin];
+    if (entry.total > 0) {
+        entry.total--;
+    }
+    notify(entry);
+}
+
+void OriginPool::wait(const string &origin, Waiter waiter) {
+    origins[origin].waiters.push_back(move(waiter));
+}
+
+void OriginPool::discard(const string &origin, int fd) {
+    Origin &entry = origins[origin];
+    for (size_t i = 0; i < entry.idle.size(); ++i) {
+        if (entry.idle[i].fd == fd) {
+            LOG_DEBUG << "Idle server socket " << fd << " to " << origin << " closed";
+            close_idle(entry, i);
+            notify(entry);
+            return;
+        }
+    }
+}
+
+void OriginPool::close_idle(Origin &entry, size_t index) {
+    int fd = entry.idle[index].fd;
+    loop.remove(fd);
+    close(fd);
+    entry.idle.erase(entry.idle.begin() + index);
+    entry.total--;
+}
+
+// hand the freed capacity to the first session still waiting for it
+void OriginPool::notify(Origin &entry) {
+    while (!entry.waiters.empty()) {
+        Waiter waiter = move(entry.waiters.front());
+        entry.waiters.pop_front();
+        if (waiter()) {
+            return;
+        }
+    }
+}
+
+void OriginPool::sweep() {
+    sweep_timer = 0;
+    steady_clock::time_point now = steady_clock::now();
+    bool any_idle = false;
+    for (auto &origin : origins) {
+        Origin &entry = origin.second;
+        while (!entry.idle.empty() && now - entry.idle.front().since > idle_timeout) {
+            close_idle(entry, 0);
+        }
+        any_idle = any_idle || !entry.idle.empty();
+    }
+    if (any_idle) {
+        sweep_timer = loop.add_timer(idle_timeout, [this]() { sweep(); });
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef ORIGINPOOL_H
+#define ORIGINPOOL_H
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "EventLoop.h"
+
+/**
+ * Keep-alive connections to origin servers, grouped by origin ip.
+ *
+ * A client session borrows a connected socket for a request with acquire()
+ * and hands it back with release() once the response is complete, so
+ * fragment requests skip the TCP handshake. Every origin has at most
+ * max_idle idle sockets and at most max_total sockets in all (0 means no
+ * limit); a session that finds the origin at its limit registers with
+ * wait() and is called back when a socket is released or closed.
+ *
+ * Idle sockets stay registered with the event loop: any readiness on them
+ * means the origin closed the connection (or sent garbage), and they are
+ * discarded. acquire() hands out the most recently used socket first and
+ * peeks it once more before returning it. Sockets idle for longer than
+ * idle_timeout are closed.
+ */
+class OriginPool {
+   public:
+    // returns false if the waiter is gone and the next one should be tried
+    using Waiter = std::function<bool()>;
+
+    OriginPool(EventLoop &loop, size_t max_idle, size_t max_total,
+               std::chrono::milliseconds idle_timeout);
+    ~OriginPool();
+    OriginPool(const OriginPool &) = delete;
+    OriginPool &operator=(const OriginPool &) = delete;
+
+    // a healthy idle socket to origin, or -1
+    int acquire(const std::string &origin);
+    // return a borrowed socket that can carry another request
+    void release(const std::string &origin, int fd);
+    // whether another socket to origin may be opened
+    bool can_open(const std::string &origin) const;
+    // account for a socket the caller opened / closed itself
+    void opened(const std::string &origin);
+    void closed(const std::string &origin);
+    // call waiter once a socket to origin is released or closed
+    void wait(const std::string &origin, Waiter waiter);
+
+   private:
+    struct IdleSocket {
+        int fd;
+        std::chrono::steady_clock::time_point since;
+    };
+    struct Origin {
+        std::vector<IdleSocket> idle;  // oldest first
+        std::deque<Waiter> waiters;
+        size_t total = 0;  // idle and borrowed sockets
+    };
+
+    EventLoop &loop;
+    const size_t max_idle;
+    const size_t max_total;
+    const std::chrono::milliseconds idle_timeout;
+    std::unordered_map<std::string, Origin> origins;
+    EventLoop::TimerId sweep_timer;
+
+    void discard(const std::string &origin, int fd);
+    void close_idle(Origin &entry, size_t index);
+    void notify(Origin &entry);
+    void sweep();
+};
+
+#endif
@@ -0,0 +1,87 @@
+#include "OutputQueue.h"
+
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+void OutputQueue::append(const char *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (chunks.empty() || chunks.back().file != -1 || chunks.back().data.size() + len > CHUNK_SIZE) {
+        chunks.emplace_back();
+    }
+    chunks.back().data.append(data, len);
+    total += len;
+}
+
+void OutputQueue::append_file(shared_ptr<const void> owner, int fd, off_t offset, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    Chunk chunk;
+    chunk.file_owner = move(owner);
+    chunk.file = fd;
+    chunk.file_offset = offset;
+    chunk.file_length = len;
+    chunks.push_back(move(chunk));
+    total += len;
+}
+
+bool OutputQueue::flush(int fd) {
+    while (total > 0) {
+        ssize_t n;
+        if (chunks.front().file != -1) {
+            const Chunk &chunk = chunks.front();
+            off_t file_offset = chunk.file_offset + static_cast<off_t>(offset);
+            n = sendfile(fd, chunk.file, &file_offset, chunk.file_length - offset);
+        } else {
+            // memory chunks up to the next file range go out together
+            struct iovec iov[MAX_IOV];
+            int pieces = 0;
+            for (auto it = chunks.begin(); it != chunks.end() && it->file == -1 && pieces < MAX_IOV;
+                 ++it, ++pieces) {
+                size_t skip = pieces == 0 ? offset : 0;
+                iov[pieces].iov_base = const_cast<char *>(it->data.data()) + skip;
+                iov[pieces].iov_len = it->data.size() - skip;
+            }
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = static_cast<size_t>(pieces);
+            n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n <= 0) {
+            // sendfile() returns 0 if the file was truncated under it
+            return false;
+        }
+
+        size_t written = static_cast<size_t>(n);
+        total -= written;
+        while (written > 0) {
+            size_t left = chunks.front().size() - offset;
+            if (written < left) {
+                offset += written;
+                break;
+            }
+            written -= left;
+            chunks.pop_front();
+            offset = 0;
+        }
+    }
+    return true;
+}
+
+void OutputQueue::clear() {
+    chunks.clear();
+    offset = 0;
+    total = 0;
+}
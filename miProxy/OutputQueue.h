@@ -0,0 +1,50 @@
+#ifndef OUTPUTQUEUE_H
+#define OUTPUTQUEUE_H
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+
+/**
+ * Bytes waiting for a non-blocking socket to accept them.
+ *
+ * Writers append what the socket did not take right away and flush() again
+ * once the event loop reports the socket writable. flush() hands several
+ * queued pieces to the kernel with one sendmsg() and never raises SIGPIPE.
+ * A range of a file can be queued too; it is written with sendfile() when
+ * it reaches the front, so its bytes are never copied into the queue.
+ */
+class OutputQueue {
+   public:
+    size_t size() const { return total; }
+    bool empty() const { return total == 0; }
+    void append(const char *data, size_t len);
+    // queue len bytes of fd from offset; owner keeps fd open until they are sent
+    void append_file(std::shared_ptr<const void> owner, int fd, off_t offset, size_t len);
+    // write as much as fd takes; false if the socket failed
+    bool flush(int fd);
+    void clear();
+
+   private:
+    static const size_t CHUNK_SIZE = 64 * 1024;  // small appends are merged up to this
+    static const int MAX_IOV = 16;
+
+    struct Chunk {
+        std::string data;
+        std::shared_ptr<const void> file_owner;  // set for a file range
+        int file = -1;
+        off_t file_offset = 0;
+        size_t file_length = 0;
+
+        size_t size() const { return file == -1 ? data.size() : file_length; }
+    };
+
+    std::deque<Chunk> chunks;
+    size_t offset = 0;  // bytes of the first chunk already written
+    size_t total = 0;
+};
+
+#endif
@@ -0,0 +1,196 @@
+#include "Profiler.h"
+
+#ifdef STAGE_PROFILE
+
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "Metrics.h"
+
+using namespace std;
+
+// Ticks are bucketed log-linearly: 8 buckets per power of two, so a
+// percentile is within 12.5% of the true value.
+static const int SUB_BITS = 3;
+static const size_t SUB_BUCKETS = 1 << SUB_BITS;
+static const size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+static const size_t STAGES = static_cast<size_t>(Stage::COUNT);
+static const char *STAGE_NAMES[STAGES] = {"parse_header", "parse_bitrate", "parse_xml", "abr", "accept",
+                                          "connect",      "recv",          "send",      "splice", "log"};
+
+static size_t bucket_of(uint64_t ticks) {
+    if (ticks < SUB_BUCKETS) {
+        return static_cast<size_t>(ticks);
+    }
+    int msb = 63 - __builtin_clzll(ticks);
+    size_t sub = static_cast<size_t>(ticks >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return static_cast<size_t>(msb - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// the largest tick count in a bucket
+static uint64_t bucket_top(size_t i) {
+    if (i < SUB_BUCKETS) {
+        return i;
+    }
+    int shift = static_cast<int>(i / SUB_BUCKETS) - 1;
+    uint64_t low = (SUB_BUCKETS + i % SUB_BUCKETS) << shift;
+    return low + (uint64_t(1) << shift) - 1;
+}
+
+namespace {
+
+// One thread's timings. Only that thread writes them, the Counters of the
+// metrics make them safe to read from any other.
+struct ThreadStages {
+    Counter buckets[STAGES][BUCKETS];
+    Counter ticks[STAGES];
+    Counter fragments;
+};
+
+struct Registry {
+    mutex lock;
+    vector<ThreadStages *> threads;  // never freed, the threads live as long as the proxy
+    // for converting ticks to nanoseconds
+    uint64_t start_ticks = StageProfiler::now();
+    uint64_t start_ns;
+
+    Registry() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        start_ns = uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+    }
+};
+
+}  // namespace
+
+static Registry &registry() {
+    static Registry r;
+    return r;
+}
+
+static ThreadStages &thread_stages() {
+    thread_local ThreadStages *stages = nullptr;
+    if (stages == nullptr) {
+        stages = new ThreadStages();
+        Registry &r = registry();
+        lock_guard<mutex> guard(r.lock);
+        r.threads.push_back(stages);
+    }
+    return *stages;
+}
+
+uint64_t StageProfiler::now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+#endif
+}
+
+void StageProfiler::record(Stage stage, uint64_t ticks) {
+    ThreadStages &stages = thread_stages();
+    size_t s = static_cast<size_t>(stage);
+    stages.buckets[s][bucket_of(ticks)].add();
+    stages.ticks[s].add(ticks);
+}
+
+void StageProfiler::fragment() { thread_stages().fragments.add(); }
+
+string StageProfiler::render() {
+    Registry &r = registry();
+    // ticks per nanosecond, measured over the life of the proxy
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    uint64_t ns = uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec) - r.start_ns;
+    uint64_t ticks = now() - r.start_ticks;
+    double ticks_per_ns = ns > 0 && ticks > 0 ? double(ticks) / double(ns) : 1;
+
+    vector<vector<uint64_t>> buckets(STAGES, vector<uint64_t>(BUCKETS));
+    vector<uint64_t> totals(STAGES);
+    uint64_t fragments = 0;
+    {
+        lock_guard<mutex> guard(r.lock);
+        for (ThreadStages *t : r.threads) {
+            for (size_t s = 0; s < STAGES; ++s) {
+                for (size_t i = 0; i < BUCKETS; ++i) {
+                    buckets[s][i] += t->buckets[s][i].get();
+                }
+                totals[s] += t->ticks[s].get();
+            }
+            fragments += t->fragments.get();
+        }
+    }
+
+    ostringstream out;
+    out << fixed << setprecision(0);
+    out << "fragments " << fragments << ", " << setprecision(3) << ticks_per_ns << " ticks/ns\n";
+    out << left << setw(14) << "stage" << right << setw(10) << "count" << setw(12) << "total_us" << setw(14)
+        << "per_frag_ns" << setw(10) << "mean_ns" << setw(10) << "p50_ns" << setw(10) << "p99_ns" << setw(10)
+        << "p999_ns" << setw(12) << "max_ns" << "\n"
+        << setprecision(0);
+    for (size_t s = 0; s < STAGES; ++s) {
+        uint64_t count = 0;
+        for (uint64_t c : buckets[s]) {
+            count += c;
+        }
+        // the top of the bucket the q-th timing falls in
+        auto quantile = [&](double q) {
+            uint64_t rank = static_cast<uint64_t>(q * double(count - 1));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                seen += buckets[s][i];
+                if (seen > rank) {
+                    return double(bucket_top(i)) / ticks_per_ns;
+                }
+            }
+            return 0.0;
+        };
+        double total_ns = double(totals[s]) / ticks_per_ns;
+        out << left << setw(14) << STAGE_NAMES[s] << right << setw(10) << count << setw(12) << total_ns / 1000;
+        if (count == 0) {
+            out << "\n";
+            continue;
+        }
+        out << setw(14) << (fragments > 0 ? total_ns / double(fragments) : 0) << setw(10)
+            << total_ns / double(count) << setw(10) << quantile(0.5) << setw(10) << quantile(0.99) << setw(10)
+            << quantile(0.999) << setw(12) << quantile(1) << "\n";
+    }
+    return out.str();
+}
+
+void StageProfiler::dump_on_signal(int signal) {
+    registry();  // the tick calibration starts now
+    // the thread starts with every signal blocked, and only ever takes this
+    // one, with sigwait
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, signal);
+    thread([signals]() {
+        while (true) {
+            int received = 0;
+            sigwait(&signals, &received);
+            cerr << render() << flush;
+        }
+    }).detach();
+    sigaddset(&old, signal);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <cstdint>
+#include <string>
+
+/**
+ * Where the time of the hot path goes, stage by stage, in a build made with
+ * `make stages` (-DSTAGE_PROFILE).
+ *
+ * A stage is timed by putting PROFILE_SCOPE(stage) at the top of a block, or
+ * by wrapping a single call in PROFILED(stage, call). Each thread adds its
+ * timings to its own histograms; the summary is printed to stderr on
+ * SIGUSR1 and served at /profile on the admin port.
+ *
+ * In every other build the macros expand to nothing and to the bare call,
+ * and StageProfiler is not compiled at all.
+ */
+
+// the stages are not exclusive: parse_bitrate includes the abr decision
+enum class Stage { ParseHeader, ParseBitrate, ParseXml, Abr, Accept, Connect, Recv, Send, Splice, Log, COUNT };
+
+#ifdef STAGE_PROFILE
+
+class StageProfiler {
+   public:
+    // the TSC where there is one, CLOCK_MONOTONIC_RAW nanoseconds elsewhere
+    static uint64_t now();
+    static void record(Stage stage, uint64_t ticks);
+    // one more fragment done, the summary is also given per fragment
+    static void fragment();
+
+    // count, total, per fragment and percentiles of each stage, all threads
+    static std::string render();
+    // prints render() to stderr on every signal; call first in main, before
+    // any thread is started, so that the others leave the signal to it
+    static void dump_on_signal(int signal);
+};
+
+class StageTimer {
+   public:
+    explicit StageTimer(Stage stage) : stage(stage), start(StageProfiler::now()) {}
+    ~StageTimer() { StageProfiler::record(stage, StageProfiler::now() - start); }
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+
+   private:
+    Stage stage;
+    uint64_t start;
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(stage) StageTimer PROFILE_CONCAT(stage_timer_, __LINE__)(stage)
+#define PROFILED(stage, call)          \
+    ([&]() {                           \
+        StageTimer stage_timer(stage); \
+        return call;                   \
+    }())
+#define PROFILE_FRAGMENT() StageProfiler::fragment()
+
+#else
+
+#define PROFILE_SCOPE(stage) ((void)0)
+#define PROFILED(stage, call) (call)
+#define PROFILE_FRAGMENT() ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+#include "RingBuffer.h"
+
+#include <algorithm>
+
+using namespace std;
+
+RingBuffer::~RingBuffer() {
+    clear();
+}
+
+size_t RingBuffer::space() const {
+    return pool == nullptr ? 0 : pool->block_size() - count;
+}
+
+ssize_t RingBuffer::read_from(int fd, size_t max) {
+    if (block == nullptr) {
+        block = pool->acquire();
+        head = 0;
+    }
+    size_t capacity = pool->block_size();
+    size_t want = min(max, capacity - count);
+    size_t tail = (head + count) % capacity;
+
+    // the free space runs from tail to the end of the block, then wraps
+    struct iovec iov[2];
+    int pieces = 1;
+    iov[0].iov_base = block + tail;
+    iov[0].iov_len = min(want, capacity - tail);
+    if (iov[0].iov_len < want) {
+        iov[1].iov_base = block;
+        iov[1].iov_len = want - iov[0].iov_len;
+        pieces = 2;
+    }
+    ssize_t n = readv(fd, iov, pieces);
+    if (n > 0) {
+        count += static_cast<size_t>(n);
+    } else if (count == 0) {
+        clear();
+    }
+    return n;
+}
+
+int RingBuffer::peek(struct iovec iov[2]) const {
+    if (count == 0) {
+        return 0;
+    }
+    size_t capacity = pool->block_size();
+    iov[0].iov_base = block + head;
+    iov[0].iov_len = min(count, capacity - head);
+    if (iov[0].iov_len == count) {
+        return 1;
+    }
+    iov[1].iov_base = block;
+    iov[1].iov_len = count - iov[0].iov_len;
+    return 2;
+}
+
+void RingBuffer::consume(size_t n) {
+    n = min(n, count);
+    count -= n;
+    head = (head + n) % pool->block_size();
+    if (count == 0) {
+        // drained, the memory is better used by a busy connection
+        clear();
+    }
+}
+
+void RingBuffer::clear() {
+    if (block != nullptr) {
+        pool->release(block);
+        block = nullptr;
+    }
+    head = 0;
+    count = 0;
+}
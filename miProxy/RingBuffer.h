@@ -0,0 +1,47 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+
+#include "BufferPool.h"
+
+/**
+ * Circular read buffer of one BufferPool block.
+ *
+ * read_from() fills the free space with a single readv(), even when it wraps
+ * around the end of the block, and peek() hands out the buffered bytes in at
+ * most two pieces, so bytes are never moved inside the buffer. The block is
+ * only borrowed while the buffer holds data: it is taken on the first read
+ * and given back to the pool when consume() empties the buffer.
+ */
+class RingBuffer {
+   public:
+    RingBuffer() = default;
+    ~RingBuffer();
+    RingBuffer(const RingBuffer &) = delete;
+    RingBuffer &operator=(const RingBuffer &) = delete;
+
+    // must be called before the first read
+    void set_pool(BufferPool *buffers) { pool = buffers; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t space() const;
+    // read at most max bytes from fd, returns what readv() returned
+    ssize_t read_from(int fd, size_t max);
+    // the buffered bytes, oldest first; returns the number of pieces
+    int peek(struct iovec iov[2]) const;
+    void consume(size_t n);
+    // drop the buffered bytes and give the block back
+    void clear();
+
+   private:
+    BufferPool *pool = nullptr;
+    char *block = nullptr;
+    size_t head = 0;  // offset of the oldest byte
+    size_t count = 0;
+};
+
+#endif
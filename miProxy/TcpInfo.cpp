@@ -0,0 +1,38 @@
+#include "TcpInfo.h"
+
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cstddef>
+#include <cstring>
+
+// Older kernels fill in a shorter struct tcp_info, so every field past the
+// basic ones is checked against the length they returned.
+#define HAS_FIELD(len, field) ((len) >= offsetof(struct tcp_info, field) + sizeof(((struct tcp_info *)0)->field))
+
+TcpInfo TcpInfo::read(int fd) {
+    TcpInfo info;
+    struct tcp_info ti;
+    memset(&ti, 0, sizeof(ti));
+    socklen_t len = sizeof(ti);
+    if (fd < 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) {
+        return info;
+    }
+    info.valid = true;
+    info.rtt = ti.tcpi_rtt / 1000.0;
+    info.rcv_rtt = ti.tcpi_rcv_rtt / 1000.0;
+    info.cwnd = ti.tcpi_snd_cwnd;
+    if (HAS_FIELD(len, tcpi_min_rtt)) {
+        // ~0U until the first RTT sample
+        info.min_rtt = ti.tcpi_min_rtt == ~0U ? 0 : ti.tcpi_min_rtt / 1000.0;
+    }
+    if (HAS_FIELD(len, tcpi_bytes_received)) {
+        info.bytes_received = ti.tcpi_bytes_received;
+    }
+    if (HAS_FIELD(len, tcpi_delivery_rate)) {
+        info.delivery_rate = (double)ti.tcpi_delivery_rate * 8 / 1000;  // bytes/s
+        info.app_limited = ti.tcpi_delivery_rate_app_limited;
+    }
+    return info;
+}
@@ -0,0 +1,28 @@
+#ifndef TCPINFO_H
+#define TCPINFO_H
+
+#include <cstdint>
+
+/**
+ * What the kernel reports about one TCP connection, from
+ * getsockopt(TCP_INFO).
+ *
+ * The delivery rate and cwnd describe what this end sends, so they mean
+ * something on the socket to the browser, which the proxy sends fragments
+ * on. The socket to the web server, where the proxy only receives, gives the
+ * round trip times.
+ */
+struct TcpInfo {
+    bool valid = false;  // getsockopt() succeeded
+    double delivery_rate = 0;  // kbps, the kernel's latest sample, 0 if unknown
+    bool app_limited = false;  // the sample was taken while the sender ran out of data
+    double rtt = 0;  // smoothed, in ms
+    double min_rtt = 0;  // ms, 0 if unknown
+    double rcv_rtt = 0;  // the receiver's estimate, ms, 0 until measured
+    uint32_t cwnd = 0;  // segments
+    uint64_t bytes_received = 0;
+
+    static TcpInfo read(int fd);
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include "ThroughputEstimator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+unique_ptr<ThroughputEstimator> ThroughputEstimator::create(const string &name, double alpha, size_t window) {
+    if (name == "ewma") {
+        return unique_ptr<ThroughputEstimator>(new EwmaEstimator(alpha));
+    }
+    if (name == "harmonic") {
+        return unique_ptr<ThroughputEstimator>(new HarmonicEstimator(window));
+    }
+    if (name == "dual") {
+        return unique_ptr<ThroughputEstimator>(new DualEwmaEstimator);
+    }
+    if (name == "bytes") {
+        return unique_ptr<ThroughputEstimator>(new ByteWeightedEstimator(window));
+    }
+    if (name == "tcp") {
+        return unique_ptr<ThroughputEstimator>(new TcpRateEstimator(alpha));
+    }
+    throw runtime_error("Error: unknown throughput estimator " + name +
+                        ", expected ewma, harmonic, dual, bytes or tcp");
+}
+
+void EwmaEstimator::add(const FragmentTiming &timing) {
+    value = alpha * timing.kbps() + (1 - alpha) * value;
+}
+
+void HarmonicEstimator::add(const FragmentTiming &timing) {
+    samples.push_back(timing.kbps());
+    if (samples.size() > window) {
+        samples.pop_front();
+    }
+}
+
+double HarmonicEstimator::estimate() const {
+    double sum = 0;
+    for (double sample : samples) {
+        if (sample <= 0) {
+            return 0;
+        }
+        sum += 1 / sample;
+    }
+    return samples.empty() ? 0 : (double)samples.size() / sum;
+}
+
+void DualEwmaEstimator::Average::add(double seconds, double sample) {
+    double alpha = exp2(-seconds / half_life);
+    value = alpha * value + (1 - alpha) * sample;
+    weight += seconds;
+}
+
+double DualEwmaEstimator::Average::get() const {
+    // early on most of the weight is still on the initial 0
+    return weight > 0 ? value / (1 - exp2(-weight / half_life)) : 0;
+}
+
+void DualEwmaEstimator::add(const FragmentTiming &timing) {
+    fast.add(timing.seconds(), timing.kbps());
+    slow.add(timing.seconds(), timing.kbps());
+}
+
+double DualEwmaEstimator::estimate() const {
+    return min(fast.get(), slow.get());
+}
+
+void ByteWeightedEstimator::add(const FragmentTiming &timing) {
+    samples.emplace_back(timing.bytes, timing.kbps());
+    if (samples.size() > window) {
+        samples.pop_front();
+    }
+}
+
+double ByteWeightedEstimator::estimate() const {
+    double weighted = 0;
+    size_t bytes = 0;
+    for (auto &sample : samples) {
+        weighted += (double)sample.first * sample.second;
+        bytes += sample.first;
+    }
+    return bytes == 0 ? 0 : weighted / (double)bytes;
+}
+
+void TcpRateEstimator::add(const FragmentTiming &timing) {
+    value = alpha * max(timing.kbps(), timing.delivery_rate) + (1 - alpha) * value;
+}
@@ -0,0 +1,133 @@
+#ifndef THROUGHPUTESTIMATOR_H
+#define THROUGHPUTESTIMATOR_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+
+// When a fragment response was asked for and arrived, and how big it was.
+struct FragmentTiming {
+    using Clock = std::chrono::steady_clock;
+
+    // the request was written, or its first byte arrived if it was
+    // pipelined behind other requests on the same connection
+    Clock::time_point sent;
+    Clock::time_point first_byte;
+    Clock::time_point last_byte;
+    size_t bytes = 0;
+    // what the kernel said about the transfer, with --tcp-info; 0 if unknown
+    double delivery_rate = 0;  // kbps, highest reading on the client socket
+    double rtt = 0;  // seconds, min RTT to the server
+    uint32_t cwnd = 0;  // of the client socket, in segments
+
+    // from sent to last_byte, so the request latency is part of it
+    double seconds() const { return std::chrono::duration<double>(last_byte - sent).count(); }
+    double latency() const { return std::chrono::duration<double>(first_byte - sent).count(); }
+    double kbps() const { return (double)bytes / seconds() * 8 / 1000; }
+};
+
+/**
+ * Turns the fragments of one session into a throughput estimate. Every
+ * session gets its own estimator, of the kind chosen with --estimator.
+ */
+class ThroughputEstimator {
+   public:
+    virtual ~ThroughputEstimator() {}
+    virtual const char *name() const = 0;
+    virtual void add(const FragmentTiming &timing) = 0;
+    // kbps, 0 before the first fragment unless seeded
+    virtual double estimate() const = 0;
+    // the estimate to start from, in kbps, given with each manifest; the
+    // estimators that average their samples have no use for it
+    virtual void seed(double kbps) { (void)kbps; }
+
+    // "ewma", "harmonic", "dual", "bytes" or "tcp"; throws runtime_error
+    // for anything else. alpha is for ewma and tcp, window for harmonic and
+    // bytes.
+    static std::unique_ptr<ThroughputEstimator> create(const std::string &name, double alpha, size_t window);
+};
+
+// alpha * sample + (1 - alpha) * previous estimate, starting from the seed.
+class EwmaEstimator : public ThroughputEstimator {
+   public:
+    explicit EwmaEstimator(double alpha) : alpha(alpha) {}
+    const char *name() const override { return "ewma"; }
+    void add(const FragmentTiming &timing) override;
+    double estimate() const override { return value; }
+    void seed(double kbps) override { value = kbps; }
+
+   private:
+    const double alpha;
+    double value = 0;
+};
+
+// Harmonic mean of the last window samples. A single fast fragment barely
+// moves it, a slow one pulls it down at once.
+class HarmonicEstimator : public ThroughputEstimator {
+   public:
+    explicit HarmonicEstimator(size_t window) : window(window) {}
+    const char *name() const override { return "harmonic"; }
+    void add(const FragmentTiming &timing) override;
+    double estimate() const override;
+
+   private:
+    const size_t window;
+    std::deque<double> samples;
+};
+
+// Two EWMAs weighted by download time, one with a half-life of 2 s and one
+// of 5 s; the estimate is the lower of the two, so it follows a drop quickly
+// and a rise slowly.
+class DualEwmaEstimator : public ThroughputEstimator {
+   public:
+    const char *name() const override { return "dual"; }
+    void add(const FragmentTiming &timing) override;
+    double estimate() const override;
+
+   private:
+    struct Average {
+        double half_life;
+        double value = 0;
+        double weight = 0;  // total weight so far, corrects the bias toward 0
+        void add(double seconds, double sample);
+        double get() const;
+    };
+    Average fast{2};
+    Average slow{5};
+};
+
+// Mean of the last window samples weighted by their size, so small
+// fragments, where latency dominates, count for less.
+class ByteWeightedEstimator : public ThroughputEstimator {
+   public:
+    explicit ByteWeightedEstimator(size_t window) : window(window) {}
+    const char *name() const override { return "bytes"; }
+    void add(const FragmentTiming &timing) override;
+    double estimate() const override;
+
+   private:
+    const size_t window;
+    std::deque<std::pair<size_t, double>> samples;  // bytes and kbps
+};
+
+// The EWMA of ewma over the higher of the measured throughput and the
+// kernel's delivery rate. A short fragment ends before TCP leaves slow
+// start, so timing it underestimates the link; the delivery rate is measured
+// per round trip and is not, unless the sender ran out of data.
+class TcpRateEstimator : public ThroughputEstimator {
+   public:
+    explicit TcpRateEstimator(double alpha) : alpha(alpha) {}
+    const char *name() const override { return "tcp"; }
+    void add(const FragmentTiming &timing) override;
+    double estimate() const override { return value; }
+    void seed(double kbps) override { value = kbps; }
+
+   private:
+    const double alpha;
+    double value = 0;
+};
+
+#endif
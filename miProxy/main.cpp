@@ -1,13 +1,77 @@
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+#include <thread>
+
+#include "Profiler.h"
 #include "miProxy.h"
 
+// Runs one shared-nothing event loop per worker thread. Each worker owns its
+// listening socket, client table and log shard; only the caches are shared,
+// behind their own locks, and the metrics, which each worker writes its own
+// part of.
+static void run_workers(const Options &opts, FragmentCache &cache, DiskCache &disk_cache,
+                        ManifestCache &manifests, Metrics &metrics) {
+    vector<thread> threads;
+    unsigned int cpus = max(1u, thread::hardware_concurrency());
+    for (int i = 0; i < opts.workers; ++i) {
+        threads.emplace_back([&opts, &cache, &disk_cache, &manifests, &metrics, i]() {
+            try {
+                MiProxy miProxy(opts, cache, disk_cache, manifests, metrics, i);
+                miProxy.init();
+                miProxy.run();
+            } catch (runtime_error& e) {
+                // the other workers go down with the process, the log is
+                // written out first
+                LOG_ERROR << "Worker " << i << " failed: " << e.what();
+                Logger::get().flush();
+                exit(1);
+            }
+        });
+        if (opts.pin_workers) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(static_cast<unsigned int>(i) % cpus, &cpuset);
+            if (pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpuset), &cpuset) != 0) {
+                LOG_WARN << "Pinning worker " << i << " to cpu " << i % cpus << " failed";
+            }
+        }
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
 int main(int argc, char* argv[]) {
+#ifdef STAGE_PROFILE
+    // before the logger starts its threads, see dump_on_signal
+    StageProfiler::dump_on_signal(SIGUSR1);
+#endif
+    // the log is written behind the proxy's back, Ctrl-C must not lose the
+    // last lines
+    Logger::flush_on_termination();
+    // a browser that goes away mid-response must not take the proxy with it,
+    // writes to it fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
     try {
-        MiProxy miProxy;
-        miProxy.get_options(argc, argv);
-        miProxy.init();
-        miProxy.run();
+        Options opts = MiProxy::get_options(argc, argv);
+        // the caches, and the metrics of the admin port, are all the workers share
+        FragmentCache cache(opts.cache_size);
+        DiskCache disk_cache(opts.disk_cache_dir, opts.disk_cache_size);
+        disk_cache.load();
+        ManifestCache manifests(milliseconds(opts.manifest_ttl_ms));
+        Metrics metrics(opts.workers);
+        if (opts.workers > 1) {
+            run_workers(opts, cache, disk_cache, manifests, metrics);
+        } else {
+            MiProxy miProxy(opts, cache, disk_cache, manifests, metrics);
+            miProxy.init();
+            miProxy.run();
+        }
     } catch (runtime_error& e) {
-        std::cerr << e.what() << std::endl;
+        LOG_ERROR << e.what();
+        Logger::get().flush();
         return 1;
     }
     return 0;
@@ -2,46 +2,190 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 
 #include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <regex>
 
+#include "Profiler.h"
 #include "helpers.h"
-void MiProxy::get_options(int argc, char *argv[]) {
-    vector<string> args(argv, argv + argc);
-    if (argc == 6 && args[1] == "--nodns") {
-        dns_mode = false;
-        listen_port = stoi(args[2]);
-        default_www_ip = args[3];
-        alpha = stof(args[4]);
-        log_path = args[5];
-        cout << "dns_mode: " << dns_mode
-             << "\nlisten_port: " << listen_port
-             << "\nwww_ip: " << default_www_ip
-             << "\nalpha: " << alpha
-             << "\nlog_path: " << log_path << endl;
-    } else if (argc == 7 && args[1] == "--dns") {
-        dns_mode = true;
-        listen_port = stoi(args[2]);
-        dns_ip = args[3];
-        dns_port = stoi(args[4]);
-        alpha = stof(args[5]);
-        log_path = args[6];
-        cout << "dns_mode: " << dns_mode
-             << "\nlisten_port: " << listen_port
-             << "\ndns_ip: " << dns_ip
-             << "\ndns_port: " << dns_port
-             << "\nalpha: " << alpha
-             << "\nlog_path: " << log_path << endl;
+
+// read buffers kept for reuse by each worker, beyond this they are freed
+const static size_t MAX_FREE_BUFFERS = 256;
+
+// whether the request is answered from one of the fragment caches
+static bool is_cache_hit(const Request &request) {
+    return (request.cached || request.on_disk.segment) && !request.attached;
+}
+
+static string cached_header(const string &content_type, size_t length, bool fetched) {
+    return "HTTP/1.1 200 OK\r\nContent-Type: " + content_type + "\r\nContent-Length: " + to_string(length) +
+           (fetched ? "\r\nX-Cache: MISS\r\n\r\n" : "\r\nX-Cache: HIT\r\n\r\n");
+}
+
+MiProxy::MiProxy(const Options &opts, FragmentCache &cache, DiskCache &disk_cache, ManifestCache &manifests,
+                 Metrics &metrics, int worker_id)
+    : opts(opts),
+      worker_id(worker_id),
+      pool(loop, opts.pool_max_idle, opts.pool_max, milliseconds(opts.pool_idle_timeout_ms)),
+      buffers(opts.read_buffer_size, MAX_FREE_BUFFERS),
+      cache(cache),
+      disk_cache(disk_cache),
+      manifests(manifests),
+      metrics(metrics),
+      stats(metrics.worker(worker_id)),
+      admin(loop),
+      fetcher(loop, pool, milliseconds(opts.connect_timeout_ms)),
+      resolver(loop, opts.dns_ip, opts.dns_port, milliseconds(opts.dns_ttl_ms), milliseconds(opts.connect_timeout_ms)),
+      abr(AbrStrategy::create(opts.abr)),
+      prefetches_in_flight(0),
+      master_socket(-1),
+      accept_timer(0) {}
+
+static LogLevel parse_log_level(const string &name) {
+    if (name == "debug") {
+        return LogLevel::Debug;
+    } else if (name == "info") {
+        return LogLevel::Info;
+    } else if (name == "warn") {
+        return LogLevel::Warn;
+    } else if (name == "error") {
+        return LogLevel::Error;
+    }
+    throw runtime_error("Error: unknown log level " + name);
+}
+
+Options MiProxy::get_options(int argc, char *argv[]) {
+    Options opts;
+    // pull out the optional flags, the rest must match one of the two modes
+    vector<string> args;
+    for (int i = 0; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--workers" && i + 1 < argc) {
+            opts.workers = stoi(argv[++i]);
+            if (opts.workers < 1) {
+                throw runtime_error("Error: --workers must be at least 1");
+            }
+        } else if (arg == "--pin-workers") {
+            opts.pin_workers = true;
+        } else if (arg == "--splice") {
+            opts.splice_relay = true;
+        } else if (arg == "--connect-timeout" && i + 1 < argc) {
+            opts.connect_timeout_ms = stoi(argv[++i]);
+        } else if (arg == "--pool-max-idle" && i + 1 < argc) {
+            opts.pool_max_idle = stoul(argv[++i]);
+        } else if (arg == "--pool-max" && i + 1 < argc) {
+            opts.pool_max = stoul(argv[++i]);
+        } else if (arg == "--pool-idle-timeout" && i + 1 < argc) {
+            opts.pool_idle_timeout_ms = stoi(argv[++i]);
+        } else if (arg == "--high-water" && i + 1 < argc) {
+            opts.high_water = stoul(argv[++i]);
+        } else if (arg == "--read-buffer" && i + 1 < argc) {
+            opts.read_buffer_size = stoul(argv[++i]);
+            if (opts.read_buffer_size < 1024) {
+                throw runtime_error("Error: --read-buffer must be at least 1024");
+            }
+        } else if (arg == "--cache" && i + 1 < argc) {
+            opts.cache_size = stoul(argv[++i]);
+        } else if (arg == "--manifest-ttl" && i + 1 < argc) {
+            opts.manifest_ttl_ms = stoi(argv[++i]);
+        } else if (arg == "--prefetch" && i + 1 < argc) {
+            opts.prefetch = stoul(argv[++i]);
+        } else if (arg == "--prefetch-max" && i + 1 < argc) {
+            opts.prefetch_max = stoul(argv[++i]);
+        } else if (arg == "--coalesce") {
+            opts.coalesce = true;
+        } else if (arg == "--abr" && i + 1 < argc) {
+            opts.abr = argv[++i];
+            AbrStrategy::create(opts.abr);  // throws if unknown
+        } else if (arg == "--estimator" && i + 1 < argc) {
+            opts.estimator = argv[++i];
+            ThroughputEstimator::create(opts.estimator, 0, 1);  // throws if unknown
+        } else if (arg == "--estimator-window" && i + 1 < argc) {
+            opts.estimator_window = stoul(argv[++i]);
+            if (opts.estimator_window == 0) {
+                throw runtime_error("Error: --estimator-window must be at least 1");
+            }
+        } else if (arg == "--tcp-info") {
+            opts.tcp_info = true;
+        } else if (arg == "--fragment-duration" && i + 1 < argc) {
+            opts.fragment_duration = stod(argv[++i]);
+            if (opts.fragment_duration <= 0) {
+                throw runtime_error("Error: --fragment-duration must be positive");
+            }
+        } else if (arg == "--dns-ttl" && i + 1 < argc) {
+            opts.dns_ttl_ms = stoi(argv[++i]);
+        } else if (arg == "--disk-cache" && i + 1 < argc) {
+            opts.disk_cache_dir = argv[++i];
+        } else if (arg == "--disk-cache-size" && i + 1 < argc) {
+            opts.disk_cache_size = stoul(argv[++i]);
+        } else if (arg == "--log-binary") {
+            opts.log_binary = true;
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            opts.log_level = parse_log_level(argv[++i]);
+        } else if (arg == "--admin-port" && i + 1 < argc) {
+            opts.admin_port = stoi(argv[++i]);
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    Logger::get().set_level(opts.log_level);
+
+    if (args.size() == 6 && args[1] == "--nodns") {
+        opts.dns_mode = false;
+        opts.listen_port = stoi(args[2]);
+        opts.default_www_ip = args[3];
+        opts.alpha = stof(args[4]);
+        opts.log_path = args[5];
+        LOG_INFO << "dns_mode: " << opts.dns_mode
+                 << "\nlisten_port: " << opts.listen_port
+                 << "\nwww_ip: " << opts.default_www_ip
+                 << "\nalpha: " << opts.alpha
+                 << "\nlog_path: " << opts.log_path;
+    } else if (args.size() == 7 && args[1] == "--dns") {
+        opts.dns_mode = true;
+        opts.listen_port = stoi(args[2]);
+        opts.dns_ip = args[3];
+        opts.dns_port = stoi(args[4]);
+        opts.alpha = stof(args[5]);
+        opts.log_path = args[6];
+        LOG_INFO << "dns_mode: " << opts.dns_mode
+                 << "\nlisten_port: " << opts.listen_port
+                 << "\ndns_ip: " << opts.dns_ip
+                 << "\ndns_port: " << opts.dns_port
+                 << "\nalpha: " << opts.alpha
+                 << "\nlog_path: " << opts.log_path;
     } else {
         throw runtime_error("Error: missing or extra arguments");
     }
-    return;
+    LOG_INFO << "workers: " << opts.workers
+             << "\npin_workers: " << opts.pin_workers
+             << "\nsplice_relay: " << opts.splice_relay
+             << "\nconnect_timeout: " << opts.connect_timeout_ms << "ms"
+             << "\npool_max_idle: " << opts.pool_max_idle
+             << "\npool_max: " << opts.pool_max
+             << "\npool_idle_timeout: " << opts.pool_idle_timeout_ms << "ms"
+             << "\nread_buffer: " << opts.read_buffer_size
+             << "\nhigh_water: " << opts.high_water
+             << "\ncache: " << opts.cache_size
+             << "\nmanifest_ttl: " << opts.manifest_ttl_ms << "ms"
+             << "\nprefetch: " << opts.prefetch << ", at most " << opts.prefetch_max << " in flight"
+             << "\ncoalesce: " << opts.coalesce
+             << "\nabr: " << opts.abr << ", fragments of " << opts.fragment_duration << "s"
+             << "\nestimator: " << opts.estimator << ", window " << opts.estimator_window
+             << "\ntcp_info: " << opts.tcp_info
+             << "\ndns_ttl: " << opts.dns_ttl_ms << "ms"
+             << "\ndisk_cache: " << opts.disk_cache_dir << " " << opts.disk_cache_size
+             << "\nlog_binary: " << opts.log_binary
+             << "\nadmin_port: " << opts.admin_port;
+    return opts;
 }
 
 void MiProxy::init_master_socket() {
@@ -58,458 +202,1934 @@ void MiProxy::init_master_socket() {
         throw runtime_error("setsockopt failed");
     }
 
+    // with several workers every loop binds its own listening socket to the
+    // same port and the kernel spreads incoming connections across them
+    if (opts.workers > 1 &&
+        setsockopt(master_socket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+        throw runtime_error("setsockopt SO_REUSEPORT failed");
+    }
+
     // type of socket created
     struct sockaddr_in address;
-    make_server_sockaddr(&address, listen_port);
+    make_server_sockaddr(&address, opts.listen_port);
+
+    // the listening socket is edge-triggered, accept() must never block
+    if (fcntl(master_socket, F_SETFL, fcntl(master_socket, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        throw runtime_error("fcntl failed");
+    }
 
     // bind the socket to localhost listen_port
     if (bind(master_socket, (sockaddr *)&address, sizeof(address)) < 0) {
         throw runtime_error("bind failed");
     }
-    printf("---Listening on port %d---\n", listen_port);
+    LOG_INFO << "---Worker " << worker_id << " listening on port " << opts.listen_port << "---";
 
     // try to specify maximum of 10 pending connections for the master socket
     if (listen(master_socket, 10) < 0) {
-        runtime_error("listen failed");
+        throw runtime_error("listen failed");
     }
 }
 
 void MiProxy::init() {
     init_master_socket();
-    if (dns_mode) {
-        init_dns_socket();
+    loop.add(master_socket, EPOLLIN, [this](uint32_t) { handle_master_connection(); });
+    // every worker writes its own shard of the log
+    string log_path = opts.workers > 1 ? opts.log_path + "." + to_string(worker_id) : opts.log_path;
+    log = Logger::get().open(log_path, opts.log_binary ? Logger::Format::Binary : Logger::Format::Text);
+    if (opts.admin_port != 0) {
+        admin.listen(opts.admin_port, opts.workers > 1);
+        admin.add_page("/metrics", "text/plain; version=0.0.4", [this]() { return metrics.render(); });
+#ifdef STAGE_PROFILE
+        admin.add_page("/profile", "text/plain", []() { return StageProfiler::render(); });
+#endif
     }
-    log.open(log_path);
-    puts("Waiting for connections ...");
+    LOG_INFO << "Waiting for connections ...";
 }
 
+const static string DOMAIN_NAME = "video.cse.umich.edu";  // DNS server resolve
+const static milliseconds ACCEPT_RETRY(100);
+
 void MiProxy::handle_master_connection() {
-    // write new socket info to address
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    int new_socket = accept(master_socket, (sockaddr *)&address, (socklen_t *)&addrlen);
-    if (new_socket < 0) {
-        throw runtime_error("accept");
-    }
+    // accept every pending connection, the listening socket is edge-triggered
+    while (true) {
+        // write new socket info to address
+        struct sockaddr_in address;
+        int addrlen = sizeof(address);
+        int new_socket =
+            PROFILED(Stage::Accept, accept4(master_socket, (sockaddr *)&address, (socklen_t *)&addrlen, SOCK_NONBLOCK));
+        if (new_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // out of fds or memory: the connection stays in the backlog, the
+            // worker and its sessions go on. The listening socket is
+            // edge-triggered and a full backlog brings no new edge, so accept
+            // is tried again once some connections may have closed
+            LOG_WARN << "Accepting a connection failed: " << strerror(errno);
+            if (accept_timer == 0) {
+                accept_timer = loop.add_timer(ACCEPT_RETRY, [this]() {
+                    accept_timer = 0;
+                    handle_master_connection();
+                });
+            }
+            return;
+        }
+
+        // inform user of socket number - used in send and receive commands
+        string ip = inet_ntoa(address.sin_addr);
+        LOG_DEBUG << "\n---New host connection---\n"
+                  << "socket fd is " << new_socket << " , ip is : " << ip << " , port : " << ntohs(address.sin_port);
 
-    // inform user of socket number - used in send and receive commands
-    string ip = inet_ntoa(address.sin_addr);
-    printf("\n---New host connection---\n");
-    printf("socket fd is %d , ip is : %s , port : %d \n", new_socket,
-           ip.c_str(), ntohs(address.sin_port));
+        Connection &conn = clients.insert(new_socket);
+        conn.id = clients.id(new_socket);
+        conn.client_socket = new_socket;
+        conn.client_in.set_pool(&buffers);
+        conn.server_in.set_pool(&buffers);
+        conn.server_socket = -1;
+        conn.relay_pipe[0] = conn.relay_pipe[1] = -1;
+        conn.cold->client_ip = ip;
+        conn.cold->client_port = ntohs(address.sin_port);
+        conn.session = &open_session(ip, conn.id);
+        stats.accepted.add();
+        stats.connections.set((double)clients.size());
+        // EPOLLOUT stays registered, edge-triggered it only fires when a
+        // full socket buffer drains
+        ClientId id = conn.id;
+        loop.add(new_socket, EPOLLIN | EPOLLOUT | EPOLLRDHUP, [this, id](uint32_t events) {
+            Connection *conn = clients.find(id);
+            if (conn != nullptr && (events & EPOLLOUT)) {
+                handle_client_writable(*conn);
+                conn = clients.find(id);
+            }
+            if (conn != nullptr && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                handle_client_connection(*conn);
+            }
+        });
+    }
+}
 
-    // add new socket to the array of sockets
-    if (clients.find(ip) != clients.end()) {
-        cout << "client already exists" << endl;
-        clients[ip].client_socket = new_socket;
+// The session of the browser at client_ip, which a new connection joins.
+// A browser's first connection starts it, and its server is looked up then.
+Session &MiProxy::open_session(const string &client_ip, ClientId id) {
+    auto it = sessions.find(client_ip);
+    if (it != sessions.end()) {
+        LOG_DEBUG << "Connection " << it->second.connections.size() + 1 << " of " << client_ip;
+        it->second.connections.push_back(id);
+        return it->second;
+    }
+    Session &session = sessions[client_ip];
+    stats.sessions.set((double)sessions.size());
+    session.client_ip = client_ip;
+    session.connections.push_back(id);
+    session.abr = AbrSession(opts.fragment_duration);
+    session.estimator = ThroughputEstimator::create(opts.estimator, opts.alpha, opts.estimator_window);
+    if (opts.dns_mode) {
+        // requests are read meanwhile but wait until the server is known
+        session.resolving = true;
+        resolver.resolve(DOMAIN_NAME,
+                         [this, client_ip](const string &www_ip) { handle_resolved(client_ip, www_ip); });
     } else {
-        clients[ip] = {};
-        clients[ip].client_socket = new_socket;
-        clients[ip].server_socket = -1;
-        clients[ip].client_ip = ip;
-        if (dns_mode) {
-            clients[ip].www_ip = request_dns();
-        } else {
-            clients[ip].www_ip = default_www_ip;
-        }
+        session.www_ip = opts.default_www_ip;
     }
+    return session;
 }
 
 const static int BUFFER_SIZE = 1024;
 
+// How much to read from fd next: the bytes still expected for the current
+// message when that is known, else what the socket has queued, and never
+// more than fits in the read buffer.
+static size_t read_size(int fd, size_t expected, size_t space) {
+    size_t want = expected;
+    if (want == 0) {
+        int available = 0;
+        if (ioctl(fd, FIONREAD, &available) == 0 && available > 0) {
+            want = (size_t)available;
+        }
+    }
+    if (want == 0 || want > space) {
+        want = space;
+    }
+    return want;
+}
+
 void MiProxy::handle_client_connection(Connection &conn) {
-    cout << "\n---Handling client connection at socket " << conn.client_socket << "---" << endl;
-    char buffer[BUFFER_SIZE];  // data buffer of 1KB
-    // Check if it was for closing , and also read the incoming message
-    // Returns the address in address
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    getpeername(conn.client_socket, (struct sockaddr *)&address, (socklen_t *)&addrlen);
-    cout << "Starting to read from client socket " << conn.client_socket << endl;
-    ssize_t valread = read(conn.client_socket, buffer, BUFFER_SIZE);
-    cout << "Read " << valread << " bytes from client socket " << conn.client_socket << endl;
+    LOG_DEBUG << "\n---Handling client connection at socket " << conn.client_socket << "---";
+    // edge-triggered: keep reading until the socket is drained
+    while (true) {
+        LOG_DEBUG << "Starting to read from client socket " << conn.client_socket;
+        size_t want = read_size(conn.client_socket, 0, conn.client_in.space());
+        ssize_t valread = PROFILED(Stage::Recv, conn.client_in.read_from(conn.client_socket, want));
+        LOG_DEBUG << "Read " << valread << " bytes from client socket " << conn.client_socket;
 
-    if (valread == 0) {
-        // Somebody disconnected, get their details and print
-        printf("\n---Client disconnected---\n");
-        printf("Client disconnected , ip %s , port %d \n", conn.client_ip.c_str(), ntohs(address.sin_port));
-        // Close the socket and mark as 0 in list for reuse
-        close(conn.client_socket);
-        clients.erase(conn.client_ip);
-        return;
+        if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (valread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (valread <= 0) {
+            // Somebody disconnected, get their details and print
+            LOG_DEBUG << "\n---Client disconnected---\n"
+                      << "Client disconnected , ip " << conn.cold->client_ip << " , port " << conn.cold->client_port;
+            close_client_connection(conn);
+            return;
+        }
+
+        if (conn.session->resolving) {
+            // the requests wait for the nameserver, the read buffer is
+            // needed for the next read
+            save_client_input(conn);
+        } else if (!handle_client_requests(conn)) {
+            return;
+        }
     }
+}
+
+// Moves the bytes in client_in to client_message, where a request that is not
+// complete yet waits for the rest.
+void MiProxy::save_client_input(Connection &conn) {
+    struct iovec iov[2];
+    int pieces = conn.client_in.peek(iov);
+    for (int i = 0; i < pieces; ++i) {
+        conn.client_message.append((const char *)iov[i].iov_base, iov[i].iov_len);
+    }
+    conn.client_in.consume(conn.client_in.size());
+}
+
+// Handles the complete requests read so far. They are parsed where they were
+// read, in client_in, and only consumed once complete; client_message only
+// gathers a request that is split over reads, or over the end of the ring.
+// Returns false if the client was closed.
+bool MiProxy::handle_client_requests(Connection &conn) {
+    // the parser picks up where it stopped, a pipelined browser may
+    // have sent several requests in one read
+    while (true) {
+        struct iovec iov[2];
+        bool in_place = conn.client_message.empty() && conn.client_in.peek(iov) == 1;
+        if (!in_place) {
+            save_client_input(conn);
+        }
+        const char *data = in_place ? (const char *)iov[0].iov_base : conn.client_message.data();
+        size_t len = in_place ? iov[0].iov_len : conn.client_message.size();
+        HttpParser &parser = conn.request_parser;
+        HttpParser::Status status = parser.parse(data, len);
+        if (status == HttpParser::Status::Incomplete) {
+            if (in_place) {
+                save_client_input(conn);
+            }
+            return true;
+        }
+        if (status == HttpParser::Status::Error || parser.framing() == HttpParser::Framing::Chunked) {
+            LOG_WARN << "Malformed request from client socket " << conn.client_socket;
+            send_client(conn, "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n");
+            close_client_connection(conn);
+            return false;
+        }
+        size_t request_len = parser.head_length();
+        if (parser.framing() == HttpParser::Framing::ContentLength) {
+            request_len += parser.content_length();
+        }
+        if (len < request_len) {
+            if (in_place) {
+                save_client_input(conn);
+            }
+            return true;  // body not complete
+        }
 
-    conn.client_message.append(buffer, valread);
-    if (conn.client_message.find("\r\n\r\n") != string::npos) {
         // Request message is complete
-        cout << "\n---New message---\n";
-        cout << conn.client_message << endl;
-        printf("\nReceived from: ip %s , port %d \n", conn.client_ip.c_str(), ntohs(address.sin_port));
-        handle_request_message(conn);
+        string request(data, request_len);
+        if (in_place) {
+            conn.client_in.consume(request_len);
+        } else {
+            conn.client_message.erase(0, request_len);
+        }
+        LOG_DEBUG << "\n---New message---\n" << request << "\n\nReceived from: ip " << conn.cold->client_ip << " , port "
+                  << conn.cold->client_port;
+        ClientId id = conn.id;
+        handle_request_message(conn, move(request));
+        if (clients.find(id) == nullptr) {
+            return false;
+        }
     }
 }
 
-const static string VIDEO_NAME = "big_buck_bunny.f4m";
-const static string VIDEO_NAME_NEW = "big_buck_bunny_nolist.f4m";
+// The nameserver answered for a new session: the requests of its
+// connections can go out now. Without an answer the session cannot be
+// served.
+void MiProxy::handle_resolved(const string &client_ip, const string &www_ip) {
+    auto it = sessions.find(client_ip);
+    if (it == sessions.end() || !it->second.resolving) {
+        return;
+    }
+    Session &session = it->second;
+    session.resolving = false;
+    session.www_ip = www_ip;
+    if (www_ip.empty()) {
+        LOG_WARN << "Could not resolve " << DOMAIN_NAME << " for " << client_ip;
+    } else {
+        DnsResolver::Stats stats = resolver.stats();
+        LOG_INFO << "Resolved " << DOMAIN_NAME << " to " << www_ip << " for " << client_ip << ", " << stats.hits
+                 << " hits, " << stats.queries << " queries, " << stats.in_flight << " in flight";
+    }
+    // closing the last connection ends the session
+    vector<ClientId> ids = session.connections;
+    for (ClientId id : ids) {
+        Connection *conn = clients.find(id);
+        if (conn == nullptr) {
+            continue;
+        }
+        if (www_ip.empty()) {
+            send_client(*conn, "HTTP/1.1 502 Bad Gateway\r\nConnection: close\r\nContent-Length: 0\r\n\r\n");
+            close_client_connection(*conn);
+        } else {
+            handle_client_requests(*conn);
+        }
+    }
+}
 
-void MiProxy::handle_request_message(Connection &conn) {
-    // forward the message to the server
-    if (conn.server_socket == -1) {
-        // create a new socket to connect to the server
-        conn.server_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (conn.server_socket < 0) {
-            throw runtime_error("socket failed");
+void MiProxy::close_client_connection(Connection &conn) {
+    // Close the sockets and forget the client
+    loop.remove(conn.client_socket);
+    close(conn.client_socket);
+    if (conn.server_socket != -1) {
+        if (!conn.server_connecting && conn.sent_requests.empty() && conn.server_received == 0) {
+            // the server socket is between requests, keep it for others
+            release_server(conn);
+        } else {
+            close_server_connection(conn);
         }
-        struct sockaddr_in address;
-        if (make_client_sockaddr(&address, conn.www_ip.c_str(), 80) == -1) {
-            throw runtime_error("make_client_sockaddr failed");
+    }
+    if (conn.relay_pipe[0] != -1) {
+        close(conn.relay_pipe[0]);
+        close(conn.relay_pipe[1]);
+    }
+    cancel_prefetches(conn);
+    leave_flights(conn, conn.pending_requests, true);
+    leave_flights(conn, conn.sent_requests, true);
+
+    Session &session = *conn.session;
+    session.connections.erase(find(session.connections.begin(), session.connections.end(), conn.id));
+    if (session.connections.empty()) {
+        if (session.abr.fragments() > 0) {
+            LOG_INFO << "Session " << session.client_ip << " (" << abr->name() << "): " << session.abr.fragments()
+                     << " fragments, average bitrate " << session.abr.average_bitrate() << "kbps, "
+                     << session.abr.stalls() << " stalls, " << session.abr.stall_time() << "s stalled";
         }
+        string ip = session.client_ip;
+        sessions.erase(ip);
+        stats.sessions.set((double)sessions.size());
+    }
+    clients.erase(conn.client_socket);
+    stats.connections.set((double)clients.size());
+}
 
-        cout << "Connecting to server..." << endl;
-        if (connect(conn.server_socket, (sockaddr *)&address, sizeof(address)) < 0) {
-            throw runtime_error("connect failed");
+void MiProxy::handle_client_writable(Connection &conn) {
+    flush_client(conn);
+    if (!conn.pending_requests.empty() && conn.pending_requests.front().attached && stream_to_follower(conn)) {
+        dispatch_requests(conn);
+    }
+    // resume the server once the client has caught up
+    if (conn.server_paused && !conn.client_failed && conn.relay_pipe_bytes == 0 &&
+        conn.client_out.size() <= opts.high_water / 4) {
+        LOG_DEBUG << "Resuming reads from server socket " << conn.server_socket;
+        conn.server_paused = false;
+        // re-arming reports the data that arrived meanwhile
+        loop.modify(conn.server_socket, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+    }
+}
+
+// Writes to the client never block: what the socket does not take is queued
+// and written when the socket drains. A client that falls behind by more than
+// the high-water mark pauses the reads from its server, so a slow browser
+// backs up its own origin connection and nothing else.
+void MiProxy::send_client(Connection &conn, const char *data, size_t len) {
+    if (conn.client_failed) {
+        return;
+    }
+    if (conn.client_out.empty() && conn.relay_pipe_bytes == 0) {
+        while (len > 0) {
+            ssize_t n = PROFILED(Stage::Send, send(conn.client_socket, data, len, MSG_NOSIGNAL | MSG_DONTWAIT));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (n < 0) {
+                fail_client(conn);
+                return;
+            }
+            stats.bytes_to_clients.add((uint64_t)n);
+            data += n;
+            len -= (size_t)n;
         }
     }
+    conn.client_out.append(data, len);
+    if (conn.client_out.size() + conn.relay_pipe_bytes > opts.high_water) {
+        pause_server(conn);
+    }
+}
+
+void MiProxy::send_client(Connection &conn, const string &data) {
+    send_client(conn, data.c_str(), data.size());
+}
+
+// Queues a body from the disk cache behind everything else for the client, it
+// is sent straight from the page cache with sendfile().
+void MiProxy::send_client_file(Connection &conn, const DiskCache::Location &location) {
+    if (conn.client_failed) {
+        return;
+    }
+    conn.client_out.append_file(location.segment, location.segment->fd, location.offset, location.length);
+    flush_client(conn);
+}
+
+// The bytes in the relay pipe go first: splice_server_message() only fills
+// the pipe while client_out is empty, so they are older than anything queued.
+void MiProxy::flush_client(Connection &conn) {
+    while (conn.relay_pipe_bytes > 0 && !conn.client_failed) {
+        ssize_t n = PROFILED(Stage::Splice, splice(conn.relay_pipe[0], nullptr, conn.client_socket, nullptr,
+                                                   conn.relay_pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            fail_client(conn);
+            return;
+        }
+        conn.relay_pipe_bytes -= (size_t)n;
+        stats.bytes_to_clients.add((uint64_t)n);
+    }
+    size_t queued = conn.client_out.size();
+    if (!conn.client_failed && !PROFILED(Stage::Send, conn.client_out.flush(conn.client_socket))) {
+        fail_client(conn);
+    }
+    stats.bytes_to_clients.add(queued - conn.client_out.size());
+}
+
+// The connection is usually deep in a call chain that still uses it when a
+// write fails, so it is closed from the event loop afterwards.
+void MiProxy::fail_client(Connection &conn) {
+    if (conn.client_failed) {
+        return;
+    }
+    LOG_DEBUG << "\n---Client disconnected---\nWriting to client socket " << conn.client_socket << " failed: " << strerror(errno);
+    close_client_later(conn);
+}
+
+void MiProxy::close_client_later(Connection &conn) {
+    conn.client_failed = true;
+    conn.client_out.clear();
+    ClientId id = conn.id;
+    loop.add_timer(milliseconds(0), [this, id]() {
+        Connection *conn = clients.find(id);
+        if (conn != nullptr && conn->client_failed) {
+            close_client_connection(*conn);
+        }
+    });
+}
+
+void MiProxy::pause_server(Connection &conn) {
+    if (conn.server_paused || conn.server_socket == -1 || conn.server_connecting) {
+        return;
+    }
+    LOG_DEBUG << "Client socket " << conn.client_socket << " is backed up, pausing reads from server socket "
+              << conn.server_socket;
+    conn.server_paused = true;
+    loop.modify(conn.server_socket, EPOLLOUT | EPOLLRDHUP);
+}
+
+// Requests are small, the server socket takes them unless the server stopped
+// reading; the rest goes out when it drains.
+void MiProxy::send_server(Connection &conn, const string &data) {
+    conn.server_out.append(data.c_str(), data.size());
+    flush_server(conn);
+}
+
+void MiProxy::flush_server(Connection &conn) {
+    if (!PROFILED(Stage::Send, conn.server_out.flush(conn.server_socket))) {
+        // the read side sees the reset and retries or fails the requests
+        LOG_DEBUG << "Writing to server socket " << conn.server_socket << " failed: " << strerror(errno);
+        conn.server_out.clear();
+    }
+}
+
+const static string VIDEO_NAME = "big_buck_bunny.f4m";
+const static string VIDEO_NAME_NEW = "big_buck_bunny_nolist.f4m";
+
+void MiProxy::handle_request_message(Connection &conn, string message) {
+    stats.requests.add();
+    Request request;
+    request.message = move(message);
+    // point the parser at the request, it was split off the client buffer
+    conn.request_parser.parse(request.message.data(), request.message.size());
+    request.head = conn.request_parser.method() == "HEAD";
+    bool get = conn.request_parser.method() == "GET";
 
     // check big_buck_bunny.f4m
-    size_t pos = conn.client_message.find(VIDEO_NAME);
-    if (pos != string::npos) {
+    string_view uri = conn.request_parser.uri();
+    if (uri.size() >= VIDEO_NAME.size() && uri.substr(uri.size() - VIDEO_NAME.size()) == VIDEO_NAME) {
         // replace big_buck_bunny.f4m with big_buck_bunny_nolist.f4m
-        conn.no_list_message = string(conn.client_message);
-        conn.no_list_message.replace(pos, VIDEO_NAME.size(), VIDEO_NAME_NEW);
+        size_t pos = conn.request_parser.uri_offset() + uri.size() - VIDEO_NAME.size();
+        request.no_list_message = request.message;
+        request.no_list_message.replace(pos, VIDEO_NAME.size(), VIDEO_NAME_NEW);
+        request.uri = string(uri);
+    }
+
+    // parse bitrate, this rewrites the message under the parser
+    parse_bitrate(conn, request);
+    if (!request.chunkname.empty() && get && !conn.cold->prefetches.empty()) {
+        use_prefetch(conn, request);
+    }
+    if (!request.chunkname.empty() && get && !request.cached && !request.waiting) {
+        string key = conn.session->www_ip + " " + request.uri;
+        if (cache.enabled()) {
+            request.cached = cache.find(key);
+            LOG_DEBUG << "Cache " << (request.cached ? "hit: " : "miss: ") << request.chunkname;
+        }
+        if (!request.cached && disk_cache.enabled()) {
+            request.on_disk = disk_cache.find(key);
+            LOG_DEBUG << "Disk cache " << (request.on_disk.segment ? "hit: " : "miss: ") << request.chunkname;
+        }
+    }
+    if (is_cache_hit(request)) {
+        stats.cache_hits.add();
+    }
+    if (!request.chunkname.empty() && get && opts.coalesce && !is_cache_hit(request) && !request.waiting) {
+        coalesce_request(conn, request);
     }
+    if (!request.no_list_message.empty() && get && manifests.enabled()) {
+        find_manifest(conn, request);
+    }
+    conn.request_parser.reset();
 
-    // parse bitrate
-    parse_bitrate(conn);
+    conn.pending_requests.push_back(move(request));
+    dispatch_requests(conn);
+}
 
-    // send the message
-    cout << "Sending message to server..." << endl;
-    send_all(conn.server_socket, conn.client_message.c_str(), conn.client_message.size());
-    conn.client_message.clear();
+// Moves the pending requests along: answers those at the front that are in a
+// cache and sends the rest, once the server socket is connected.
+void MiProxy::dispatch_requests(Connection &conn) {
+    serve_cached_requests(conn);
+    if (conn.pending_requests.empty() || conn.pending_requests.front().waiting) {
+        return;
+    }
+    if (conn.server_socket != -1 && !conn.server_connecting) {
+        send_pending_requests(conn);
+    } else if (conn.server_socket == -1 && !conn.waiting_for_server) {
+        acquire_server(conn);
+    }
 }
 
-const static string DOMAIN_NAME = "video.cse.umich.edu";  // DNS server resolve
+// A session that finds its manifests in the manifest cache starts without
+// asking the origin. Otherwise both manifests are fetched at the same time,
+// and sessions asking for the same video meanwhile wait for those fetches.
+void MiProxy::find_manifest(Connection &conn, Request &request) {
+    string key = conn.session->www_ip + " " + request.uri;
+    ManifestCache::EntryPtr entry = manifests.find(key);
+    if (entry) {
+        LOG_DEBUG << "Manifest cache hit: " << request.uri;
+        set_bitrates(conn, entry->bitrates);
+        request.cached = entry->no_list;
+        request.no_list_message.clear();
+        return;
+    }
+    LOG_DEBUG << "Manifest cache miss: " << request.uri;
+    request.waiting = true;
+    auto it = manifest_fetches.find(key);
+    if (it == manifest_fetches.end()) {
+        it = manifest_fetches.emplace(key, ManifestFetch()).first;
+        fetcher.fetch(conn.session->www_ip, request.message, [this, key](OriginFetcher::Response &response) {
+            manifest_fetches[key].manifest = move(response);
+            handle_manifest_fetch(key);
+        });
+        fetcher.fetch(conn.session->www_ip, request.no_list_message, [this, key](OriginFetcher::Response &response) {
+            manifest_fetches[key].no_list = move(response);
+            handle_manifest_fetch(key);
+        });
+    }
+    it->second.clients.push_back(conn.id);
+}
 
-void MiProxy::init_dns_socket() {
-    dns_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (dns_socket < 0) {
-        throw runtime_error("socket failed");
+void MiProxy::handle_manifest_fetch(const string &key) {
+    auto it = manifest_fetches.find(key);
+    if (--it->second.remaining > 0) {
+        return;
     }
+    ManifestFetch fetch = move(it->second);
+    manifest_fetches.erase(it);
 
-    int yes = 1;
-    if (setsockopt(dns_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
-        throw runtime_error("setsockopt failed");
+    ManifestCache::EntryPtr entry;
+    OriginFetcher::Response &manifest = fetch.manifest;
+    OriginFetcher::Response &no_list = fetch.no_list;
+    vector<int> bitrates = parse_bitrates(manifest.body);
+    if (manifest.ok && manifest.status == 200 && no_list.ok && no_list.status == 200 && !bitrates.empty()) {
+        milliseconds lifetime = min(manifests.lifetime(manifest.cache_control),
+                                    manifests.lifetime(no_list.cache_control));
+        auto body = make_shared<const FragmentCache::Entry>(
+            FragmentCache::Entry{no_list.content_type, move(no_list.body)});
+        entry = make_shared<const ManifestCache::Entry>(
+            ManifestCache::Entry{move(bitrates), move(body), steady_clock::now() + lifetime});
+        if (lifetime.count() > 0) {
+            manifests.insert(key, entry);
+        }
+        ManifestCache::Stats stats = manifests.stats();
+        LOG_DEBUG << "Fetched manifests " << key << ", " << stats.entries << " cached, " << stats.hits << " hits, "
+                  << stats.misses << " misses";
+    } else {
+        LOG_WARN << "Fetching manifests " << key << " failed, sending the request on";
+    }
+
+    // every waiting session gets the manifest, or asks the origin itself
+    for (ClientId id : fetch.clients) {
+        Connection *client = clients.find(id);
+        if (client == nullptr) {
+            continue;
+        }
+        Connection &conn = *client;
+        for (Request &request : conn.pending_requests) {
+            if (!request.waiting || request.no_list_message.empty()) {
+                continue;
+            }
+            request.waiting = false;
+            if (entry) {
+                set_bitrates(conn, entry->bitrates);
+                request.cached = entry->no_list;
+                request.fetched = true;
+                request.no_list_message.clear();
+            }
+            break;
+        }
+        dispatch_requests(conn);
     }
+}
 
+void MiProxy::acquire_server(Connection &conn) {
+    // borrow an idle keep-alive connection if there is one
+    int fd = pool.acquire(conn.session->www_ip);
+    if (fd != -1) {
+        conn.server_socket = fd;
+        conn.server_reused = true;
+        stats.origin_reuses.add();
+        watch_server_socket(conn, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+        send_pending_requests(conn);
+        return;
+    }
+    if (!pool.can_open(conn.session->www_ip)) {
+        // wait until another session releases or closes a connection
+        LOG_DEBUG << "Waiting for a connection to " << conn.session->www_ip;
+        conn.waiting_for_server = true;
+        ClientId id = conn.id;
+        pool.wait(conn.session->www_ip, [this, id]() {
+            Connection *conn = clients.find(id);
+            if (conn == nullptr || !conn->waiting_for_server) {
+                return false;
+            }
+            conn->waiting_for_server = false;
+            acquire_server(*conn);
+            return true;
+        });
+        return;
+    }
+    connect_server(conn);
+}
+
+void MiProxy::release_server(Connection &conn) {
+    int fd = conn.server_socket;
+    conn.server_socket = -1;
+    conn.server_reused = false;
+    conn.server_paused = false;
+    conn.server_in.clear();
+    conn.server_out.clear();
+    pool.release(conn.session->www_ip, fd);
+}
+
+void MiProxy::watch_server_socket(Connection &conn, uint32_t events) {
+    ClientId id = conn.id;
+    loop.add(conn.server_socket, events, [this, id](uint32_t events) {
+        Connection *client = clients.find(id);
+        if (client == nullptr) {
+            return;
+        }
+        Connection &conn = *client;
+        if (conn.server_connecting) {
+            handle_server_connect(conn, events);
+            return;
+        }
+        if ((events & EPOLLOUT) && !conn.server_out.empty()) {
+            flush_server(conn);
+        }
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            handle_server_connection(conn);
+        }
+    });
+}
+
+void MiProxy::connect_server(Connection &conn) {
     struct sockaddr_in address;
-    if (make_client_sockaddr(&address, dns_ip.c_str(), dns_port) == -1) {
-        throw runtime_error("make_client_sockaddr failed");
+    if (make_client_sockaddr(&address, conn.session->www_ip.c_str(), 80) == -1) {
+        fail_pending_requests(conn, "502 Bad Gateway");
+        return;
     }
 
-    cout << "Connecting to dns server..." << endl;
-    if (connect(dns_socket, (sockaddr *)&address, sizeof(address)) < 0) {
-        throw runtime_error("connect dns failed");
+    // create a new non-blocking socket, the event loop finishes the connect
+    conn.server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (conn.server_socket < 0) {
+        // out of fds, say: this session's requests fail, the worker goes on
+        LOG_WARN << "Opening a socket to the server failed: " << strerror(errno);
+        conn.server_socket = -1;
+        stats.origin_connect_failures.add();
+        fail_pending_requests(conn, "502 Bad Gateway");
+        return;
     }
-    cout << "Connecting to dns server success..." << endl;
+    pool.opened(conn.session->www_ip);
+    stats.origin_connects.add();
+    LOG_DEBUG << "Connecting to server...";
+    if (PROFILED(Stage::Connect, connect(conn.server_socket, (sockaddr *)&address, sizeof(address))) < 0 &&
+        errno != EINPROGRESS) {
+        LOG_WARN << "Connecting to server failed: " << strerror(errno);
+        stats.origin_connect_failures.add();
+        close_server_connection(conn);
+        fail_pending_requests(conn, "502 Bad Gateway");
+        return;
+    }
+    conn.server_connecting = true;
+    conn.server_reused = false;
+    watch_server_socket(conn, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
 
+    ClientId id = conn.id;
+    int fd = conn.server_socket;
+    conn.cold->connect_timer = loop.add_timer(milliseconds(opts.connect_timeout_ms), [this, id, fd]() {
+        Connection *conn = clients.find(id);
+        if (conn == nullptr || conn->server_socket != fd) {
+            return;
+        }
+        LOG_WARN << "Connecting to server timed out";
+        stats.origin_connect_failures.add();
+        conn->cold->connect_timer = 0;
+        close_server_connection(*conn);
+        fail_pending_requests(*conn, "504 Gateway Timeout");
+    });
 }
 
-string MiProxy::request_dns() {
-    handle_dns_request();
-    return handle_dns_response();
+void MiProxy::handle_server_connect(Connection &conn, uint32_t events) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(conn.server_socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+        error = errno;
+    }
+    if (error == 0 && !(events & EPOLLOUT)) {
+        return;  // still in progress
+    }
+    if (error != 0) {
+        LOG_WARN << "Connecting to server failed: " << strerror(error);
+        stats.origin_connect_failures.add();
+        close_server_connection(conn);
+        fail_pending_requests(conn, "502 Bad Gateway");
+        return;
+    }
+
+    LOG_DEBUG << "Connected to server at socket " << conn.server_socket;
+    loop.cancel_timer(conn.cold->connect_timer);
+    conn.cold->connect_timer = 0;
+    conn.server_connecting = false;
+    loop.modify(conn.server_socket, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
+    send_pending_requests(conn);
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        handle_server_connection(conn);
+    }
 }
 
-void MiProxy::handle_dns_request() {
-    // DNS Header
-    string header = make_dns_Header() + "\0";
-    string question = make_dns_Question() + "\0";
+// Answers a fragment request with its prefetch, or makes it wait for the
+// prefetch in flight. A request for any other fragment means the player
+// seeked or switched bitrate, and the prefetches no request is waiting for
+// are dropped.
+void MiProxy::use_prefetch(Connection &conn, Request &request) {
+    auto it = conn.cold->prefetches.find(request.uri);
+    if (it == conn.cold->prefetches.end()) {
+        size_t dropped = 0;
+        for (auto p = conn.cold->prefetches.begin(); p != conn.cold->prefetches.end();) {
+            if (p->second.awaited) {
+                ++p;
+                continue;
+            }
+            if (p->second.fetch != 0) {
+                fetcher.cancel(p->second.fetch);
+                prefetches_in_flight--;
+            }
+            p = conn.cold->prefetches.erase(p);
+            dropped++;
+        }
+        if (dropped > 0) {
+            LOG_DEBUG << "Dropping " << dropped << " prefetches";
+        }
+        return;
+    }
+    if (it->second.entry) {
+        LOG_DEBUG << "Prefetch hit: " << request.chunkname;
+        request.cached = it->second.entry;
+        log_fragment(conn, request, conn.session->www_ip, it->second.timing);
+        conn.cold->prefetches.erase(it);
+    } else {
+        LOG_DEBUG << "Waiting for prefetch: " << request.chunkname;
+        request.waiting = true;
+        it->second.awaited = true;
+    }
+}
+
+// Called whenever a fragment went out to the player, however it was answered.
+void MiProxy::fragment_served(Connection &conn, const Request &request) {
+    if (request.chunkname.empty()) {
+        return;
+    }
+    if (request.bitrate > 0) {
+        conn.session->abr.fragment_served(request.bitrate, steady_clock::now());
+    }
+    prefetch_next(conn, request);
+}
+
+// Whether a request of conn for uri is queued or on its way to the origin.
+static bool is_requested(const Connection &conn, const string &uri) {
+    auto same = [&uri](const Request &request) { return request.uri == uri; };
+    return any_of(conn.pending_requests.begin(), conn.pending_requests.end(), same) ||
+           any_of(conn.sent_requests.begin(), conn.sent_requests.end(), same);
+}
+
+// Fetches the fragments after the one just served, at the bitrate the
+// player is likely to be given for them, while the player is busy with it.
+void MiProxy::prefetch_next(Connection &conn, const Request &request) {
+    if (opts.prefetch == 0 || request.chunkname.empty() || conn.session->available_bitrates.empty()) {
+        return;
+    }
+    // <bitrate>Seg<n>-Frag<m>
+    const string &name = request.chunkname;
+    size_t pos_s = name.rfind("Seg");
+    size_t pos_f = name.rfind("-Frag");
+    int frag;
+    try {
+        frag = stoi(name.substr(pos_f + 5));
+    } catch (logic_error &) {
+        return;
+    }
+    string path = request.uri.substr(0, request.uri.size() - name.size());
+    string segment = name.substr(pos_s, pos_f - pos_s);  // Seg<n>
+    int bitrate = choose_bitrate(conn);
+    size_t uri_pos = request.message.find(' ') + 1;
+
+    for (size_t ahead = 1; ahead <= opts.prefetch; ++ahead) {
+        if (conn.cold->prefetches.size() >= opts.prefetch || prefetches_in_flight >= opts.prefetch_max) {
+            return;
+        }
+        Request next;
+        next.chunkname = to_string(bitrate) + segment + "-Frag" + to_string(frag + (int)ahead);
+        next.uri = path + next.chunkname;
+        next.bitrate = bitrate;
+        string key = conn.session->www_ip + " " + next.uri;
+        if (conn.cold->prefetches.count(next.uri) > 0 || is_requested(conn, next.uri) || flights.count(key) > 0 ||
+            (cache.enabled() && cache.contains(key)) || disk_cache.contains(key)) {
+            continue;
+        }
+        // the player's request with the next fragment's uri
+        string message = request.message;
+        message.replace(uri_pos, request.uri.size(), next.uri);
+        LOG_DEBUG << "Prefetching " << next.chunkname;
+        ClientId id = conn.id;
+        string uri = next.uri;
+        conn.cold->prefetches[uri].fetch =
+            fetcher.fetch(conn.session->www_ip, message, [this, id, next](OriginFetcher::Response &response) {
+                handle_prefetch(id, next, response);
+            });
+        prefetches_in_flight++;
+    }
+}
+
+// A cancelled prefetch never gets here, so the one for the uri is in flight.
+void MiProxy::handle_prefetch(ClientId id, const Request &request, OriginFetcher::Response &response) {
+    prefetches_in_flight--;
+    Connection *client = clients.find(id);
+    if (client == nullptr) {
+        return;
+    }
+    Connection &conn = *client;
+    auto it = conn.cold->prefetches.find(request.uri);
+    if (it == conn.cold->prefetches.end()) {
+        return;
+    }
+
+    FragmentCache::EntryPtr entry;
+    FragmentTiming timing;
+    if (response.ok && response.status == 200 && response.content_type.compare(0, 9, "video/f4f") == 0) {
+        LOG_DEBUG << "Prefetched " << request.chunkname;
+        // the prefetch measured the path to the origin like any fragment,
+        // the log has it once the player gets it
+        timing.sent = response.sent;
+        timing.first_byte = response.first_byte;
+        timing.last_byte = steady_clock::now();
+        timing.bytes = response.body.size();
+        record_throughput(conn, conn.session->www_ip, timing);
+        entry = make_shared<const FragmentCache::Entry>(
+            FragmentCache::Entry{response.content_type, move(response.body)});
+    } else {
+        LOG_DEBUG << "Prefetching " << request.chunkname << " failed";
+    }
 
-    cout << "Sending header size to dns server..." << endl;
-    uint32_t header_size = htonl(static_cast<uint32_t>(header.length()));
-    send(dns_socket, &header_size, sizeof(header_size), 0);
+    // a request already waiting for it takes it, or goes to the origin
+    for (Request &waiting : conn.pending_requests) {
+        if (waiting.waiting && waiting.uri == request.uri && waiting.no_list_message.empty()) {
+            waiting.waiting = false;
+            waiting.cached = entry;
+            waiting.fetched = entry != nullptr;
+            if (entry) {
+                log_fragment(conn, waiting, conn.session->www_ip, timing);
+            }
+            conn.cold->prefetches.erase(it);
+            dispatch_requests(conn);
+            return;
+        }
+    }
+    if (entry) {
+        it->second.fetch = 0;
+        it->second.entry = entry;
+        it->second.timing = timing;
+    } else {
+        conn.cold->prefetches.erase(it);
+    }
+}
 
-    cout << "Sending header to dns server..." << endl;
-    send_all(dns_socket, header.c_str(), header.size());
+void MiProxy::cancel_prefetches(Connection &conn) {
+    for (auto &it : conn.cold->prefetches) {
+        if (it.second.fetch != 0) {
+            fetcher.cancel(it.second.fetch);
+            prefetches_in_flight--;
+        }
+    }
+    conn.cold->prefetches.clear();
+}
 
-    cout << "Sending question size to dns server..." << endl;
-    uint32_t question_size = htonl(static_cast<uint32_t>(question.length()));
-    send(dns_socket, &question_size, sizeof(question_size), 0);
+// The first request for a fragment goes to the origin, identical requests
+// from other sessions wait for its response instead of asking again.
+void MiProxy::coalesce_request(Connection &conn, Request &request) {
+    string key = conn.session->www_ip + " " + request.uri;
+    auto it = flights.find(key);
+    if (it == flights.end()) {
+        flights[key].leader = conn.id;
+        request.leading = true;
+        return;
+    }
+    Flight &flight = it->second;
+    LOG_DEBUG << "Coalescing " << request.chunkname << " with an identical request";
+    request.coalesced = true;
+    request.waiting = true;
+    if (find(flight.followers.begin(), flight.followers.end(), conn.id) == flight.followers.end()) {
+        flight.followers.push_back(conn.id);
+    }
+}
 
-    cout << "Sending question to dns server..." << endl;
-    send_all(dns_socket, question.c_str(), question.size());
+// Called with the header of the leading request's response. A fragment of
+// known length is streamed to the followers that are ready for it.
+void MiProxy::start_flight(Connection &conn, const Request &request) {
+    string key = conn.session->www_ip + " " + request.uri;
+    auto it = flights.find(key);
+    if (it == flights.end()) {
+        return;
+    }
+    Flight &flight = it->second;
+    conn.cold->server_flight = key;
+    flight.ok = !request.head && conn.response_parser.status_code() == 200 &&
+                conn.server_content_type.compare(0, 9, "video/f4f") == 0;
+    if (!flight.ok || request.framing != HttpParser::Framing::ContentLength) {
+        return;  // followers get the whole body once it is complete
+    }
+    flight.streaming = true;
+    flight.content_type = conn.server_content_type;
+    flight.length = conn.server_body_len;
+    vector<ClientId> followers = flight.followers;
+    for (ClientId id : followers) {
+        // those with nothing ahead of the coalesced request join now
+        Connection *follower = clients.find(id);
+        if (follower != nullptr) {
+            serve_cached_requests(*follower);
+        }
+    }
 }
 
-string MiProxy::handle_dns_response() {
-    uint32_t headerSize;
-    memset(&headerSize, 0, sizeof(headerSize));
-    cout << "Receving header size from dns server..." << endl;
-    if (recv(dns_socket, &headerSize, sizeof(headerSize), 0) != sizeof(headerSize)) {
-        std::cerr << "Error reading dns message" << std::endl;
-        exit(1);
+// Starts the response to the coalesced request at the front of conn, with
+// the part of the body the leader has received so far.
+void MiProxy::attach_follower(Connection &conn) {
+    Request &request = conn.pending_requests.front();
+    auto it = flights.find(conn.session->www_ip + " " + request.uri);
+    if (it == flights.end() || !it->second.streaming) {
+        return;
     }
-    headerSize = ntohl(headerSize);
+    Flight &flight = it->second;
+    Connection *leader = clients.find(flight.leader);
+    if (leader == nullptr) {
+        return;
+    }
+    LOG_DEBUG << "Streaming " << request.chunkname << " from the response to " << leader->cold->client_ip;
+    request.attached = true;
+    flight.streams.push_back(conn.id);
+    send_client(conn, cached_header(flight.content_type, flight.length, true));
+    stream_to_follower(conn);
+}
 
-    // Receive DNS Header
-    cout << "Receving header from dns server..." << endl;
-    DNSHeader header = DNSHeader::decode(receive_all(dns_socket, headerSize));
+// Queues more of the shared response for the attached request at the front of
+// conn, up to the high-water mark: a follower that falls behind is fed from the
+// leader's copy of the body, or from the cache entry once the flight is done,
+// when its client drains. Returns true once the response is complete and the
+// request is gone.
+bool MiProxy::stream_to_follower(Connection &conn) {
+    Request &request = conn.pending_requests.front();
+    const string *body = nullptr;
+    if (request.cached) {
+        body = &request.cached->body;
+    } else {
+        auto it = flights.find(conn.session->www_ip + " " + request.uri);
+        Connection *leader = it == flights.end() ? nullptr : clients.find(it->second.leader);
+        if (leader == nullptr) {
+            return false;
+        }
+        body = &leader->cache_body;
+    }
+    while (!conn.client_failed && request.streamed < body->size() && conn.client_out.size() < opts.high_water) {
+        size_t len = min(body->size() - request.streamed, opts.high_water - conn.client_out.size());
+        send_client(conn, body->data() + request.streamed, len);
+        request.streamed += len;
+    }
+    if (!request.cached || request.streamed < body->size() || conn.client_failed) {
+        return false;
+    }
+    Request done = move(request);
+    conn.pending_requests.pop_front();
+    LOG_DEBUG << "Streamed " << done.chunkname << " to " << conn.cold->client_ip;
+    fragment_served(conn, done);
+    return true;
+}
 
-    cout << "Receving record size from dns server..." << endl;
-    uint32_t recordSize;
-    memset(&recordSize, 0, sizeof(recordSize));
-    if (recv(dns_socket, &recordSize, sizeof(recordSize), 0) != sizeof(recordSize)) {
-        std::cerr << "Error reading dns message" << std::endl;
-        exit(1);
+// Called once the leading request was answered. Followers being streamed the
+// body get the rest of it from entry, the others are answered with entry like
+// a cache hit. If the response was not a fragment they ask the origin
+// themselves.
+void MiProxy::finish_flight(const string &key, const FragmentCache::EntryPtr &entry) {
+    auto it = flights.find(key);
+    if (it == flights.end()) {
+        return;
+    }
+    if (!it->second.ok || !entry) {
+        abandon_flight(key, false);
+        return;
+    }
+    Flight flight = move(it->second);
+    flights.erase(it);
+    for (ClientId id : flight.followers) {
+        Connection *follower = clients.find(id);
+        if (follower == nullptr) {
+            continue;
+        }
+        Connection &conn = *follower;
+        for (Request &request : conn.pending_requests) {
+            if (request.coalesced && conn.session->www_ip + " " + request.uri == key) {
+                request.coalesced = false;
+                request.cached = entry;
+                // an attached request waits until the rest of the body went out
+                request.waiting = request.attached;
+                request.fetched = !request.attached;
+            }
+        }
+        if (!conn.pending_requests.empty() && conn.pending_requests.front().attached &&
+            !conn.pending_requests.front().coalesced) {
+            // the front request may also be streamed from another flight
+            stream_to_follower(conn);
+        }
+        if (id != flight.leader) {
+            // the leader's own connection moves on once its response is done
+            dispatch_requests(conn);
+        }
     }
-    recordSize = ntohl(recordSize);
+}
 
-    cout << "Receving record from dns server..." << endl;
-    DNSRecord record = DNSRecord::decode(receive_all(dns_socket, recordSize));
-    return record.RDATA;
+// Takes the requests of conn that are about to be dropped out of their
+// flights. Identical requests that waited for a dropped leading request are
+// either handed to one of them (promote) or all sent to the origin.
+void MiProxy::leave_flights(Connection &conn, deque<Request> &requests, bool promote) {
+    for (Request &request : requests) {
+        auto it = flights.find(conn.session->www_ip + " " + request.uri);
+        if (request.coalesced && it != flights.end()) {
+            vector<ClientId> &followers = it->second.followers;
+            followers.erase(remove(followers.begin(), followers.end(), conn.id), followers.end());
+            vector<ClientId> &streams = it->second.streams;
+            streams.erase(remove(streams.begin(), streams.end(), conn.id), streams.end());
+            request.coalesced = false;
+        }
+    }
+    for (const Request &request : requests) {
+        string key = conn.session->www_ip + " " + request.uri;
+        auto it = flights.find(key);
+        if (request.leading && it != flights.end() && it->second.leader == conn.id) {
+            abandon_flight(key, promote);
+        }
+    }
 }
 
-string MiProxy::make_dns_Header() {
-    DNSHeader header;
-    header.ID = 1;
-    header.QR = 0;
-    header.OPCODE = 1;
-    header.AA = 0;
-    header.TC = 0;
-    header.RD = 0;
-    header.RA = 0;
-    header.Z = 0;
-    header.RCODE = 0;
-    header.QDCOUNT = 1;
-    header.ANCOUNT = 0;
-    header.NSCOUNT = 0;
-    header.ARCOUNT = 0;
-    return header.encode(header);
+void MiProxy::abandon_flight(const string &key, bool promote) {
+    auto it = flights.find(key);
+    if (it == flights.end()) {
+        return;
+    }
+    Flight flight = move(it->second);
+    flights.erase(it);
+    Flight next;
+    vector<ClientId> released;
+    for (ClientId id : flight.followers) {
+        Connection *follower = clients.find(id);
+        if (follower == nullptr) {
+            continue;
+        }
+        Connection &conn = *follower;
+        if (!conn.pending_requests.empty() && conn.pending_requests.front().attached &&
+            conn.session->www_ip + " " + conn.pending_requests.front().uri == key) {
+            // part of the response already went out, it cannot be completed
+            LOG_DEBUG << "Response to " << conn.pending_requests.front().chunkname << " was cut short";
+            close_client_later(conn);
+            continue;
+        }
+        bool waits = false;
+        for (Request &request : conn.pending_requests) {
+            if (!request.coalesced || conn.session->www_ip + " " + request.uri != key) {
+                continue;
+            }
+            if (promote && next.leader != 0) {
+                waits = true;
+                continue;
+            }
+            if (promote) {
+                LOG_DEBUG << "Request for " << request.chunkname << " from " << conn.cold->client_ip << " leads now";
+                next.leader = id;
+                request.leading = true;
+            }
+            request.coalesced = false;
+            request.waiting = false;
+        }
+        if (waits) {
+            next.followers.push_back(id);
+        }
+        if (id != flight.leader) {
+            released.push_back(id);
+        }
+    }
+    if (next.leader != 0) {
+        flights[key] = move(next);
+    }
+    for (ClientId id : released) {
+        Connection *follower = clients.find(id);
+        if (follower != nullptr) {
+            dispatch_requests(*follower);
+        }
+    }
 }
 
-string MiProxy::make_dns_Question() {
-    DNSQuestion question;
-    strcpy(question.QNAME, "video.cse.umich.edu");
-    question.QTYPE = 1;
-    question.QCLASS = 1;
-    return question.encode(question);
+void MiProxy::send_pending_requests(Connection &conn) {
+    // send the messages, they stay in sent_requests until answered
+    while (!conn.pending_requests.empty()) {
+        serve_cached_requests(conn);
+        if (conn.pending_requests.empty() || is_cache_hit(conn.pending_requests.front()) ||
+            conn.pending_requests.front().waiting) {
+            // the cached response waits for the ones ahead of it, and a
+            // waiting request for its manifest or prefetch
+            return;
+        }
+        if (!conn.sent_requests.empty() && !conn.server_reused) {
+            // only pipeline once the server has shown it keeps connections
+            // open, a server that closes after the response would reset
+            // the connection under the requests queued behind it
+            return;
+        }
+        if (!conn.sent_requests.empty() && !conn.sent_requests.back().no_list_message.empty()) {
+            // the nolist manifest has to go out right after the manifest
+            // is answered, nothing is pipelined behind it
+            return;
+        }
+        Request &request = conn.pending_requests.front();
+        if (request.deferred && !conn.session->available_bitrates.empty()) {
+            // the manifest was parsed since it was queued
+            rewrite_bitrate(conn, request);
+        }
+        LOG_DEBUG << "Sending message to server...";
+        send_server(conn, request.message);
+        request.sent = steady_clock::now();
+        request.pipelined = !conn.sent_requests.empty();
+        conn.sent_requests.push_back(move(request));
+        conn.pending_requests.pop_front();
+    }
 }
 
-void MiProxy::parse_bitrate(Connection &conn) {
-    // validate path
-    // GET /vod/1000Seg1-Frag2 HTTP/1.1
-    string &msg = conn.client_message;
-    string front_msg = msg.substr(0, msg.find(" HTTP/1.1"));  // GET /vod/1000Seg1-Frag2
-    size_t path_start_pos = front_msg.rfind("/");
-    size_t pos_s = front_msg.rfind("Seg");
-    size_t pos_f = front_msg.rfind("-Frag");
-    if (pos_s == string::npos || pos_f == string::npos || pos_f - pos_s < 4 || pos_s - path_start_pos < 2) {
-        return;
-    }
-    double bitrate_max = conn.current_throughput / 1.5;
-    cout << "Max bitrate allowed: " << bitrate_max << "kbps" << endl;
-    conn.current_bitrate = conn.available_bitrates[0];
-    for (auto br : conn.available_bitrates) {
-        if (br <= bitrate_max) {
-            conn.current_bitrate = br;
+// Answers the requests at the front of pending_requests that were found in the
+// fragment cache. Responses go out in request order, so this waits until every
+// request sent before them has been answered. A coalesced request that gets
+// there joins the response being streamed for it, if there is one.
+void MiProxy::serve_cached_requests(Connection &conn) {
+    while (conn.sent_requests.empty() && !conn.pending_requests.empty() &&
+           is_cache_hit(conn.pending_requests.front())) {
+        Request request = move(conn.pending_requests.front());
+        conn.pending_requests.pop_front();
+        if (request.cached) {
+            const FragmentCache::Entry &entry = *request.cached;
+            send_client(conn, cached_header(entry.content_type, entry.body.size(), request.fetched));
+            send_client(conn, entry.body);
+            LOG_DEBUG << "Serving " << request.chunkname << " from the cache";
         } else {
-            break;
+            send_client(conn, cached_header(request.on_disk.content_type, request.on_disk.length, false));
+            send_client_file(conn, request.on_disk);
+            LOG_DEBUG << "Serving " << request.chunkname << " from the disk cache";
         }
+        fragment_served(conn, request);
+    }
+    if (conn.sent_requests.empty() && !conn.pending_requests.empty() && conn.pending_requests.front().coalesced &&
+        !conn.pending_requests.front().attached) {
+        attach_follower(conn);
     }
-    cout << "Current bitrate: " << conn.current_bitrate << "kbps" << endl;
-    msg = msg.substr(0, path_start_pos + 1) + to_string(conn.current_bitrate) + msg.substr(pos_s);
-    conn.chunkname = msg.substr(path_start_pos + 1, msg.find(" HTTP/1.1") - path_start_pos - 1);
-    cout << "\n---Modified message---\n";
-    cout << conn.client_message << endl;
 }
 
-void MiProxy::handle_server_connection(Connection &conn) {
-    cout << "\n---Handling server connection at socket " << conn.server_socket << "---" << endl;
+void MiProxy::fail_pending_requests(Connection &conn, const string &status) {
+    // answer every request that could not reach the server, those found in
+    // the cache are still served from it
+    string response = "HTTP/1.1 " + status + "\r\nContent-Length: 0\r\n\r\n";
+    leave_flights(conn, conn.pending_requests, false);
+    while (!conn.pending_requests.empty()) {
+        serve_cached_requests(conn);
+        if (!conn.pending_requests.empty()) {
+            send_client(conn, response);
+            conn.pending_requests.pop_front();
+        }
+    }
+}
+
+void MiProxy::parse_bitrate(Connection &conn, Request &request) {
+    PROFILE_SCOPE(Stage::ParseBitrate);
+    // validate path
+    // GET /vod/1000Seg1-Frag2 HTTP/1.1
+    string uri(conn.request_parser.uri());  // /vod/1000Seg1-Frag2
+    size_t path_start_pos = uri.rfind("/");
+    size_t pos_s = uri.rfind("Seg");
+    size_t pos_f = uri.rfind("-Frag");
+    if (path_start_pos == string::npos || pos_s == string::npos || pos_f == string::npos ||
+        pos_s < path_start_pos || pos_f - pos_s < 4 || pos_s - path_start_pos < 2) {
+        return;
+    }
+    request.uri = move(uri);
+    request.uri_offset = conn.request_parser.uri_offset();
+    if (conn.session->available_bitrates.empty()) {
+        // pipelined behind the manifest, say
+        LOG_DEBUG << "No manifest yet, choosing the bitrate when the request is sent";
+        request.deferred = true;
+        return;
+    }
+    rewrite_bitrate(conn, request);
+}
 
-    if (conn.server_message.empty()) {
-        // new message from server
-        conn.server_conn_start = steady_clock::now();
+// Puts the bitrate the session is given into the fragment uri of request.
+void MiProxy::rewrite_bitrate(Connection &conn, Request &request) {
+    conn.session->current_bitrate = choose_bitrate(conn);
+    LOG_DEBUG << "Current bitrate: " << conn.session->current_bitrate << "kbps";
+    const string &uri = request.uri;
+    size_t path_start_pos = uri.rfind("/");
+    string new_uri = uri.substr(0, path_start_pos + 1) + to_string(conn.session->current_bitrate) +
+                     uri.substr(uri.rfind("Seg"));
+    request.message.replace(request.uri_offset, uri.size(), new_uri);
+    request.chunkname = new_uri.substr(path_start_pos + 1);
+    request.uri = new_uri;
+    request.bitrate = conn.session->current_bitrate;
+    request.deferred = false;
+    const vector<int> &ladder = conn.session->available_bitrates;
+    auto rung = lower_bound(ladder.begin(), ladder.end(), request.bitrate);
+    if (rung != ladder.end() && *rung == request.bitrate) {
+        conn.session->bitrate_counters[static_cast<size_t>(rung - ladder.begin())]->add();
+    } else {
+        stats.bitrates.get(to_string(request.bitrate)).add();
     }
+    LOG_DEBUG << "\n---Modified message---\n" << request.message;
+}
+
+void MiProxy::handle_server_connection(Connection &conn) {
+    LOG_DEBUG << "\n---Handling server connection at socket " << conn.server_socket << "---";
 
-    char buffer[BUFFER_SIZE];  // data buffer of 1KB
     // Check if it was for closing , and also read the incoming message
     // Returns the address in address
     struct sockaddr_in address;
     int addrlen = sizeof(address);
     getpeername(conn.server_socket, (struct sockaddr *)&address, (socklen_t *)&addrlen);
-    conn.server_ip = inet_ntoa(address.sin_addr);
-    conn.server_port = ntohs(address.sin_port);
-    cout << "Starting to read from server socket " << conn.server_socket << endl;
-    ssize_t valread = read(conn.server_socket, buffer, BUFFER_SIZE);
-    cout << "Read " << valread << " bytes from server socket " << conn.server_socket << endl;
-
-    if (valread == 0) {
-        // Server disconnected, get their details and print
-        printf("\n---Server disconnected---\n");
-        printf("Server disconnected , ip %s , port %d \n", conn.server_ip.c_str(), conn.server_port);
-        // Close the socket and mark as 0 in list for reuse
-        close(conn.server_socket);
-        conn.server_socket = -1;
-        return;
+    conn.cold->server_ip = inet_ntoa(address.sin_addr);
+    conn.cold->server_port = ntohs(address.sin_port);
+    // edge-triggered: keep reading until the socket is drained
+    while (conn.server_socket != -1) {
+        if (conn.server_paused) {
+            return;  // the client is backed up, see send_client()
+        }
+        if (conn.server_splicing) {
+            if (!splice_server_message(conn)) {
+                return;
+            }
+            continue;
+        }
+
+        LOG_DEBUG << "Starting to read from server socket " << conn.server_socket;
+        // a body of known length is read in as few calls as possible
+        size_t expected = 0;
+        if (conn.server_header_len != 0 &&
+            conn.sent_requests.front().framing == HttpParser::Framing::ContentLength) {
+            expected = conn.server_body_len - conn.server_body_received;
+        }
+        size_t want = read_size(conn.server_socket, expected, conn.server_in.space());
+        ssize_t valread = PROFILED(Stage::Recv, conn.server_in.read_from(conn.server_socket, want));
+        LOG_DEBUG << "Read " << valread << " bytes from server socket " << conn.server_socket;
+
+        if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (valread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (valread <= 0) {
+            handle_server_disconnect(conn, valread == 0);
+            return;
+        }
+        stats.bytes_from_origins.add((uint64_t)valread);
+        sample_tcp_info(conn, false);
+
+        struct iovec iov[2];
+        int pieces = conn.server_in.peek(iov);
+        for (int i = 0; i < pieces; ++i) {
+            if (!handle_server_data(conn, (const char *)iov[i].iov_base, iov[i].iov_len)) {
+                return;
+            }
+        }
+        conn.server_in.consume(conn.server_in.size());
     }
+}
 
-    conn.server_message.append(buffer, valread);
+// Runs bytes read from the server through the response state machine. With
+// pipelined requests one read may finish a response and start the next.
+// Returns false once the server socket was closed or released, which may
+// have taken the connection and the read buffer with it.
+bool MiProxy::handle_server_data(Connection &conn, const char *data, size_t len) {
+    while (len > 0) {
+        if (conn.sent_requests.empty()) {
+            LOG_DEBUG << "Unexpected data from server socket " << conn.server_socket;
+            close_server_connection(conn);
+            if (!conn.pending_requests.empty()) {
+                acquire_server(conn);
+            }
+            return false;
+        }
+        Request &request = conn.sent_requests.front();
+        if (conn.server_received == 0) {
+            // new message from server
+            request.first_byte = steady_clock::now();
+        }
 
-    if (conn.server_message_len == 0 && parse_header(conn) == -1) {
-        return;  // header not complete
+        int relayed;
+        size_t consumed = 0;
+        if (conn.server_header_len == 0) {
+            // the header is parsed where it was read, server_message only
+            // gathers one that is split over reads
+            size_t buffered = conn.server_message.size();
+            if (buffered > 0) {
+                conn.server_message.append(data, len);
+            }
+            int parsed = buffered > 0 ? parse_header(conn, conn.server_message.data(), conn.server_message.size())
+                                      : parse_header(conn, data, len);
+            if (parsed == -1) {
+                if (buffered == 0) {
+                    conn.server_message.assign(data, len);
+                }
+                conn.server_received += len;
+                return true;  // header not complete
+            }
+            if (parsed == -2) {
+                handle_server_disconnect(conn);
+                return false;
+            }
+            size_t header_part = conn.server_header_len - buffered;  // of data
+            if (buffered == 0) {
+                conn.server_message.assign(data, conn.server_header_len);
+            } else {
+                conn.server_message.resize(conn.server_header_len);
+            }
+            // the parser's fields point into the header that is kept
+            conn.response_parser.parse(conn.server_message.data(), conn.server_message.size());
+            conn.server_received += header_part;
+            data += header_part;
+            len -= header_part;
+            // the manifest is buffered since it has to be parsed, everything
+            // else is cut through to the client as soon as it arrives
+            conn.server_streaming = request.no_list_message.empty();
+            if (conn.server_streaming) {
+                send_server_header(conn);
+            }
+            conn.server_caching = is_cacheable(conn, request);
+            if (request.leading) {
+                start_flight(conn, request);
+            }
+            relayed = relay_server_body(conn, data, len, consumed);
+            // the rest of a fragment body never has to enter user space,
+            // unless it is kept for the cache
+            conn.server_splicing = relayed == 0 && conn.server_streaming && opts.splice_relay &&
+                                   !conn.server_caching && conn.cold->server_flight.empty() &&
+                                   request.framing == HttpParser::Framing::ContentLength &&
+                                   conn.server_content_type.compare(0, 9, "video/f4f") == 0;
+        } else {
+            relayed = relay_server_body(conn, data, len, consumed);
+        }
+        conn.server_received += consumed;
+        data += consumed;
+        len -= consumed;
+
+        if (relayed == -1) {
+            LOG_WARN << "---Malformed chunked body---";
+            handle_server_disconnect(conn);
+            return false;
+        }
+        if (relayed == 0) {
+            LOG_DEBUG << "Received " << conn.server_received << " bytes, waiting for more...";
+            return true;
+        }
+
+        // Request message is complete
+        LOG_DEBUG << "\n---New message---\n" << conn.server_message.substr(0, BUFFER_SIZE)
+                  << "\n\nReceived from: ip " << conn.cold->server_ip << " , port " << conn.cold->server_port;
+        // the rest belongs to the next response
+        bool keep_alive = conn.server_keep_alive;
+        handle_response_message(conn);
+        if (!keep_alive || conn.server_socket == -1) {
+            // closed, or released to the pool with nothing outstanding
+            return false;
+        }
     }
+    return true;
+}
 
-    if (conn.server_message.size() < conn.server_message_len) {
-        cout << "Received " << conn.server_message.size() << " bytes, waiting for "
-             << conn.server_message_len - conn.server_message.size() << " more bytes..." << endl;
+// clean is true when the server closed the connection in order, and false
+// after a reset or when the proxy gives up on the connection.
+void MiProxy::handle_server_disconnect(Connection &conn, bool clean) {
+    // Server disconnected, get their details and print
+    LOG_DEBUG << "\n---Server disconnected---\n"
+              << "Server disconnected , ip " << conn.cold->server_ip << " , port " << conn.cold->server_port;
+    if (clean && conn.server_header_len != 0 &&
+        conn.sent_requests.front().framing == HttpParser::Framing::UntilClose) {
+        // the close marks the end of the body, a reset may have cut it short
+        if (conn.server_streaming) {
+            send_client(conn, "0\r\n\r\n", 5);
+        }
+        handle_response_message(conn);
+        return;
+    }
+    if (conn.server_streaming) {
+        // part of the response already reached the client, it
+        // cannot be completed any more
+        close_client_connection(conn);
         return;
     }
 
-    // Request message is complete
-    cout << "\n---New message---\n";
-    cout << conn.server_message.substr(0, BUFFER_SIZE) << endl;
-    printf("\nReceived from: ip %s , port %d \n", conn.server_ip.c_str(), conn.server_port);
+    bool retry = conn.server_reused && conn.server_received == 0;
+    close_server_connection(conn);
+    if (retry) {
+        // an idle keep-alive connection was closed by the server just as
+        // it was reused, send the requests again on another connection
+        conn.pending_requests.insert(conn.pending_requests.begin(), conn.sent_requests.begin(),
+                                     conn.sent_requests.end());
+    } else {
+        leave_flights(conn, conn.sent_requests, false);
+        string response = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+        for (size_t i = 0; i < conn.sent_requests.size(); ++i) {
+            send_client(conn, response);
+        }
+    }
+    conn.sent_requests.clear();
+    if (!conn.pending_requests.empty()) {
+        acquire_server(conn);
+    }
+}
+
+void MiProxy::close_server_connection(Connection &conn) {
+    // Close the socket and mark as -1 so the next request reconnects
+    loop.remove(conn.server_socket);
+    close(conn.server_socket);
+    conn.server_socket = -1;
+    conn.server_reused = false;
+    conn.server_paused = false;
+    conn.server_in.clear();
+    conn.server_out.clear();
+    pool.closed(conn.session->www_ip);
+    loop.cancel_timer(conn.cold->connect_timer);
+    conn.cold->connect_timer = 0;
+    conn.server_connecting = false;
+    reset_server_message(conn);
+}
+
+void MiProxy::reset_server_message(Connection &conn) {
+    conn.server_message.clear();
+    conn.server_header_len = 0;
+    conn.server_body_len = 0;
+    conn.server_body_received = 0;
+    conn.server_received = 0;
+    conn.chunk_decoder.reset();
+    conn.server_streaming = false;
+    conn.server_splicing = false;
+    conn.server_caching = false;
+    conn.cache_body.clear();
+    conn.cold->server_flight.clear();
+    conn.server_keep_alive = false;
+    conn.server_content_type.clear();
+    conn.response_parser.reset();
+    conn.cold->peak_delivery_rate = 0;
+}
+
+// Moves the body of a fragment from the origin to the browser through a pipe
+// with splice(), so the payload is never copied into user space. Returns true
+// once the whole response has been read, false when the origin socket is
+// drained, the client is backed up or the connection was closed. Without a
+// pipe it also returns true, and the body is relayed by copying instead.
+bool MiProxy::splice_server_message(Connection &conn) {
+    if (conn.relay_pipe[0] == -1 && pipe2(conn.relay_pipe, O_CLOEXEC) < 0) {
+        // out of fds, say: this connection does without splice()
+        LOG_WARN << "Creating a relay pipe failed: " << strerror(errno);
+        conn.relay_pipe[0] = conn.relay_pipe[1] = -1;
+        conn.server_splicing = false;
+        return true;
+    }
+    while (conn.server_body_received < conn.server_body_len) {
+        // the pipe only takes more once the client has everything before it,
+        // which also keeps the bytes in order with client_out
+        if (conn.relay_pipe_bytes > 0 || !conn.client_out.empty()) {
+            flush_client(conn);
+            if (conn.client_failed) {
+                return false;
+            }
+            if (conn.relay_pipe_bytes > 0 || !conn.client_out.empty()) {
+                pause_server(conn);
+                return false;
+            }
+        }
+        size_t remaining = conn.server_body_len - conn.server_body_received;
+        ssize_t n = PROFILED(Stage::Splice, splice(conn.server_socket, nullptr, conn.relay_pipe[1], nullptr, remaining,
+                                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            handle_server_disconnect(conn);
+            return false;
+        }
+        conn.server_received += n;
+        conn.server_body_received += n;
+        conn.relay_pipe_bytes += (size_t)n;
+        stats.bytes_from_origins.add((uint64_t)n);
+        sample_tcp_info(conn, false);
+        LOG_DEBUG << "Spliced " << n << " bytes from server socket " << conn.server_socket;
+    }
+    // whatever the client does not take now follows on EPOLLOUT
+    flush_client(conn);
+
+    LOG_DEBUG << "\n---New message---\n" << conn.server_message << "\n\nReceived from: ip " << conn.cold->server_ip
+              << " , port " << conn.cold->server_port;
     handle_response_message(conn);
+    return true;
+}
+
+// Relays the part of data that belongs to the current response body: to the
+// client when streaming, into server_message (decoded) when buffering.
+// Sets consumed to the number of bytes that belonged to it and returns 1 once
+// the body is complete, 0 while more is expected and -1 if the chunked
+// encoding is malformed.
+int MiProxy::relay_server_body(Connection &conn, const char *data, size_t len, size_t &consumed) {
+    HttpParser::Framing framing = conn.sent_requests.front().framing;
+    size_t take = 0;
+    int complete = 0;
+    switch (framing) {
+        case HttpParser::Framing::None:
+            complete = 1;
+            break;
+        case HttpParser::Framing::ContentLength:
+            take = min(len, conn.server_body_len - conn.server_body_received);
+            complete = conn.server_body_received + take == conn.server_body_len;
+            break;
+        case HttpParser::Framing::Chunked: {
+            string *decoded = &conn.server_message;
+            if (conn.server_streaming) {
+                decoded = conn.server_caching || !conn.cold->server_flight.empty() ? &conn.cache_body : nullptr;
+            }
+            ChunkedDecoder::Status status = conn.chunk_decoder.decode(data, len, take, decoded);
+            if (status == ChunkedDecoder::Status::Error) {
+                return -1;
+            }
+            complete = status == ChunkedDecoder::Status::Complete;
+            break;
+        }
+        case HttpParser::Framing::UntilClose:
+            take = len;
+            break;
+    }
+    conn.server_body_received += take;
+
+    if (conn.server_caching || !conn.cold->server_flight.empty()) {
+        if (framing != HttpParser::Framing::Chunked) {
+            conn.cache_body.append(data, take);
+        }
+        if (conn.server_caching &&
+            conn.cache_body.size() > max(cache.max_entry_size(), disk_cache.max_entry_size())) {
+            // too big to be cached, stop copying it unless a flight needs it
+            conn.server_caching = false;
+            if (conn.cold->server_flight.empty()) {
+                string().swap(conn.cache_body);
+            }
+        }
+    }
+    auto flight = conn.cold->server_flight.empty() ? flights.end() : flights.find(conn.cold->server_flight);
+    if (flight != flights.end() && take > 0) {
+        for (ClientId id : flight->second.streams) {
+            Connection *follower = clients.find(id);
+            if (follower != nullptr) {
+                stream_to_follower(*follower);
+            }
+        }
+    }
+    if (conn.server_streaming && take > 0) {
+        if (framing == HttpParser::Framing::UntilClose) {
+            // every read goes out as one chunk, see send_server_header()
+            char size_line[32];
+            int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", take);
+            send_client(conn, size_line, (size_t)size_len);
+            send_client(conn, data, take);
+            send_client(conn, "\r\n", 2);
+        } else {
+            // chunked bodies are forwarded still encoded
+            send_client(conn, data, take);
+        }
+    } else if (!conn.server_streaming && framing != HttpParser::Framing::Chunked) {
+        conn.server_message.append(data, take);
+    }
+    consumed = take;
+    return complete;
+}
+
+// Forwards the response header to the client. A body delimited by the server
+// closing the connection is re-framed with chunked encoding, so the client
+// connection outlives the server connection.
+void MiProxy::send_server_header(Connection &conn) {
+    if (conn.sent_requests.front().framing != HttpParser::Framing::UntilClose) {
+        send_client(conn, conn.server_message);
+        return;
+    }
+    string header;
+    size_t pos = 0;
+    while (pos < conn.server_header_len) {
+        size_t end = conn.server_message.find('\n', pos) + 1;
+        string_view line(conn.server_message.data() + pos, end - pos);
+        pos = end;
+        size_t colon = line.find(':');
+        if (line == "\r\n" || line == "\n" ||
+            (colon != string_view::npos && HttpParser::iequals(line.substr(0, colon), "Connection"))) {
+            continue;  // the final CRLF, and the server's Connection: close
+        }
+        header.append(line);
+    }
+    header += "Transfer-Encoding: chunked\r\n\r\n";
+    send_client(conn, header);
 }
 
 void MiProxy::handle_response_message(Connection &conn) {
     // forward the message to the client
     // check xml file
-    if (!conn.no_list_message.empty()) {
-        parse_xml(conn);
-        // send no_list_message to server
-        cout << "Sending message to server..." << endl;
-        send_all(conn.server_socket, conn.no_list_message.c_str(), conn.no_list_message.size());
-        conn.no_list_message.clear();
+    Request &request = conn.sent_requests.front();
+    if (!request.no_list_message.empty() && !parse_xml(conn)) {
+        // the manifest was buffered, none of it went out: the player gets
+        // an error instead, and the nolist manifest is not asked for
+        send_client(conn, "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n");
+        request.no_list_message.clear();
+    } else if (!request.no_list_message.empty()) {
+        // send no_list_message to server next
+        Request no_list;
+        no_list.message = move(request.no_list_message);
+        request.no_list_message.clear();
+        conn.pending_requests.push_front(move(no_list));
     } else {
-        update_throughput(conn);
-        // send the message
-        cout << "Sending message to client..." << endl;
-        send_all(conn.client_socket, conn.server_message.c_str(), conn.server_message.size());
+        // the body has already been relayed to the client
+        update_throughput(conn, request);
+        fragment_served(conn, request);
+        string key = conn.session->www_ip + " " + request.uri;
+        FragmentCache::EntryPtr entry;
+        if (conn.server_caching || !conn.cold->server_flight.empty()) {
+            entry = make_shared<const FragmentCache::Entry>(
+                FragmentCache::Entry{conn.server_content_type, move(conn.cache_body)});
+        }
+        if (conn.server_caching) {
+            if (disk_cache.enabled()) {
+                disk_cache.insert(key, entry->content_type, entry->body);
+                DiskCache::Stats stats = disk_cache.stats();
+                LOG_DEBUG << "Cached " << request.chunkname << " on disk, " << stats.entries << " fragments, "
+                          << stats.bytes << " bytes in " << stats.segments << " segments, " << stats.hits << " hits, "
+                          << stats.misses << " misses";
+            }
+            if (cache.enabled()) {
+                cache.insert(key, entry);
+                FragmentCache::Stats stats = cache.stats();
+                LOG_DEBUG << "Cached " << request.chunkname << ", " << stats.entries << " fragments, " << stats.bytes
+                          << " bytes, " << stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions
+                          << " evictions";
+            }
+        }
+        if (!conn.cold->server_flight.empty()) {
+            finish_flight(conn.cold->server_flight, entry);
+        }
     }
-    conn.server_message.clear();
-    conn.server_message_len = 0;
+    bool keep_alive = conn.server_keep_alive;
+    reset_server_message(conn);
+    finish_server_request(conn, keep_alive);
 }
 
-void MiProxy::update_throughput(Connection &conn) {
-    // check content type
-    size_t ct_pos = conn.server_message.find("Content-Type: video/f4f");
-    size_t crlf_pos = conn.server_message.find("\r\n\r\n");
-    if (ct_pos == string::npos || crlf_pos == string::npos || ct_pos > crlf_pos) {
+void MiProxy::finish_server_request(Connection &conn, bool keep_alive) {
+    if (!conn.sent_requests.empty()) {
+        conn.sent_requests.pop_front();
+    }
+    if (!keep_alive) {
+        // the server closes the connection after this response, requests
+        // already sent on it go out again on another connection
+        conn.pending_requests.insert(conn.pending_requests.begin(), conn.sent_requests.begin(),
+                                     conn.sent_requests.end());
+        conn.sent_requests.clear();
+        close_server_connection(conn);
+        dispatch_requests(conn);
+        return;
+    }
+    conn.server_reused = true;
+    if (!conn.pending_requests.empty()) {
+        send_pending_requests(conn);
+    }
+    if (conn.pending_requests.empty() && conn.sent_requests.empty() && conn.server_socket != -1) {
+        // nothing left to ask, give the connection back to the pool
+        release_server(conn);
+    }
+}
+
+int MiProxy::choose_bitrate(const Connection &conn) const {
+    PROFILE_SCOPE(Stage::Abr);
+    steady_clock::time_point now = steady_clock::now();
+    int bitrate = abr->choose(conn.session->abr, conn.session->available_bitrates, now);
+    LOG_DEBUG << "Throughput " << conn.session->current_throughput << "kbps, buffer about " << conn.session->abr.buffer(now) << "s, "
+              << abr->name() << " picks " << bitrate << "kbps";
+    return bitrate;
+}
+
+void MiProxy::update_throughput(Connection &conn, const Request &request) {
+    // check content type; a fragment sent without a bitrate chosen, when the
+    // manifest did not list any, is not logged either
+    if (conn.server_content_type.compare(0, 9, "video/f4f") != 0 || request.chunkname.empty()) {
+        return;
+    }
+    // a pipelined request only starts to be answered once the responses
+    // ahead of it are done, and its wait for them says nothing about the
+    // path: it is timed from its first byte
+    FragmentTiming timing;
+    timing.sent = request.pipelined ? request.first_byte : request.sent;
+    timing.first_byte = request.first_byte;
+    timing.last_byte = steady_clock::now();
+    timing.bytes = conn.server_received;
+    if (opts.tcp_info) {
+        sample_tcp_info(conn, true);
+        timing.delivery_rate = conn.cold->peak_delivery_rate;
+        double rtt = conn.cold->server_tcp.min_rtt > 0 ? conn.cold->server_tcp.min_rtt : conn.cold->server_tcp.rcv_rtt;
+        timing.rtt = rtt / 1000;
+        timing.cwnd = conn.cold->client_tcp.cwnd;
+    }
+    record_throughput(conn, conn.cold->server_ip, timing);
+    log_fragment(conn, request, conn.cold->server_ip, timing);
+}
+
+const static milliseconds TCP_INFO_INTERVAL(10);
+
+// With --tcp-info, reads TCP_INFO of both sockets of a fragment transfer,
+// at most every TCP_INFO_INTERVAL unless now is set. The delivery rate of the
+// client socket is the rate at which the fragment reached the browser over
+// the last round trip; the highest reading of a response is kept.
+void MiProxy::sample_tcp_info(Connection &conn, bool now) {
+    if (!opts.tcp_info) {
         return;
     }
+    steady_clock::time_point t = steady_clock::now();
+    if (!now && t - conn.cold->tcp_sampled < TCP_INFO_INTERVAL) {
+        return;
+    }
+    conn.cold->tcp_sampled = t;
+    conn.cold->client_tcp = TcpInfo::read(conn.client_socket);
+    conn.cold->server_tcp = TcpInfo::read(conn.server_socket);
+    conn.cold->peak_delivery_rate = max(conn.cold->peak_delivery_rate, conn.cold->client_tcp.delivery_rate);
+}
 
+// Feeds a fragment fetched from server_ip to the session's estimate and to
+// the metrics.
+void MiProxy::record_throughput(Connection &conn, const string &server_ip, const FragmentTiming &timing) {
     // calculate throughput
-    duration<double> time_diff = steady_clock::now() - conn.server_conn_start;
-    double new_throughput = (double)conn.server_message_len / time_diff.count() * 8 / 1000;  // kbps
-    cout << "Previous throughput: " << conn.current_throughput << " kbps" << endl;
-    conn.current_throughput = alpha * new_throughput + (1 - alpha) * conn.current_throughput;
-    cout << "Time diff: " << time_diff.count() << " s" << endl;
-    cout << "New throughput: " << new_throughput << " kbps" << endl;
-    cout << "Current throughput: " << conn.current_throughput << " kbps" << endl;
-
-    // logging
-    log << conn.client_ip << " "
-        << conn.chunkname << " "
-        << conn.server_ip << " "
-        << (float)time_diff.count() << " "
-        << new_throughput << " "
-        << conn.current_throughput << " "
-        << conn.current_bitrate << endl;
-}
-
-void MiProxy::parse_xml(Connection &conn) {
-    // check content type
-    if (conn.server_message.find("Content-Type: text/xml") == string::npos) {
-        throw runtime_error("Content-Type is not text/xml");
-    }
-    cout << "---Parsing xml---" << endl;
-    size_t br_pos, br_end_pos;
-    string &msg = conn.server_message;
-    while ((br_pos = msg.find("bitrate=\"")) != string::npos) {
-        br_end_pos = msg.find("\"", br_pos + 9);
-        string br_str = msg.substr(br_pos + 9, br_end_pos - br_pos - 9);
-        conn.available_bitrates.push_back(stoi(br_str));
-        msg.erase(br_pos, br_end_pos - br_pos + 1);
-        cout << "Available bitrate: " << br_str << endl;
-    }
-    sort(conn.available_bitrates.begin(), conn.available_bitrates.end());
-    conn.current_throughput = conn.available_bitrates[0] * 1.5;
-    cout << "initialize current_throughput: " << conn.current_throughput << endl;
-}
-
-int MiProxy::parse_header(Connection &conn) {
-    size_t end_pos = conn.server_message.find("\r\n\r\n");
-    if (end_pos == string::npos) {
-        cout << "header not complete" << endl;
-        return -1;
+    double new_throughput = timing.kbps();
+    LOG_DEBUG << "Previous throughput: " << conn.session->current_throughput << " kbps";
+    conn.session->estimator->add(timing);
+    conn.session->current_throughput = conn.session->estimator->estimate();
+    conn.session->abr.add_sample(new_throughput, conn.session->current_throughput);
+    if (timing.rtt > 0) {
+        conn.session->abr.add_rtt(timing.rtt);
     }
-    size_t cl_pos = conn.server_message.find("Content-Length: ");
-    size_t con_end_pos = conn.server_message.find("\r\n", cl_pos);
-    if (cl_pos == string::npos || con_end_pos == string::npos) {
-        cout << "---No Content-Length header---" << endl;
-        cout << conn.server_message << endl;
-        return -1;
+    LOG_DEBUG << "Time diff: " << timing.seconds() << " s, " << timing.latency() << " s to the first byte";
+    LOG_DEBUG << "New throughput: " << new_throughput << " kbps";
+    LOG_DEBUG << "Current throughput: " << conn.session->current_throughput << " kbps (" << conn.session->estimator->name() << ")";
+    if (opts.tcp_info) {
+        LOG_DEBUG << "Kernel: delivery rate " << timing.delivery_rate << " kbps, min rtt " << timing.rtt * 1000
+                  << " ms, cwnd " << timing.cwnd;
     }
-    string cl_str = conn.server_message.substr(cl_pos + 16, con_end_pos - cl_pos - 16);
-    cout << cl_str << endl;
-    int content_length = stoi(cl_str);
-    cout << "Content-Length: " << content_length << endl;
-    conn.server_message_len = end_pos + 4 + (size_t)content_length;
-    return 0;
+    stats.fragment_seconds.observe(timing.seconds());
+    stats.estimates.observe(conn.session->current_throughput);
+    OriginMetrics &origin = stats.origins.get(server_ip);
+    double previous = origin.throughput.get();
+    origin.throughput.set(origin.fragments.get() == 0 ? new_throughput
+                                                      : opts.alpha * new_throughput + (1 - opts.alpha) * previous);
+    origin.fragments.add();
+    origin.bytes.add(timing.bytes);
 }
 
-void MiProxy::run() {
-    while (true) {
-        // clear the socket set
-        FD_ZERO(&readfds);
+// Writes the log line of a fragment the player is given, with the timing of
+// its fetch from server_ip.
+void MiProxy::log_fragment(Connection &conn, const Request &request, const string &server_ip,
+                           const FragmentTiming &timing) {
+    // logging, the writer thread renders the line
+    ChunkRecord record;
+    record.client_ip = conn.cold->client_ip;
+    record.chunkname = request.chunkname;
+    record.server_ip = server_ip;
+    record.duration = (float)timing.seconds();
+    record.tput = timing.kbps();
+    record.avg_tput = conn.session->current_throughput;
+    record.bitrate = request.bitrate;
+    if (opts.tcp_info) {
+        record.tcp_info = true;
+        record.delivery_rate = timing.delivery_rate;
+        record.rtt = (float)(timing.rtt * 1000);
+        record.cwnd = timing.cwnd;
+    }
+    {
+        PROFILE_SCOPE(Stage::Log);
+        Logger::get().chunk(log, record);
+    }
+    PROFILE_FRAGMENT();
+}
 
-        // add master socket to set
-        FD_SET(master_socket, &readfds);
-        // add client and server sockets to set
-        cout << "Number of client sockets: " << clients.size() << endl;
-        for (auto client : clients) {
-            FD_SET(client.second.client_socket, &readfds);
-            if (client.second.server_socket != -1) {
-                FD_SET(client.second.server_socket, &readfds);
-            }
-        }
-        cout << "Waiting for activity on sockets..." << endl;
-        // wait for an activity on one of the sockets, timeout is NULL,
-        // so wait indefinitely
-        ssize_t activity = select(FD_SETSIZE, &readfds, NULL, NULL, NULL);
-        cout << "Activity detected on socket!" << endl;
-        if ((activity < 0) && (errno != EINTR)) {
-            throw runtime_error("select error");
-        }
+// false if the response is not a manifest with bitrates to choose from
+bool MiProxy::parse_xml(Connection &conn) {
+    PROFILE_SCOPE(Stage::ParseXml);
+    // check content type
+    if (conn.server_content_type.compare(0, 8, "text/xml") != 0) {
+        LOG_WARN << "Manifest from " << conn.cold->server_ip << " is " << conn.server_content_type << ", not text/xml";
+        return false;
+    }
+    LOG_DEBUG << "---Parsing xml---";
+    vector<int> bitrates = parse_bitrates(conn.server_message);
+    if (bitrates.empty()) {
+        LOG_WARN << "Manifest from " << conn.cold->server_ip << " lists no bitrates";
+        return false;
+    }
+    set_bitrates(conn, bitrates);
+    return true;
+}
 
-        // If something happened on the master socket,
-        // then its an incoming connection, call accept()
-        if (FD_ISSET(master_socket, &readfds)) {
-            handle_master_connection();
+// the bitrate="..." attributes of a manifest, sorted
+vector<int> MiProxy::parse_bitrates(const string &manifest) {
+    vector<int> bitrates;
+    size_t br_pos = 0, br_end_pos;
+    while ((br_pos = manifest.find("bitrate=\"", br_pos)) != string::npos) {
+        br_end_pos = manifest.find("\"", br_pos + 9);
+        if (br_end_pos == string::npos) {
+            break;
         }
-        // else it's some IO operation on a client socket
-        for (auto &client : clients) {
-            if (FD_ISSET(client.second.client_socket, &readfds)) {
-                handle_client_connection(client.second);
-            } else if (client.second.server_socket != -1 &&
-                       FD_ISSET(client.second.server_socket, &readfds)) {
-                handle_server_connection(client.second);
-            }
+        string br_str = manifest.substr(br_pos + 9, br_end_pos - br_pos - 9);
+        try {
+            bitrates.push_back(stoi(br_str));
+            LOG_DEBUG << "Available bitrate: " << br_str;
+        } catch (logic_error &) {
+            LOG_DEBUG << "Bad bitrate: " << br_str;
         }
+        br_pos = br_end_pos;
     }
+    sort(bitrates.begin(), bitrates.end());
+    return bitrates;
 }
 
-static const int MAX_MESSAGE_SIZE = 256;
+void MiProxy::set_bitrates(Connection &conn, const vector<int> &bitrates) {
+    conn.session->available_bitrates = bitrates;
+    // looked up once here, not for every fragment
+    conn.session->bitrate_counters.clear();
+    for (int bitrate : bitrates) {
+        conn.session->bitrate_counters.push_back(&stats.bitrates.get(to_string(bitrate)));
+    }
+    conn.session->current_throughput = conn.session->available_bitrates[0] * 1.5;
+    conn.session->estimator->seed(conn.session->current_throughput);
+    LOG_DEBUG << "initialize current_throughput: " << conn.session->current_throughput;
+}
 
-string MiProxy::receive_all(int connectionfd, uint32_t size) {
-    // Initialize message with given size.
-    char msg[MAX_MESSAGE_SIZE + 1];
-    memset(msg, 0, sizeof(msg));
+// Whether the body of the response being read goes into the fragment cache:
+// a complete fragment the origin did not mark as private.
+bool MiProxy::is_cacheable(Connection &conn, const Request &request) {
+    if ((!cache.enabled() && !disk_cache.enabled()) || request.chunkname.empty() || request.head ||
+        is_cache_hit(request)) {
+        return false;
+    }
+    const HttpParser &parser = conn.response_parser;
+    string_view cache_control = parser.header("Cache-Control");
+    return parser.status_code() == 200 && conn.server_content_type.compare(0, 9, "video/f4f") == 0 &&
+           !HttpParser::has_token(cache_control, "no-store") && !HttpParser::has_token(cache_control, "private");
+}
 
-    if (recv(connectionfd, msg, size, 0) == -1) {
-        std::cerr << "Error reading stream message" << std::endl;
-        exit(1);
+// Parses the response header at the start of data. Returns 0 once it is
+// complete, -1 while it is not and -2 if the response cannot be relayed.
+int MiProxy::parse_header(Connection &conn, const char *data, size_t len) {
+    PROFILE_SCOPE(Stage::ParseHeader);
+    HttpParser &parser = conn.response_parser;
+    HttpParser::Status status = parser.parse(data, len);
+    if (status == HttpParser::Status::Incomplete) {
+        LOG_DEBUG << "header not complete";
+        return -1;
+    }
+    if (status == HttpParser::Status::Error) {
+        LOG_WARN << "---Malformed response header---";
+        return -2;
+    }
+    // the framing belongs to the oldest request, a response to HEAD never
+    // has a body whatever its header says
+    Request &request = conn.sent_requests.front();
+    request.framing = request.head ? HttpParser::Framing::None : parser.framing();
+    if (request.framing == HttpParser::Framing::ContentLength) {
+        conn.server_body_len = parser.content_length();
+        LOG_DEBUG << "Content-Length: " << conn.server_body_len;
+    } else if (request.framing == HttpParser::Framing::Chunked) {
+        LOG_DEBUG << "Transfer-Encoding: chunked";
+    } else if (request.framing == HttpParser::Framing::UntilClose) {
+        LOG_DEBUG << "---No Content-Length header, reading until close---";
     }
-    msg[size] = '\0';
+    conn.server_header_len = parser.head_length();
+    conn.server_keep_alive = parser.keep_alive();
+    conn.server_content_type = string(parser.content_type());
+    return 0;
+}
 
-    return string(msg, size);
+void MiProxy::run() {
+    // every socket is registered with the event loop once, and each
+    // readiness event is dispatched straight to that socket's handler
+    LOG_DEBUG << "Waiting for activity on sockets...";
+    loop.run();
 }
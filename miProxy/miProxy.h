@@ -2,50 +2,157 @@
 #define MIPROXY_H
 
 #include <netinet/in.h>
-#include <sys/select.h>
 #include <sys/socket.h>
-#include <sys/time.h>  //FD_SET, FD_ISSET, FD_ZERO, FD_SETSIZE macros
 #include <sys/types.h>
 #include <unistd.h>  //close
 
 #include <chrono>
 #include <iostream>
-#include <fstream>
+#include <deque>
 #include <map>
 #include <vector>
 
-#include "DNSHeader.h"
-#include "DNSQuestion.h"
-#include "DNSRecord.h"
+#include "Abr.h"
+#include "AdminServer.h"
+#include "BufferPool.h"
+#include "ChunkedDecoder.h"
+#include "DiskCache.h"
+#include "DnsResolver.h"
+#include "EventLoop.h"
+#include "FdTable.h"
+#include "FragmentCache.h"
+#include "HttpParser.h"
+#include "Logger.h"
+#include "ManifestCache.h"
+#include "Metrics.h"
+#include "OriginFetcher.h"
+#include "OriginPool.h"
+#include "OutputQueue.h"
+#include "RingBuffer.h"
+#include "TcpInfo.h"
+#include "ThroughputEstimator.h"
 
 using namespace std;
 using namespace std::chrono;
 
-struct Connection {
-    string client_message;
-    string server_message;
-    int client_socket;
-    int server_socket;
-    size_t server_message_len;
-    time_point<chrono::steady_clock> server_conn_start;
-    double current_throughput;
+// Identifies a browser connection, see FdTable.
+using ClientId = uint64_t;
+
+// A request from the client on its way to the server and back.
+struct Request {
+    string message;
+    string no_list_message;  // set for the manifest, sent once it is answered
+    string chunkname;  // empty unless it asks for a fragment
+    string uri;  // of a fragment (rewritten) or manifest, part of the cache keys
+    size_t uri_offset = 0;  // of uri in message
+    bool deferred = false;  // a fragment asked for before the manifest was parsed, rewritten when sent
+    FragmentCache::EntryPtr cached;  // answered from the cache, never sent; or the rest of an attached response
+    DiskCache::Location on_disk;  // answered from the disk cache, never sent
+    bool waiting = false;  // waiting for the manifest fetches, a prefetch or a flight
+    bool fetched = false;  // cached is the result of those fetches
+    bool leading = false;  // its response is shared with identical requests
+    bool coalesced = false;  // waiting for the response to an identical request
+    bool attached = false;  // coalesced, and that response is being streamed to it
+    size_t streamed = 0;  // body bytes of that response queued for the client so far
+    int bitrate = 0;  // chosen for the fragment, in kbps
+    bool head = false;  // HEAD request, the response has no body
+    time_point<chrono::steady_clock> sent;
+    time_point<chrono::steady_clock> first_byte;  // of the response
+    bool pipelined = false;  // sent while responses to others were outstanding
+    HttpParser::Framing framing = HttpParser::Framing::None;  // of the response
+};
+
+// A fragment fetched before the player asked for it.
+struct Prefetch {
+    OriginFetcher::FetchId fetch = 0;  // 0 once it arrived
+    FragmentCache::EntryPtr entry;
+    FragmentTiming timing;  // of its fetch, logged once it is served
+    bool awaited = false;  // a request is waiting for it
+};
+
+// A fragment on its way from the origin, asked for by more than one session.
+struct Flight {
+    ClientId leader = 0;  // the connection whose request was sent
+    vector<ClientId> followers;  // connections with coalesced requests
+    vector<ClientId> streams;  // followers being sent the body as it arrives
+    bool ok = false;  // the response is a fragment that can be shared
+    bool streaming = false;  // its length is known, so it can be streamed
+    string content_type;
+    size_t length = 0;
+};
+
+// What the proxy knows of one browser, by its ip. A browser may open several
+// connections, they all share its server and its throughput and bitrate
+// state.
+struct Session {
+    string client_ip;
+    vector<ClientId> connections;  // open ones
+    string www_ip;  // its web server, empty while resolving
+    bool resolving = false;  // www_ip is being looked up, requests wait in client_message
+    unique_ptr<ThroughputEstimator> estimator;
+    double current_throughput = 0;  // its estimate, in kbps
+    AbrSession abr;  // what the bitrate strategy knows of the session
     vector<int> available_bitrates;  // in kbps
-    string no_list_message;
-    string chunkname;
+    vector<Counter *> bitrate_counters;  // the worker's bitrates metric of each
+    int current_bitrate = 0;
+};
+
+// The part of a Connection that only some requests or options touch. It is
+// allocated on its own, so that what every read and write of a fragment
+// uses fits in fewer cache lines.
+struct ConnectionCold {
+    string server_flight;  // key of the flight the current response feeds, if any
+    EventLoop::TimerId connect_timer;
+    map<string, Prefetch> prefetches;  // by rewritten request-uri
+    TcpInfo client_tcp;  // latest TCP_INFO readings of the sockets, with --tcp-info
+    TcpInfo server_tcp;
+    double peak_delivery_rate;  // kbps, highest client_tcp reading during the current response
+    time_point<chrono::steady_clock> tcp_sampled;  // when they were taken
     string server_ip;
     int server_port;
-    string client_ip; // also used as key in clients map
-    int current_bitrate;
-    string www_ip;
+    string client_ip;
+    int client_port;
 };
 
-class MiProxy {
-   public:
-    void get_options(int argc, char *argv[]);
-    void init();
-    void run();
+// One connection from a browser, and the server connection its requests go
+// out on.
+struct Connection {
+    ClientId id;
+    Session *session;
+    string client_message;  // the start of a request split over reads, or requests waiting for the nameserver
+    string server_message;  // response header, plus the body when buffering
+    RingBuffer client_in;  // bytes read from the sockets, not handled yet
+    RingBuffer server_in;
+    OutputQueue client_out;  // bytes the sockets did not take yet
+    OutputQueue server_out;
+    bool client_failed;  // writing to the client failed, it is being closed
+    bool server_paused;  // server reads wait for client_out to drain
+    HttpParser request_parser{HttpParser::Request};
+    HttpParser response_parser{HttpParser::Response};
+    string server_content_type;  // of the current response
+    int client_socket;
+    int server_socket;
+    size_t server_header_len;  // 0 until the header is parsed
+    size_t server_body_len;  // for Content-Length framing
+    size_t server_body_received;  // body bytes read so far, still encoded
+    size_t server_received;  // bytes of the current response read so far
+    ChunkedDecoder chunk_decoder;
+    bool server_streaming;  // body is relayed to the client as it arrives
+    bool server_splicing;  // body is moved to the client with splice()
+    bool server_caching;  // body is kept in cache_body for the fragment cache
+    string cache_body;  // decoded body of the current response
+    int relay_pipe[2];  // pipe used by splice(), created on first use
+    size_t relay_pipe_bytes;  // spliced from the server, not yet to the client
+    bool server_connecting;  // connect() to the server is still in progress
+    deque<Request> pending_requests;  // requests waiting for the server socket
+    deque<Request> sent_requests;  // requests sent and not answered yet, oldest first
+    bool server_reused;  // server socket already carried a keep-alive response
+    bool server_keep_alive;  // server socket may carry another request
+    bool waiting_for_server;  // queued in the pool for a server socket
+    unique_ptr<ConnectionCold> cold{new ConnectionCold()};
+};
 
-   private:
+struct Options {
     bool dns_mode;
     int listen_port;
     string default_www_ip;
@@ -53,34 +160,139 @@ class MiProxy {
     int dns_port;
     float alpha;
     string log_path;
+    int workers = 1;           // number of event loops, each on its own thread
+    bool pin_workers = false;  // pin worker i to cpu i
+    bool splice_relay = false;  // relay fragment bodies with splice()
+    int connect_timeout_ms = 3000;  // give up on a server connect after this
+    size_t pool_max_idle = 8;  // idle keep-alive connections per server
+    size_t pool_max = 32;  // connections per server, 0 for no limit
+    int pool_idle_timeout_ms = 15000;  // close keep-alive connections idle this long
+    size_t read_buffer_size = 64 * 1024;  // per connection and direction, while busy
+    size_t high_water = 512 * 1024;  // pause server reads with this much queued for a client
+    size_t cache_size = 0;  // bytes of fragments cached in memory, 0 to disable
+    int manifest_ttl_ms = 60000;  // keep manifests without a max-age this long, 0 to disable
+    size_t prefetch = 0;  // fragments fetched ahead per session, 0 to disable
+    size_t prefetch_max = 16;  // prefetches in flight per worker
+    bool coalesce = false;  // send identical fragment requests to the origin once
+    string abr = "rate";  // bitrate strategy: rate, buffer or mpc
+    double fragment_duration = 2;  // seconds of video per fragment, for the buffer estimate
+    string estimator = "ewma";  // throughput estimator: ewma, harmonic, dual, bytes or tcp
+    size_t estimator_window = 5;  // samples kept by the harmonic and bytes estimators
+    bool tcp_info = false;  // sample TCP_INFO of the sockets during fragment transfers
+    int dns_ttl_ms = 0;  // keep answers without a TTL this long, 0 to look up every session
+    string disk_cache_dir;  // second cache tier, disabled if empty
+    size_t disk_cache_size = 1024 * 1024 * 1024;
+    bool log_binary = false;  // write the log as records for logdecode instead of text
+    LogLevel log_level = LogLevel::Debug;  // of the output, levels not compiled in are never shown
+    int admin_port = 0;  // serve /metrics on this port, 0 to disable
+};
 
-    fd_set readfds;
-    map<string, Connection> clients;  // <client_ip, Connection>
+// The two manifests of a video being fetched for the manifest cache.
+struct ManifestFetch {
+    OriginFetcher::Response manifest;
+    OriginFetcher::Response no_list;
+    int remaining = 2;
+    vector<ClientId> clients;  // connections waiting for them
+};
+
+class MiProxy {
+   public:
+    MiProxy(const Options &opts, FragmentCache &cache, DiskCache &disk_cache, ManifestCache &manifests,
+            Metrics &metrics, int worker_id = 0);
+    static Options get_options(int argc, char *argv[]);
+    void init();
+    void run();
+
+   private:
+    const Options opts;
+    const int worker_id;
+
+    EventLoop loop;
+    OriginPool pool;  // keep-alive connections to the servers
+    BufferPool buffers;  // memory for the connections' read buffers
+    FragmentCache &cache;  // shared with the other workers
+    DiskCache &disk_cache;  // behind cache, also shared
+    ManifestCache &manifests;  // also shared
+    Metrics &metrics;  // every worker's, for /metrics
+    WorkerMetrics &stats;  // this worker's part of them
+    AdminServer admin;  // the admin port, if there is one
+    OriginFetcher fetcher;  // requests the proxy makes on its own
+    DnsResolver resolver;  // finds the server of each session in --dns mode
+    unique_ptr<AbrStrategy> abr;  // picks the bitrates
+    map<string, ManifestFetch> manifest_fetches;  // in flight, by manifest cache key
+    size_t prefetches_in_flight;
+    map<string, Flight> flights;  // fragments being fetched, by cache key
+    FdTable<Connection> clients;  // by client socket
+    map<string, Session> sessions;  // by client ip
     int master_socket;
-    ofstream log;
-    int dns_socket;
+    EventLoop::TimerId accept_timer;  // set while accept waits for a free fd
+    Logger::Sink log;
 
     void init_master_socket();
     void handle_master_connection();
     void handle_client_connection(Connection &conn);
-    void handle_request_message(Connection &conn);
+    bool handle_client_requests(Connection &conn);
+    void save_client_input(Connection &conn);
+    void handle_resolved(const string &client_ip, const string &www_ip);
+    Session &open_session(const string &client_ip, ClientId id);
+    void close_client_connection(Connection &conn);
+    void handle_client_writable(Connection &conn);
+    void send_client(Connection &conn, const char *data, size_t len);
+    void send_client(Connection &conn, const string &data);
+    void send_client_file(Connection &conn, const DiskCache::Location &location);
+    void flush_client(Connection &conn);
+    void fail_client(Connection &conn);
+    void close_client_later(Connection &conn);
+    void pause_server(Connection &conn);
+    void send_server(Connection &conn, const string &data);
+    void flush_server(Connection &conn);
+    void handle_request_message(Connection &conn, string request);
+    void dispatch_requests(Connection &conn);
+    void find_manifest(Connection &conn, Request &request);
+    void handle_manifest_fetch(const string &key);
+    void use_prefetch(Connection &conn, Request &request);
+    void fragment_served(Connection &conn, const Request &request);
+    void prefetch_next(Connection &conn, const Request &request);
+    void handle_prefetch(ClientId id, const Request &request, OriginFetcher::Response &response);
+    void cancel_prefetches(Connection &conn);
+    void coalesce_request(Connection &conn, Request &request);
+    void start_flight(Connection &conn, const Request &request);
+    void attach_follower(Connection &conn);
+    bool stream_to_follower(Connection &conn);
+    void finish_flight(const string &key, const FragmentCache::EntryPtr &entry);
+    void leave_flights(Connection &conn, deque<Request> &requests, bool promote);
+    void abandon_flight(const string &key, bool promote);
+    void acquire_server(Connection &conn);
+    void release_server(Connection &conn);
+    void watch_server_socket(Connection &conn, uint32_t events);
+    void connect_server(Connection &conn);
+    void handle_server_connect(Connection &conn, uint32_t events);
+    void send_pending_requests(Connection &conn);
+    void serve_cached_requests(Connection &conn);
+    void fail_pending_requests(Connection &conn, const string &status);
     void handle_server_connection(Connection &conn);
+    void handle_server_disconnect(Connection &conn, bool clean = false);
+    void close_server_connection(Connection &conn);
+    void reset_server_message(Connection &conn);
+    bool splice_server_message(Connection &conn);
+    bool handle_server_data(Connection &conn, const char *data, size_t len);
+    int relay_server_body(Connection &conn, const char *data, size_t len, size_t &consumed);
+    void send_server_header(Connection &conn);
     void handle_response_message(Connection &conn);
-    int parse_header(Connection &conn);
-    void parse_xml(Connection &conn);
-    void parse_bitrate(Connection &conn);
-    void update_throughput(Connection &conn);
-    
-    void init_dns_socket();
-    string request_dns();
-    void handle_dns_request();
-    string handle_dns_response();
-    string make_dns_Header();
-    string make_dns_Question();
-
-    string receive_all(int connectionfd, uint32_t size);
-
-
+    void finish_server_request(Connection &conn, bool keep_alive);
+    bool is_cacheable(Connection &conn, const Request &request);
+    int parse_header(Connection &conn, const char *data, size_t len);
+    bool parse_xml(Connection &conn);
+    static vector<int> parse_bitrates(const string &manifest);
+    void set_bitrates(Connection &conn, const vector<int> &bitrates);
+    void parse_bitrate(Connection &conn, Request &request);
+    void rewrite_bitrate(Connection &conn, Request &request);
+    int choose_bitrate(const Connection &conn) const;
+    void sample_tcp_info(Connection &conn, bool now);
+    void update_throughput(Connection &conn, const Request &request);
+    void record_throughput(Connection &conn, const string &server_ip, const FragmentTiming &timing);
+    void log_fragment(Connection &conn, const Request &request, const string &server_ip,
+                      const FragmentTiming &timing);
 };
 
 #endif
@@ -0,0 +1,96 @@
+// Unit checks for ChunkedDecoder: make test_chunked_decoder && ./test_chunked_decoder
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <string>
+
+#include "ChunkedDecoder.h"
+
+using namespace std;
+
+static const string BODY = "5\r\nhello\r\n7;ext=1\r\n, world\r\n0\r\n\r\n";
+
+static void test_whole() {
+    ChunkedDecoder decoder;
+    string body;
+    size_t consumed = 0;
+    assert(decoder.decode(BODY.data(), BODY.size(), consumed, &body) == ChunkedDecoder::Status::Complete);
+    assert(consumed == BODY.size());
+    assert(body == "hello, world");
+    assert(decoder.body_length() == 12);
+}
+
+// every split of the body decodes the same, one byte at a time included
+static void test_splits() {
+    for (size_t split = 1; split <= BODY.size(); ++split) {
+        ChunkedDecoder decoder;
+        string body;
+        size_t total = 0;
+        ChunkedDecoder::Status status = ChunkedDecoder::Status::Incomplete;
+        for (size_t pos = 0; pos < BODY.size(); pos += split) {
+            size_t consumed = 0;
+            size_t len = min(split, BODY.size() - pos);
+            status = decoder.decode(BODY.data() + pos, len, consumed, &body);
+            assert(consumed == len);
+            total += consumed;
+        }
+        assert(status == ChunkedDecoder::Status::Complete);
+        assert(total == BODY.size());
+        assert(body == "hello, world");
+    }
+}
+
+// the bytes after the last chunk are the next response
+static void test_stops_at_end() {
+    string buf = BODY + "HTTP/1.1 200 OK\r\n";
+    ChunkedDecoder decoder;
+    size_t consumed = 0;
+    assert(decoder.decode(buf.data(), buf.size(), consumed, nullptr) == ChunkedDecoder::Status::Complete);
+    assert(consumed == BODY.size());
+    assert(decoder.body_length() == 12);
+}
+
+static void test_trailers() {
+    string buf = "3\r\nabc\r\n0\r\nExpires: never\r\nX-Check: 1\r\n\r\n";
+    ChunkedDecoder decoder;
+    string body;
+    size_t consumed = 0;
+    assert(decoder.decode(buf.data(), buf.size(), consumed, &body) == ChunkedDecoder::Status::Complete);
+    assert(consumed == buf.size());
+    assert(body == "abc");
+
+    // bare LFs are tolerated
+    string lf = "3\nabc\n0\n\n";
+    decoder.reset();
+    body.clear();
+    assert(decoder.decode(lf.data(), lf.size(), consumed, &body) == ChunkedDecoder::Status::Complete);
+    assert(consumed == lf.size());
+    assert(body == "abc");
+}
+
+static void test_malformed() {
+    const char *bodies[] = {
+        "x\r\n",                      // not hex
+        "\r\n",                       // no size
+        "3\r\nabcd\r\n",              // data longer than its size
+        "3\rx",                       // CR without LF
+        "fffffffffffffffff\r\n",      // size overflows
+    };
+    for (const char *text : bodies) {
+        string buf = text;
+        ChunkedDecoder decoder;
+        size_t consumed = 0;
+        assert(decoder.decode(buf.data(), buf.size(), consumed, nullptr) == ChunkedDecoder::Status::Error);
+    }
+}
+
+int main() {
+    test_whole();
+    test_splits();
+    test_stops_at_end();
+    test_trailers();
+    test_malformed();
+    cout << "test_chunked_decoder: all tests passed" << endl;
+    return 0;
+}
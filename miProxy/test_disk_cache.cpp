@@ -0,0 +1,166 @@
+// Unit checks for DiskCache: make test_disk_cache && ./test_disk_cache
+// Runs in a fresh directory under /tmp, removed at the end.
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <iostream>
+#include <string>
+
+#include "DiskCache.h"
+#include "Logger.h"
+
+using namespace std;
+
+const static size_t MB = 1024 * 1024;
+const static size_t BODY_SIZE = 300 * 1024;  // three to a 1 MB segment
+
+static string body(int i) {
+    return string(BODY_SIZE, static_cast<char>('a' + i % 26));
+}
+
+static string key(int i) {
+    return "127.0.0.1 /vod/10Seg1-Frag" + to_string(i);
+}
+
+// the body a hit points at, read back from its segment
+static string read(const DiskCache::Location &location) {
+    string data(location.length, '\0');
+    ssize_t n = pread(location.segment->fd, &data[0], data.size(), location.offset);
+    assert(n == static_cast<ssize_t>(data.size()));
+    return data;
+}
+
+static void remove_dir(const string &dir) {
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) {
+        return;
+    }
+    while (struct dirent *ent = readdir(d)) {
+        string name = ent->d_name;
+        if (name != "." && name != "..") {
+            unlink((dir + "/" + name).c_str());
+        }
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+static string make_dir() {
+    char dir[] = "/tmp/test_disk_cache.XXXXXX";
+    assert(mkdtemp(dir) != nullptr);
+    return dir;
+}
+
+static void test_disabled() {
+    DiskCache cache("", 4 * MB);
+    assert(!cache.enabled());
+    assert(cache.max_entry_size() == 0);
+    cache.load();
+    cache.insert(key(0), "video/f4f", body(0));
+    assert(!cache.contains(key(0)));
+}
+
+static void test_find() {
+    string dir = make_dir();
+    {
+        DiskCache cache(dir, 4 * MB);
+        cache.load();
+        assert(cache.max_entry_size() == MB);
+        assert(!cache.find(key(0)).segment);
+        cache.insert(key(0), "video/f4f", body(0));
+        cache.insert(key(1), "video/f4f", body(1));
+        DiskCache::Location location = cache.find(key(1));
+        assert(location.segment);
+        assert(location.offset == static_cast<off_t>(BODY_SIZE));
+        assert(location.content_type == "video/f4f");
+        assert(read(location) == body(1));
+        // a body bigger than a segment, or a content type that would break
+        // the index, is not cached
+        cache.insert("big", "video/f4f", string(MB + 1, 'x'));
+        cache.insert("tab", "video/f4f\tx", "x");
+        assert(!cache.contains("big") && !cache.contains("tab"));
+        DiskCache::Stats stats = cache.stats();
+        assert(stats.hits == 1 && stats.misses == 1 && stats.insertions == 2);
+        assert(stats.entries == 2 && stats.bytes == 2 * BODY_SIZE && stats.segments == 1);
+    }
+    remove_dir(dir);
+}
+
+// whole segments are dropped, oldest first, and a hit being sent keeps its
+// segment readable
+static void test_eviction() {
+    string dir = make_dir();
+    {
+        DiskCache cache(dir, 4 * MB);
+        cache.load();
+        for (int i = 0; i < 13; ++i) {
+            cache.insert(key(i), "video/f4f", body(i));
+        }
+        // five segments, the last one with a single body
+        assert(cache.stats().segments == 5 && cache.stats().entries == 13);
+        DiskCache::Location held = cache.find(key(1));
+
+        // the 14th body takes the cache over 4 MB
+        cache.insert(key(13), "video/f4f", body(13));
+        DiskCache::Stats stats = cache.stats();
+        assert(stats.segments == 4);
+        assert(stats.entries == 11);
+        assert(stats.bytes == 11 * BODY_SIZE);
+        for (int i = 0; i < 3; ++i) {
+            assert(!cache.contains(key(i)));
+        }
+        for (int i = 3; i < 14; ++i) {
+            assert(read(cache.find(key(i))) == body(i));
+        }
+        assert(access((dir + "/segment.0").c_str(), F_OK) < 0);
+        assert(read(held) == body(1));
+    }
+    remove_dir(dir);
+}
+
+// a restarted proxy finds the entries of the last run, newest copy first
+static void test_reload() {
+    string dir = make_dir();
+    {
+        DiskCache cache(dir, 4 * MB);
+        cache.load();
+        for (int i = 0; i < 14; ++i) {
+            cache.insert(key(i), "video/f4f", body(i));
+        }
+        cache.insert(key(5), "video/mp4", body(20));
+    }
+    {
+        DiskCache cache(dir, 4 * MB);
+        cache.load();
+        DiskCache::Stats stats = cache.stats();
+        assert(stats.entries == 11);
+        assert(stats.segments == 4);
+        assert(!cache.contains(key(2)));
+        DiskCache::Location location = cache.find(key(5));
+        assert(location.content_type == "video/mp4");
+        assert(read(location) == body(20));
+        assert(read(cache.find(key(13))) == body(13));
+    }
+    {
+        // a smaller cache evicts what no longer fits as it loads
+        DiskCache cache(dir, 2 * MB);
+        cache.load();
+        assert(cache.stats().bytes <= 2 * MB);
+        assert(cache.contains(key(13)));
+        assert(!cache.contains(key(3)));
+    }
+    remove_dir(dir);
+}
+
+int main() {
+    Logger::get().set_level(LogLevel::Warn);
+    test_disabled();
+    test_find();
+    test_eviction();
+    test_reload();
+    cout << "test_disk_cache: all tests passed" << endl;
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Unit checks for the throughput estimators: make test_estimators && ./test_estimators
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "ThroughputEstimator.h"
+
+using namespace std;
+
+// a fragment of bytes that took seconds from request to last byte
+static FragmentTiming timing(size_t bytes, double seconds) {
+    FragmentTiming timing;
+    timing.sent = FragmentTiming::Clock::now();
+    auto duration = chrono::duration_cast<FragmentTiming::Clock::duration>(chrono::duration<double>(seconds));
+    timing.first_byte = timing.sent + duration / 10;
+    timing.last_byte = timing.sent + duration;
+    timing.bytes = bytes;
+    return timing;
+}
+
+// bytes / seconds * 8 / 1000
+static FragmentTiming kbps(double rate, double seconds = 1) {
+    return timing((size_t)(rate * seconds * 125), seconds);
+}
+
+static bool near(double a, double b) {
+    return fabs(a - b) < 0.01;
+}
+
+static void test_create() {
+    const char *names[] = {"ewma", "harmonic", "dual", "bytes", "tcp"};
+    for (const char *name : names) {
+        assert(string(ThroughputEstimator::create(name, 0.5, 5)->name()) == name);
+    }
+    bool threw = false;
+    try {
+        ThroughputEstimator::create("median", 0.5, 5);
+    } catch (const runtime_error &) {
+        threw = true;
+    }
+    assert(threw);
+}
+
+static void test_timing() {
+    FragmentTiming t = timing(250000, 2);
+    assert(near(t.seconds(), 2));
+    assert(near(t.latency(), 0.2));
+    assert(near(t.kbps(), 1000));
+}
+
+// the estimate starts from the seed the manifest gives, not from 0
+static void test_ewma() {
+    EwmaEstimator ewma(0.5);
+    assert(ewma.estimate() == 0);
+    ewma.seed(150);
+    assert(ewma.estimate() == 150);
+    ewma.add(kbps(1000));
+    assert(near(ewma.estimate(), 575));
+    ewma.add(kbps(1000));
+    assert(near(ewma.estimate(), 787.5));
+
+    EwmaEstimator unseeded(0.25);
+    unseeded.add(kbps(1000));
+    assert(near(unseeded.estimate(), 250));
+}
+
+static void test_harmonic() {
+    HarmonicEstimator harmonic(3);
+    harmonic.seed(9999);  // averaged estimators have no use for it
+    assert(harmonic.estimate() == 0);
+    harmonic.add(kbps(1000));
+    assert(near(harmonic.estimate(), 1000));
+    harmonic.add(kbps(500));
+    harmonic.add(kbps(250));
+    assert(near(harmonic.estimate(), 3 / (1 / 1000.0 + 1 / 500.0 + 1 / 250.0)));
+    // the oldest sample leaves the window
+    harmonic.add(kbps(2000));
+    assert(near(harmonic.estimate(), 3 / (1 / 500.0 + 1 / 250.0 + 1 / 2000.0)));
+}
+
+static void test_dual() {
+    DualEwmaEstimator dual;
+    assert(dual.estimate() == 0);
+    // the bias toward the initial 0 is corrected
+    dual.add(kbps(1000));
+    assert(near(dual.estimate(), 1000));
+    dual.add(kbps(100));
+    // a drop is followed by the fast average
+    double fast = (exp2(-0.5) * (1 - exp2(-0.5)) * 1000 + (1 - exp2(-0.5)) * 100) / (1 - exp2(-1.0));
+    double slow = (exp2(-0.2) * (1 - exp2(-0.2)) * 1000 + (1 - exp2(-0.2)) * 100) / (1 - exp2(-0.4));
+    assert(fast < slow);
+    assert(near(dual.estimate(), fast));
+    // and a rise by the slow one
+    dual.add(kbps(5000));
+    assert(dual.estimate() < 5000);
+    assert(dual.estimate() > 100);
+}
+
+static void test_bytes() {
+    ByteWeightedEstimator bytes(2);
+    assert(bytes.estimate() == 0);
+    bytes.add(timing(125000, 1));  // 1000 kbps
+    bytes.add(timing(12500, 1));   // 100 kbps, a tenth of the weight
+    assert(near(bytes.estimate(), (125000 * 1000.0 + 12500 * 100.0) / 137500));
+    bytes.add(timing(12500, 1));
+    assert(near(bytes.estimate(), 100));
+}
+
+// the higher of the measured throughput and the kernel's delivery rate
+static void test_tcp() {
+    TcpRateEstimator tcp(0.5);
+    tcp.seed(150);
+    assert(tcp.estimate() == 150);
+    FragmentTiming short_fragment = kbps(200, 0.05);
+    short_fragment.delivery_rate = 1000;
+    tcp.add(short_fragment);
+    assert(near(tcp.estimate(), 575));
+    FragmentTiming app_limited = kbps(1000);
+    app_limited.delivery_rate = 400;
+    tcp.add(app_limited);
+    assert(near(tcp.estimate(), 787.5));
+    tcp.add(kbps(1000));  // no reading, delivery_rate 0
+    assert(near(tcp.estimate(), 893.75));
+}
+
+int main() {
+    test_create();
+    test_timing();
+    test_ewma();
+    test_harmonic();
+    test_dual();
+    test_bytes();
+    test_tcp();
+    cout << "test_estimators: all tests passed" << endl;
+    return 0;
+}
@@ -0,0 +1,103 @@
+// Unit checks for FragmentCache: make test_fragment_cache && ./test_fragment_cache
+
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "FragmentCache.h"
+
+using namespace std;
+
+static FragmentCache::EntryPtr entry(size_t size, char fill = 'x') {
+    return make_shared<const FragmentCache::Entry>(FragmentCache::Entry{"video/f4f", string(size, fill)});
+}
+
+static void test_disabled() {
+    FragmentCache cache(0);
+    assert(!cache.enabled());
+    assert(cache.max_entry_size() == 0);
+    cache.insert("a", entry(1));
+    assert(!cache.contains("a"));
+    assert(cache.stats().entries == 0);
+}
+
+static void test_find() {
+    FragmentCache cache(800);
+    assert(cache.find("a") == nullptr);
+    cache.insert("a", entry(100, 'a'));
+    assert(cache.contains("a"));
+    FragmentCache::EntryPtr found = cache.find("a");
+    assert(found && found->body == string(100, 'a') && found->content_type == "video/f4f");
+    // contains() is not a lookup
+    FragmentCache::Stats stats = cache.stats();
+    assert(stats.hits == 1 && stats.misses == 1 && stats.insertions == 1);
+    assert(stats.entries == 1 && stats.bytes == 100);
+}
+
+// a body may take an eighth of the cache at most
+static void test_max_entry_size() {
+    FragmentCache cache(800);
+    assert(cache.max_entry_size() == 100);
+    cache.insert("big", entry(101));
+    assert(!cache.contains("big"));
+    cache.insert("fits", entry(100));
+    assert(cache.contains("fits"));
+}
+
+// the least recently used entries go first, find() counts as a use
+static void test_lru_eviction() {
+    FragmentCache cache(800);
+    const string keys = "abcdefgh";
+    for (char key : keys) {
+        cache.insert(string(1, key), entry(100, key));
+    }
+    assert(cache.stats().entries == 8 && cache.stats().bytes == 800 && cache.stats().evictions == 0);
+    assert(cache.find("a"));
+    cache.insert("i", entry(100, 'i'));
+    assert(cache.contains("a"));
+    assert(!cache.contains("b"));
+    assert(cache.contains("i"));
+    // several old entries make room for a big one
+    cache.insert("j", entry(60));
+    cache.insert("k", entry(100));
+    assert(!cache.contains("c"));
+    assert(!cache.contains("d"));
+    assert(cache.contains("e"));
+    FragmentCache::Stats stats = cache.stats();
+    assert(stats.evictions == 3);
+    assert(stats.entries == 8);
+    assert(stats.bytes == 760);
+}
+
+static void test_replace() {
+    FragmentCache cache(800);
+    cache.insert("a", entry(100, '1'));
+    cache.insert("a", entry(50, '2'));
+    assert(cache.find("a")->body == string(50, '2'));
+    FragmentCache::Stats stats = cache.stats();
+    assert(stats.entries == 1 && stats.bytes == 50 && stats.insertions == 2);
+}
+
+// an entry being served outlives its eviction
+static void test_evicted_entry_stays_valid() {
+    FragmentCache cache(800);
+    cache.insert("a", entry(100, 'a'));
+    FragmentCache::EntryPtr held = cache.find("a");
+    for (int i = 0; i < 8; ++i) {
+        cache.insert(to_string(i), entry(100));
+    }
+    assert(!cache.contains("a"));
+    assert(held->body == string(100, 'a'));
+}
+
+int main() {
+    test_disabled();
+    test_find();
+    test_max_entry_size();
+    test_lru_eviction();
+    test_replace();
+    test_evicted_entry_stays_valid();
+    cout << "test_fragment_cache: all tests passed" << endl;
+    return 0;
+}
@@ -0,0 +1,128 @@
+// Unit checks for HttpParser: make test_http_parser && ./test_http_parser
+
+#include <cassert>
+#include <iostream>
+#include <string>
+
+#include "HttpParser.h"
+
+using namespace std;
+
+static void test_request() {
+    string buf = "GET /vod/1000Seg1-Frag2 HTTP/1.1\r\nHost: video.cse.umich.edu\r\nAccept: */*\r\n\r\n";
+    HttpParser parser(HttpParser::Request);
+    assert(parser.parse(buf.data(), buf.size()) == HttpParser::Status::Complete);
+    assert(parser.head_length() == buf.size());
+    assert(parser.method() == "GET");
+    assert(parser.uri() == "/vod/1000Seg1-Frag2");
+    assert(parser.uri_offset() == 4);
+    assert(parser.version() == "HTTP/1.1");
+    assert(parser.header("host") == "video.cse.umich.edu");
+    assert(parser.has_header("ACCEPT"));
+    assert(!parser.has_header("Content-Length"));
+    assert(parser.framing() == HttpParser::Framing::None);
+    assert(parser.keep_alive());
+}
+
+// the head arrives one byte at a time, in a buffer that moves as it grows
+static void test_split_head() {
+    string head = "HTTP/1.1 200 OK\r\nContent-Type: video/f4f\r\nContent-Length: 1234\r\n\r\n";
+    string buf;
+    HttpParser parser(HttpParser::Response);
+    for (size_t i = 0; i < head.size(); ++i) {
+        buf += head[i];
+        buf.shrink_to_fit();
+        HttpParser::Status status = parser.parse(buf.data(), buf.size());
+        assert(status == (i + 1 < head.size() ? HttpParser::Status::Incomplete : HttpParser::Status::Complete));
+    }
+    assert(parser.status_code() == 200);
+    assert(parser.content_type() == "video/f4f");
+    assert(parser.framing() == HttpParser::Framing::ContentLength);
+    assert(parser.content_length() == 1234);
+}
+
+// bytes after the head belong to the body, or to the next message
+static void test_pipelined() {
+    string buf = "GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\n";
+    HttpParser parser(HttpParser::Request);
+    assert(parser.parse(buf.data(), buf.size()) == HttpParser::Status::Complete);
+    assert(parser.uri() == "/a");
+    size_t first = parser.head_length();
+    assert(first == 19);
+    parser.reset();
+    assert(parser.parse(buf.data() + first, buf.size() - first) == HttpParser::Status::Complete);
+    assert(parser.uri() == "/b");
+}
+
+static void test_framing() {
+    struct Case {
+        const char *head;
+        HttpParser::Framing framing;
+        bool keep_alive;
+    };
+    const Case cases[] = {
+        {"HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip, chunked\r\n\r\n", HttpParser::Framing::Chunked, true},
+        {"HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: close\r\n\r\n", HttpParser::Framing::ContentLength,
+         false},
+        {"HTTP/1.1 200 OK\r\n\r\n", HttpParser::Framing::UntilClose, false},
+        {"HTTP/1.1 204 No Content\r\nContent-Length: 5\r\n\r\n", HttpParser::Framing::None, true},
+        {"HTTP/1.1 304 Not Modified\r\n\r\n", HttpParser::Framing::None, true},
+        {"HTTP/1.0 200 OK\r\nContent-Length: 5\r\n\r\n", HttpParser::Framing::ContentLength, false},
+        {"HTTP/1.0 200 OK\r\nContent-Length: 5\r\nConnection: Keep-Alive\r\n\r\n",
+         HttpParser::Framing::ContentLength, true},
+    };
+    for (const Case &c : cases) {
+        string buf = c.head;
+        HttpParser parser(HttpParser::Response);
+        assert(parser.parse(buf.data(), buf.size()) == HttpParser::Status::Complete);
+        assert(parser.framing() == c.framing);
+        assert(parser.keep_alive() == c.keep_alive);
+    }
+}
+
+static void test_malformed() {
+    const char *heads[] = {
+        "GET /a\r\n\r\n",                                            // no version
+        "GET /a FTP/1.0\r\n\r\n",                                    // not HTTP
+        "GET /a HTTP/1.1\r\nHost : x\r\n\r\n",                       // space before the colon
+        "GET /a HTTP/1.1\r\nHost: x\r\n folded\r\n\r\n",             // obsolete line folding
+        "GET /a HTTP/1.1\r\nContent-Length: 12x\r\n\r\n",            // bad length
+        "GET /a HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n",        // cannot be delimited
+    };
+    for (const char *head : heads) {
+        string buf = head;
+        HttpParser parser(HttpParser::Request);
+        assert(parser.parse(buf.data(), buf.size()) == HttpParser::Status::Error);
+        // and it stays failed
+        assert(parser.parse(buf.data(), buf.size()) == HttpParser::Status::Error);
+    }
+
+    string status_line = "HTTP/1.1 2x0 OK\r\n\r\n";
+    HttpParser response(HttpParser::Response);
+    assert(response.parse(status_line.data(), status_line.size()) == HttpParser::Status::Error);
+
+    // a head that never ends is given up on
+    string endless = "GET /a HTTP/1.1\r\nX: " + string(70 * 1024, 'a');
+    HttpParser request(HttpParser::Request);
+    assert(request.parse(endless.data(), endless.size()) == HttpParser::Status::Error);
+}
+
+static void test_has_token() {
+    assert(HttpParser::has_token("keep-alive, Upgrade", "upgrade"));
+    assert(HttpParser::has_token(" chunked;q=1 ", "chunked"));
+    assert(!HttpParser::has_token("no-cache", "no-store"));
+    assert(!HttpParser::has_token("", "close"));
+    assert(HttpParser::iequals("Content-Type", "content-type"));
+    assert(!HttpParser::iequals("Content-Type", "Content-Typ"));
+}
+
+int main() {
+    test_request();
+    test_split_head();
+    test_pipelined();
+    test_framing();
+    test_malformed();
+    test_has_token();
+    cout << "test_http_parser: all tests passed" << endl;
+    return 0;
+}
@@ -10,13 +10,16 @@ static const int INT_SIZE = 4;
 static const int MAX_MESSAGE_SIZE = 256;
 
 int run_server(Info* info, RoundRobin* rr, Geography* geo, int queue_size = 10);
-void handle_connection(int connectionfd, ofstream& log, Info* info, RoundRobin* rr, Geography* geo, string clientIP);
+void handle_connection(int connectionfd, Logger::Sink log, Info* info, RoundRobin* rr, Geography* geo, string clientIP);
 void send_all(int connectionfd, const char *message, size_t size);
 string receive_all(int connectionfd, uint32_t size);
 void make_server_sockaddr(struct sockaddr_in *addr, int port);
 int get_port_number(int sockfd);
 
 int main(int argc, char **argv) {
+    // the log is written by a background thread, flush it on Ctrl-C
+    Logger::flush_on_termination();
+
     // Read Arguments
     Info info(argc, argv);
 
@@ -46,12 +49,15 @@ int main(int argc, char **argv) {
  */
 int run_server(Info* info, RoundRobin* rr, Geography* geo, int queue_size) {
     // Open Logfile
-    ofstream log(info->getLog());
-    if (!log.is_open()) {
+    Logger::Sink log = 0;
+    try {
+        log = Logger::get().open(info->getLog(), Logger::Format::Text);
+    } catch (std::runtime_error& e) {
         std::cerr << "Fail to Open Logfile " << info->getLog() << std::endl;
+        exit(1);
     }
 
-	std::cout << "Successfully opened " << info->getLog() << std::endl;
+	LOG_INFO << "Successfully opened " << info->getLog();
 
 	// Create socket
 	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -79,7 +85,7 @@ int run_server(Info* info, RoundRobin* rr, Geography* geo, int queue_size) {
 
 	// Detect which port was chosen.
 	int port = get_port_number(sockfd);
-	std::cout << "Server listening on port " << port << "..." << std::endl;
+	LOG_INFO << "Server listening on port " << port << "...";
 
 	// Begin listening for incoming connections.
 	listen(sockfd, queue_size);
@@ -100,11 +106,11 @@ int run_server(Info* info, RoundRobin* rr, Geography* geo, int queue_size) {
 			exit(1);
 		}
 		string ip = inet_ntoa(client_addr.sin_addr);
-		std::cout << "Server connected to client " << ip << "..." << std::endl;
+		LOG_DEBUG << "Server connected to client " << ip << "...";
 
 		handle_connection(connectionfd, log, info, rr, geo, ip);
 
-		std::cout << "Server finished serving client " << ip << "..." << std::endl;
+		LOG_DEBUG << "Server finished serving client " << ip << "...";
 	}
 
 	close(sockfd);
@@ -113,8 +119,8 @@ int run_server(Info* info, RoundRobin* rr, Geography* geo, int queue_size) {
 /**
  * Receives DNS Header and DNS Question, and Answers DNS Header and DNS Record.
  */
-void handle_connection(int connectionfd, ofstream& log, Info* info, RoundRobin* rr, Geography* geo, string clientIP) {
-	std::cout << "New connection " << connectionfd << std::endl;
+void handle_connection(int connectionfd, Logger::Sink log, Info* info, RoundRobin* rr, Geography* geo, string clientIP) {
+	LOG_DEBUG << "New connection " << connectionfd;
 
 	// Receive DNS Header Size
 	uint32_t headerSize;
@@ -128,8 +134,8 @@ void handle_connection(int connectionfd, ofstream& log, Info* info, RoundRobin*
 	// Receive DNS Header
 	DNSHeader header = DNSHeader::decode(receive_all(connectionfd, headerSize));
 
-	std::cout << "Successfully Received DNS Header with size " << headerSize << std::endl;
-	std::cout << DNSHeader::encode(header) << std::endl;
+	LOG_DEBUG << "Successfully Received DNS Header with size " << headerSize;
+	LOG_DEBUG << DNSHeader::encode(header);
 
 	// Receive DNS Question Size
 	uint32_t questionSize;
@@ -144,8 +150,8 @@ void handle_connection(int connectionfd, ofstream& log, Info* info, RoundRobin*
 	DNSQuestion question = DNSQuestion::decode(receive_all(connectionfd, questionSize));
 	string domain = question.QNAME;
 
-	std::cout << "Successfully Received DNS Question with size " << questionSize << std::endl;
-	std::cout << DNSQuestion::encode(question) << std::endl;
+	LOG_DEBUG << "Successfully Received DNS Question with size " << questionSize;
+	LOG_DEBUG << DNSQuestion::encode(question);
 
 	// Check QNAME is video.cse.umich.edu
 	if (domain != "video.cse.umich.edu") {
@@ -163,7 +169,7 @@ void handle_connection(int connectionfd, ofstream& log, Info* info, RoundRobin*
 		// Close connection
 		close(connectionfd);
 
-		std::cout << "Only supports video.cse.umich.edu" << std::endl;
+		LOG_WARN << "Only supports video.cse.umich.edu";
 		return;
 	}
 
@@ -186,17 +192,17 @@ void handle_connection(int connectionfd, ofstream& log, Info* info, RoundRobin*
 		// Close connection
 		close(connectionfd);
 
-		std::cout << "Cannot find ip for client " << clientIP << std::endl;
+		LOG_WARN << "Cannot find ip for client " << clientIP;
 		return;
 	}
 
-	std::cout << clientIP << " " << domain << " " << ip << std::endl;
+	LOG_DEBUG << clientIP << " " << domain << " " << ip;
 
 	// Edit DNS Header
 	header.AA = 1;
 	string responseHeader = DNSHeader::encode(header);
 
-	std::cout << "Successfully Encoded DNS Header " << responseHeader << std::endl;
+	LOG_DEBUG << "Successfully Encoded DNS Header " << responseHeader;
 
 	// Edit DNS Record
 	DNSRecord record;
@@ -208,7 +214,7 @@ void handle_connection(int connectionfd, ofstream& log, Info* info, RoundRobin*
 	record.RDLENGTH = static_cast<ushort>(ip.length());
 	string responseRecord = DNSRecord::encode(record);
 
-	std::cout << "Successfully Encoded DNS Record " << responseRecord << std::endl;
+	LOG_DEBUG << "Successfully Encoded DNS Record " << responseRecord;
 
 	// Send DNS Header Size
 	headerSize = htonl(static_cast<uint32_t>(responseHeader.length()));
@@ -217,12 +223,12 @@ void handle_connection(int connectionfd, ofstream& log, Info* info, RoundRobin*
 		exit(1);
 	}
 
-	std::cout << "Successfully Sent DNS Header Size " << responseHeader.length() << std::endl;
+	LOG_DEBUG << "Successfully Sent DNS Header Size " << responseHeader.length();
 
 	// Send DNS Header
 	send_all(connectionfd, responseHeader.c_str(), responseHeader.length());
 
-	std::cout << "Successfully Sent DNS Header" << std::endl;
+	LOG_DEBUG << "Successfully Sent DNS Header";
 
 	// Send DNS Record Size
 	uint32_t recordSize = htonl(static_cast<uint32_t>(responseRecord.length()));
@@ -231,18 +237,18 @@ void handle_connection(int connectionfd, ofstream& log, Info* info, RoundRobin*
 		exit(1);
 	}
 
-	std::cout << "Successfully Sent DNS Record Size " << responseRecord.length() << std::endl;
+	LOG_DEBUG << "Successfully Sent DNS Record Size " << responseRecord.length();
 
 	// Send DNS Record
 	send_all(connectionfd, responseRecord.c_str(), responseRecord.length());
 
-	std::cout << "Successfully Sent DNS Record" << std::endl;
+	LOG_DEBUG << "Successfully Sent DNS Record";
 
 	// Close connection
     close(connectionfd);
 
 	// Write Logfile
-	log << clientIP << " " << domain << " " << ip << std::endl;
+	LogLine(LogLevel::Info, log) << clientIP << " " << domain << " " << ip;
 }
 
 /**
@@ -251,7 +257,7 @@ void handle_connection(int connectionfd, ofstream& log, Info* info, RoundRobin*
 void send_all(int connectionfd, const char *message, size_t size) {
 	// Send message to remote server
 	// Call send() enough times to send all the data
-	std::cout << "Sending " << size << " bytes" << std::endl;
+	LOG_DEBUG << "Sending " << size << " bytes";
 	size_t sent = 0;
 	do {
 		ssize_t sval = send(connectionfd, message + sent, size - sent, 0);
@@ -259,7 +265,7 @@ void send_all(int connectionfd, const char *message, size_t size) {
 			perror("Error sending on stream socket");
 			exit(1);
 		}
-		std::cout << sval << " bytes sent " << size - sent << " bytes remaining" << std::endl;
+		LOG_DEBUG << sval << " bytes sent " << size - sent << " bytes remaining";
 		sent += sval;
 	} while (sent < size);
 }
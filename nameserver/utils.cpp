@@ -203,7 +203,7 @@ Geography::Geography(string filename) {
 
 string Geography::findServer(string clientIP) {
     uint32_t client = IP_UINT(clientIP);
-    std::cout << "Client uint32_t ip is " << client << std::endl;
+    LOG_DEBUG << "Client uint32_t ip is " << client;
     // Check ClientIP in network
     if (this->IPmap.find(client) == this->IPmap.end()) {
         std::cerr << "Fail to Find Client with IP " << clientIP << std::endl;
@@ -218,14 +218,14 @@ string Geography::findServer(string clientIP) {
     }
     // Check Cache for client
     if (this->cache.find(client) != this->cache.end()) {
-        std::cout << "Client IP Found in Cache" << std::endl;
+        LOG_DEBUG << "Client IP Found in Cache";
         return UINT_IP(this->cache[client]);
     }
     // Find Nearest Server from Client
     Neighbor current(origin, 0);
     map<int, int> distMap = {{origin, 0}};
     unordered_set<int> visited;
-    std::cout << "Start from " << client << std::endl;
+    LOG_DEBUG << "Start from " << client;
     // Traverse All Nodes
     while (!distMap.empty()) {
         int currentID = current.getId();
@@ -241,7 +241,7 @@ string Geography::findServer(string clientIP) {
         }
         
         // Mark Current Node Visited
-        std::cout << "Traverse to " << nodes[currentID].getIp() << "with distance " << current.getDistance() << std::endl;
+        LOG_DEBUG << "Traverse to " << nodes[currentID].getIp() << "with distance " << current.getDistance();
         visited.insert(currentID);
         // Remove Current Node from DistMap
         distMap.erase(currentID);
@@ -22,6 +22,7 @@
 #include "DNSHeader.h"
 #include "DNSQuestion.h"
 #include "DNSRecord.h"
+#include "Logger.h"
 
 using std::min;
 using std::map;